@@ -254,6 +254,12 @@ HEADERS += src/qt/bitbeangui.h \
     src/pbkdf2.h \
     src/serialize.h \
     src/main.h \
+    src/checkqueue.h \
+    src/blockcache.h \
+    src/blockfile.h \
+    src/blockcompress.h \
+    src/blockencodings.h \
+    src/memusage.h \
     src/miner.h \
     src/net.h \
     src/key.h \
@@ -380,6 +386,8 @@ SOURCES += src/qt/beancash.cpp \
     src/qt/rpcconsole.cpp \
     src/noui.cpp \
     src/kernel.cpp \
+    src/blockcompress.cpp \
+    src/blockencodings.cpp \
     src/pbkdf2.cpp \
     src/qt/intro.cpp \
     src/core.cpp
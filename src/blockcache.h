@@ -0,0 +1,96 @@
+// Copyright (c) 2015-2020 Bean Core www.beancash.org
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITBEAN_BLOCKCACHE_H
+#define BITBEAN_BLOCKCACHE_H
+
+#include "serialize.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <list>
+#include <map>
+
+/** Bounded LRU of recent blocks kept in network serialization, so the
+ * same block requested by many peers is read and serialized only once.
+ */
+class CBlockCache
+{
+private:
+    typedef std::list<std::pair<uint256, CDataStream> > list_type;
+
+    mutable CCriticalSection cs;
+    list_type lruBlocks; // most recently used first
+    std::map<uint256, list_type::iterator> mapBlocks;
+    size_t nBytes;
+    size_t nMaxBytes;
+    uint64_t nHits;
+    uint64_t nMisses;
+
+    void Trim()
+    {
+        while (nBytes > nMaxBytes && !lruBlocks.empty())
+        {
+            nBytes -= lruBlocks.back().second.size();
+            mapBlocks.erase(lruBlocks.back().first);
+            lruBlocks.pop_back();
+        }
+    }
+
+public:
+    CBlockCache(size_t nMaxBytesIn) : nBytes(0), nMaxBytes(nMaxBytesIn), nHits(0), nMisses(0) {}
+
+    void SetMaxSize(size_t nMaxBytesIn)
+    {
+        LOCK(cs);
+        nMaxBytes = nMaxBytesIn;
+        Trim();
+    }
+
+    /** Copy out the serialized block, counting a hit or a miss. */
+    bool Get(const uint256& hash, CDataStream& ssBlock)
+    {
+        LOCK(cs);
+        std::map<uint256, list_type::iterator>::iterator mi = mapBlocks.find(hash);
+        if (mi == mapBlocks.end())
+        {
+            nMisses++;
+            return false;
+        }
+        lruBlocks.splice(lruBlocks.begin(), lruBlocks, mi->second);
+        ssBlock = mi->second->second;
+        nHits++;
+        return true;
+    }
+
+    void Insert(const uint256& hash, const CDataStream& ssBlock)
+    {
+        LOCK(cs);
+        if (mapBlocks.count(hash) || ssBlock.size() > nMaxBytes)
+            return;
+        lruBlocks.push_front(std::make_pair(hash, ssBlock));
+        mapBlocks[hash] = lruBlocks.begin();
+        nBytes += ssBlock.size();
+        Trim();
+    }
+
+    template<typename T>
+    void Insert(const uint256& hash, const T& block)
+    {
+        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+        ssBlock << block;
+        Insert(hash, ssBlock);
+    }
+
+    void GetStats(size_t& nEntriesOut, size_t& nBytesOut, size_t& nMaxBytesOut, uint64_t& nHitsOut, uint64_t& nMissesOut) const
+    {
+        LOCK(cs);
+        nEntriesOut = mapBlocks.size();
+        nBytesOut = nBytes;
+        nMaxBytesOut = nMaxBytes;
+        nHitsOut = nHits;
+        nMissesOut = nMisses;
+    }
+};
+
+#endif
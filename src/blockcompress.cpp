@@ -0,0 +1,147 @@
+// Copyright (c) 2015-2020 Bean Core www.beancash.org
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcompress.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+// LZ4 block format: a sequence is a token (literal length << 4 | match
+// length - 4), the literals, a 2-byte little-endian match offset and the
+// match. Lengths of 15 or more continue in extra bytes. The last sequence
+// has literals only; the last 5 bytes are always literals and the last
+// match starts at least 12 bytes before the end.
+static const size_t MIN_MATCH = 4;
+static const size_t LAST_LITERALS = 5;
+static const size_t MATCH_FIND_LIMIT = 12;
+static const size_t MAX_OFFSET = 65535;
+static const int HASH_LOG = 12;
+
+static inline uint32_t Read32(const unsigned char* p)
+{
+    uint32_t n;
+    memcpy(&n, p, sizeof(n));
+    return n;
+}
+
+static inline uint32_t Hash32(uint32_t n)
+{
+    return (n * 2654435761U) >> (32 - HASH_LOG);
+}
+
+static void WriteLength(vector<unsigned char>& vchOut, size_t nLen)
+{
+    for (; nLen >= 255; nLen -= 255)
+        vchOut.push_back(255);
+    vchOut.push_back((unsigned char)nLen);
+}
+
+// nMatch == 0 writes the final, literals-only sequence
+static void WriteSequence(vector<unsigned char>& vchOut, const unsigned char* pchLiterals, size_t nLiterals, size_t nOffset, size_t nMatch)
+{
+    size_t nToken = vchOut.size();
+    vchOut.push_back((unsigned char)(min(nLiterals, (size_t)15) << 4));
+    if (nLiterals >= 15)
+        WriteLength(vchOut, nLiterals - 15);
+    vchOut.insert(vchOut.end(), pchLiterals, pchLiterals + nLiterals);
+    if (nMatch == 0)
+        return;
+
+    vchOut.push_back(nOffset & 0xff);
+    vchOut.push_back(nOffset >> 8);
+    nMatch -= MIN_MATCH;
+    vchOut[nToken] |= (unsigned char)min(nMatch, (size_t)15);
+    if (nMatch >= 15)
+        WriteLength(vchOut, nMatch - 15);
+}
+
+void CompressBlock(const unsigned char* pch, size_t nSize, vector<unsigned char>& vchOut)
+{
+    vchOut.clear();
+    vchOut.reserve(nSize + nSize / 255 + 16);
+
+    size_t nAnchor = 0;
+    if (nSize > MATCH_FIND_LIMIT)
+    {
+        vector<uint32_t> vTable(1 << HASH_LOG, 0);
+        const size_t nFindLimit = nSize - MATCH_FIND_LIMIT;
+        const size_t nMatchLimit = nSize - LAST_LITERALS;
+        size_t nPos = 0;
+        while (nPos < nFindLimit)
+        {
+            uint32_t nSeq = Read32(pch + nPos);
+            uint32_t& nSlot = vTable[Hash32(nSeq)];
+            size_t nRef = nSlot;
+            nSlot = nPos;
+            if (nRef >= nPos || nPos - nRef > MAX_OFFSET || Read32(pch + nRef) != nSeq)
+            {
+                nPos++;
+                continue;
+            }
+
+            size_t nMatch = MIN_MATCH;
+            while (nPos + nMatch < nMatchLimit && pch[nRef + nMatch] == pch[nPos + nMatch])
+                nMatch++;
+            WriteSequence(vchOut, pch + nAnchor, nPos - nAnchor, nPos - nRef, nMatch);
+            nPos += nMatch;
+            nAnchor = nPos;
+        }
+    }
+    WriteSequence(vchOut, pch + nAnchor, nSize - nAnchor, 0, 0);
+}
+
+static bool ReadLength(const unsigned char* pch, size_t nSize, size_t& nPos, size_t& nLen)
+{
+    unsigned char ch;
+    do {
+        if (nPos >= nSize)
+            return false;
+        ch = pch[nPos++];
+        nLen += ch;
+    } while (ch == 255);
+    return true;
+}
+
+bool DecompressBlock(const unsigned char* pch, size_t nSize, unsigned char* pchOut, size_t nOut)
+{
+    size_t nPos = 0, nOutPos = 0;
+    while (nOutPos < nOut)
+    {
+        if (nPos >= nSize)
+            return false;
+        unsigned char nToken = pch[nPos++];
+
+        size_t nLiterals = nToken >> 4;
+        if (nLiterals == 15 && !ReadLength(pch, nSize, nPos, nLiterals))
+            return false;
+        if (nLiterals > nSize - nPos)
+            return false;
+        size_t nCopy = min(nLiterals, nOut - nOutPos);
+        memcpy(pchOut + nOutPos, pch + nPos, nCopy);
+        nOutPos += nCopy;
+        nPos += nLiterals;
+        if (nOutPos == nOut)
+            break;
+
+        if (nSize - nPos < 2)
+            return false;
+        size_t nOffset = pch[nPos] | (pch[nPos + 1] << 8);
+        nPos += 2;
+        if (nOffset == 0 || nOffset > nOutPos)
+            return false;
+        size_t nMatch = nToken & 15;
+        if (nMatch == 15 && !ReadLength(pch, nSize, nPos, nMatch))
+            return false;
+        nMatch += MIN_MATCH;
+
+        // Byte by byte, as the match may overlap what it is copying
+        nCopy = min(nMatch, nOut - nOutPos);
+        for (size_t i = 0; i < nCopy; i++, nOutPos++)
+            pchOut[nOutPos] = pchOut[nOutPos - nOffset];
+    }
+    return true;
+}
@@ -0,0 +1,24 @@
+// Copyright (c) 2015-2020 Bean Core www.beancash.org
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITBEAN_BLOCKCOMPRESS_H
+#define BITBEAN_BLOCKCOMPRESS_H
+
+#include <stddef.h>
+#include <vector>
+
+/** Fast compression for block records in the block files. The output is
+ * an LZ4 block (format as documented by the LZ4 project), so it could be
+ * swapped for the reference library later without touching stored data.
+ */
+
+/** Compress nSize bytes at pch into vchOut. */
+void CompressBlock(const unsigned char* pch, size_t nSize, std::vector<unsigned char>& vchOut);
+
+/** Decompress the first nOut bytes of the data compressed in [pch, pch + nSize)
+ * into pchOut. nOut may be less than the original size to read only a prefix.
+ * Returns false on malformed or truncated input.
+ */
+bool DecompressBlock(const unsigned char* pch, size_t nSize, unsigned char* pchOut, size_t nOut);
+
+#endif
@@ -0,0 +1,139 @@
+// Copyright (c) 2015-2020 Bean Core www.beancash.org
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "hash.h"
+
+#include <map>
+
+using namespace std;
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) :
+    nNonce(GetRand(std::numeric_limits<uint64_t>::max()))
+{
+    header.nVersion = block.nVersion;
+    header.hashPrevBlock = block.hashPrevBlock;
+    header.hashMerkleRoot = block.hashMerkleRoot;
+    header.nTime = block.nTime;
+    header.nBits = block.nBits;
+    header.nNonce = block.nNonce;
+    header.vchBlockSig = block.vchBlockSig;
+    FillShortIDKeys();
+
+    // Neither can be in the receiver's memory pool
+    unsigned int nPrefilled = block.IsProofOfStake() ? 2 : 1;
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        if (i < nPrefilled)
+        {
+            vPrefilledTx.push_back(CPrefilledTransaction());
+            vPrefilledTx.back().nIndex = i;
+            vPrefilledTx.back().tx = block.vtx[i];
+        }
+        else
+            vShortTxIDs.push_back(GetShortID(block.vtx[i].GetHash()));
+    }
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortIDKeys() const
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << header.GetHash() << nNonce;
+    uint256 hashKey = ss.GetHash();
+    nShortIDKey0 = hashKey.Get64(0);
+    nShortIDKey1 = hashKey.Get64(1);
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& hashTx) const
+{
+    return SipHashUint256(nShortIDKey0, nShortIDKey1, hashTx) & 0xffffffffffffULL;
+}
+
+CompactReadStatus CPartialBlock::Init(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& pool, vector<unsigned short>& vMissing)
+{
+    if (cmpctblock.header.IsNull() || (cmpctblock.vShortTxIDs.empty() && cmpctblock.vPrefilledTx.empty()))
+        return READ_STATUS_INVALID;
+    if (cmpctblock.BlockTxCount() > MAX_COMPACT_BLOCK_TXS)
+        return READ_STATUS_INVALID;
+
+    header = cmpctblock.header;
+    vtx.assign(cmpctblock.BlockTxCount(), CTransaction());
+    vHave.assign(cmpctblock.BlockTxCount(), false);
+
+    for (const CPrefilledTransaction& prefilled : cmpctblock.vPrefilledTx)
+    {
+        if (prefilled.nIndex >= vtx.size() || vHave[prefilled.nIndex])
+            return READ_STATUS_INVALID;
+        vtx[prefilled.nIndex] = prefilled.tx;
+        vHave[prefilled.nIndex] = true;
+    }
+
+    // Short IDs fill the slots the prefilled transactions left, in order
+    map<uint64_t, unsigned int> mapShortIDs;
+    unsigned int nIndex = 0;
+    for (uint64_t nShortID : cmpctblock.vShortTxIDs)
+    {
+        while (vHave[nIndex])
+            nIndex++;
+        // Two transactions of the block with one short ID: rare, just get the block
+        if (!mapShortIDs.insert(make_pair(nShortID, nIndex)).second)
+            return READ_STATUS_FAILED;
+        nIndex++;
+    }
+
+    // Matching more than one pool transaction makes the slot missing, as
+    // does a collision with one; the merkle root catches what slips through
+    set<unsigned int> setCollided;
+    {
+        LOCK(pool.cs);
+        for (CTxMemPool::indexed_transaction_set::const_iterator it = pool.mapTx.begin(); it != pool.mapTx.end(); ++it)
+        {
+            map<uint64_t, unsigned int>::iterator mi = mapShortIDs.find(cmpctblock.GetShortID(it->GetHash()));
+            if (mi == mapShortIDs.end())
+                continue;
+            if (vHave[mi->second])
+                setCollided.insert(mi->second);
+            else
+            {
+                vtx[mi->second] = it->GetTx();
+                vHave[mi->second] = true;
+            }
+        }
+    }
+    for (unsigned int nCollided : setCollided)
+    {
+        vtx[nCollided] = CTransaction();
+        vHave[nCollided] = false;
+    }
+
+    vMissing.clear();
+    for (unsigned int i = 0; i < vHave.size(); i++)
+        if (!vHave[i])
+            vMissing.push_back(i);
+    return READ_STATUS_OK;
+}
+
+CompactReadStatus CPartialBlock::Fill(const vector<CTransaction>& vtxMissing, CBlock& block) const
+{
+    block = header;
+    block.vtx = vtx;
+
+    unsigned int nMissing = 0;
+    for (unsigned int i = 0; i < vHave.size(); i++)
+    {
+        if (vHave[i])
+            continue;
+        if (nMissing >= vtxMissing.size())
+            return READ_STATUS_INVALID;
+        block.vtx[i] = vtxMissing[nMissing++];
+    }
+    if (nMissing != vtxMissing.size())
+        return READ_STATUS_INVALID;
+
+    // A short ID matched the wrong pool transaction
+    if (block.BuildMerkleTree() != block.hashMerkleRoot)
+        return READ_STATUS_FAILED;
+    return READ_STATUS_OK;
+}
@@ -0,0 +1,148 @@
+// Copyright (c) 2015-2020 Bean Core www.beancash.org
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITBEAN_BLOCKENCODINGS_H
+#define BITBEAN_BLOCKENCODINGS_H
+
+#include "main.h"
+
+/** Compact block relay: a new block goes out as its header, a 6-byte short
+ * ID per transaction and the transactions the receiver can't have in its
+ * memory pool (beanbase and beansprout). The receiver rebuilds the block
+ * from its pool and asks for whatever it is missing with "getblocktxn".
+ */
+
+/** Smallest transaction: one input and one output, both with empty scripts */
+static const unsigned int MIN_TRANSACTION_SIZE = 64;
+/** Transactions a compact block can name: no more than fit in a block, and
+ * no more than the 16-bit indexes of prefilled and requested ones reach */
+static const unsigned int MAX_COMPACT_BLOCK_TXS = MAX_BLOCK_SIZE / MIN_TRANSACTION_SIZE < 0xffff ? MAX_BLOCK_SIZE / MIN_TRANSACTION_SIZE : 0xffff;
+
+/** A transaction sent in full inside a compact block, at index nIndex of the block */
+class CPrefilledTransaction
+{
+public:
+    unsigned short nIndex;
+    CTransaction tx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nIndex);
+        READWRITE(tx);
+    )
+};
+
+/** "cmpctblock": a block with its transactions replaced by short IDs */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    // SipHash keys, from the header and nonce
+    mutable uint64_t nShortIDKey0, nShortIDKey1;
+    uint64_t nNonce;
+
+    void FillShortIDKeys() const;
+
+public:
+    CBlock header; // header and block signature, no transactions
+    std::vector<uint64_t> vShortTxIDs;
+    std::vector<CPrefilledTransaction> vPrefilledTx;
+
+    CBlockHeaderAndShortTxIDs() : nShortIDKey0(0), nShortIDKey1(0), nNonce(0) {}
+    /** Prefills the beanbase and, for proof-of-stake blocks, the beansprout */
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& hashTx) const;
+    size_t BlockTxCount() const { return vShortTxIDs.size() + vPrefilledTx.size(); }
+
+    IMPLEMENT_SERIALIZE
+    (
+        CBlockHeaderAndShortTxIDs* pthis = const_cast<CBlockHeaderAndShortTxIDs*>(this);
+        READWRITE(header.nVersion);
+        READWRITE(header.hashPrevBlock);
+        READWRITE(header.hashMerkleRoot);
+        READWRITE(header.nTime);
+        READWRITE(header.nBits);
+        READWRITE(header.nNonce);
+        READWRITE(header.vchBlockSig);
+        READWRITE(nNonce);
+
+        // Short IDs go as 6 bytes each
+        unsigned int nShortIDs = vShortTxIDs.size();
+        READWRITE(nShortIDs);
+        if (fRead)
+        {
+            if (nShortIDs > MAX_COMPACT_BLOCK_TXS)
+                throw std::ios_base::failure("CBlockHeaderAndShortTxIDs : too many short IDs");
+            pthis->vShortTxIDs.resize(nShortIDs);
+        }
+        for (unsigned int i = 0; i < nShortIDs; i++)
+        {
+            unsigned int nLow = vShortTxIDs[i] & 0xffffffff;
+            unsigned short nHigh = (vShortTxIDs[i] >> 32) & 0xffff;
+            READWRITE(nLow);
+            READWRITE(nHigh);
+            if (fRead)
+                pthis->vShortTxIDs[i] = ((uint64_t)nHigh << 32) | nLow;
+        }
+
+        READWRITE(vPrefilledTx);
+        if (fRead)
+            pthis->FillShortIDKeys();
+    )
+};
+
+/** "getblocktxn": the transactions of a compact block the receiver is missing */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 hashBlock;
+    std::vector<unsigned short> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vIndexes);
+    )
+};
+
+/** "blocktxn": the answer to a CBlockTransactionsRequest, in the order asked */
+class CBlockTransactions
+{
+public:
+    uint256 hashBlock;
+    std::vector<CTransaction> vtx;
+
+    CBlockTransactions() {}
+    CBlockTransactions(const CBlockTransactionsRequest& req) : hashBlock(req.hashBlock), vtx(req.vIndexes.size()) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vtx);
+    )
+};
+
+enum CompactReadStatus
+{
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, // malformed, the peer misbehaved
+    READ_STATUS_FAILED,  // e.g. short ID collision; get the full block instead
+};
+
+/** A block being rebuilt from a compact block and the memory pool */
+class CPartialBlock
+{
+private:
+    CBlock header;
+    std::vector<CTransaction> vtx;
+    std::vector<bool> vHave;
+
+public:
+    /** Fill in what the prefilled transactions and pool provide. The
+        indexes still missing are returned in vMissing. */
+    CompactReadStatus Init(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& pool, std::vector<unsigned short>& vMissing);
+    /** Complete the block with the transactions that were missing, in order */
+    CompactReadStatus Fill(const std::vector<CTransaction>& vtxMissing, CBlock& block) const;
+};
+
+#endif
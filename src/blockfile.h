@@ -0,0 +1,164 @@
+// Copyright (c) 2015-2020 Bean Core www.beancash.org
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITBEAN_BLOCKFILE_H
+#define BITBEAN_BLOCKFILE_H
+
+#include "serialize.h"
+#include "sync.h"
+
+#include <map>
+
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/shared_ptr.hpp>
+
+/** Read-only stream over a span of memory, for deserializing in place. */
+class CMemoryStream
+{
+private:
+    const char* pcur;
+    const char* pend;
+
+public:
+    int nType;
+    int nVersion;
+
+    CMemoryStream(const char* pbegin, const char* pendIn, int nTypeIn, int nVersionIn) :
+        pcur(pbegin), pend(pendIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    int GetType()                { return nType; }
+    int GetVersion()             { return nVersion; }
+    size_t size() const          { return pend - pcur; }
+
+    CMemoryStream& read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CMemoryStream::read() : end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CMemoryStream& operator>>(T& obj)
+    {
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+/** Read-only memory maps of the block files, so block and transaction
+ * reads deserialize from mapped memory instead of opening and seeking
+ * the file each time. The files only ever grow, so a read past the end
+ * of a mapping remaps the file at its current size. Readers hold a
+ * reference to the mapping they use, which keeps it valid across a remap.
+ * Any failure returns false and the caller falls back to stdio.
+ */
+class CBlockFileMap
+{
+public:
+    typedef boost::filesystem::path (*PathFunc)(unsigned int nFile);
+
+private:
+    typedef boost::shared_ptr<boost::interprocess::mapped_region> region_ptr;
+
+    mutable CCriticalSection cs;
+    std::map<unsigned int, region_ptr> mapRegions;
+    PathFunc pathFunc;
+    bool fEnabled;
+
+    region_ptr GetRegion(unsigned int nFile, bool fRemap)
+    {
+        LOCK(cs);
+        if (!fEnabled)
+            return region_ptr();
+        region_ptr& region = mapRegions[nFile];
+        if (region && !fRemap)
+            return region;
+        try {
+            boost::interprocess::file_mapping mapping(pathFunc(nFile).string().c_str(), boost::interprocess::read_only);
+            region.reset(new boost::interprocess::mapped_region(mapping, boost::interprocess::read_only));
+        }
+        catch (std::exception& e) {
+            // Missing, empty or unmappable (e.g. out of address space)
+            region.reset();
+        }
+        return region;
+    }
+
+public:
+    CBlockFileMap(PathFunc pathFuncIn) : pathFunc(pathFuncIn), fEnabled(true) {}
+
+    void SetEnabled(bool fEnabledIn)
+    {
+        LOCK(cs);
+        fEnabled = fEnabledIn;
+        if (!fEnabled)
+            mapRegions.clear();
+    }
+
+    /** Drop every mapping, e.g. before block files are rewritten or removed. */
+    void Clear()
+    {
+        LOCK(cs);
+        mapRegions.clear();
+    }
+
+    /** Drop the mapping of one file, e.g. before deleting it. */
+    void Erase(unsigned int nFile)
+    {
+        LOCK(cs);
+        mapRegions.erase(nFile);
+    }
+
+    size_t size() const
+    {
+        LOCK(cs);
+        return mapRegions.size();
+    }
+
+    /** Deserialize obj from offset nPos of block file nFile. */
+    template<typename T>
+    bool Read(unsigned int nFile, unsigned int nPos, T& obj, int nType, int nVersion)
+    {
+        // The second pass remaps in case the file grew since it was mapped
+        for (int nPass = 0; nPass < 2; nPass++)
+        {
+            region_ptr region = GetRegion(nFile, nPass > 0);
+            if (!region)
+                return false;
+            const char* pbegin = (const char*)region->get_address();
+            if (nPos >= region->get_size())
+                continue;
+            CMemoryStream s(pbegin + nPos, pbegin + region->get_size(), nType, nVersion);
+            try {
+                s >> obj;
+                return true;
+            }
+            catch (std::exception& e) {
+                continue;
+            }
+        }
+        return false;
+    }
+
+    /** Copy nSize raw bytes from offset nPos of block file nFile. */
+    bool ReadBytes(unsigned int nFile, unsigned int nPos, char* pch, size_t nSize)
+    {
+        for (int nPass = 0; nPass < 2; nPass++)
+        {
+            region_ptr region = GetRegion(nFile, nPass > 0);
+            if (!region)
+                return false;
+            if ((uint64_t)nPos + nSize > region->get_size())
+                continue;
+            memcpy(pch, (const char*)region->get_address() + nPos, nSize);
+            return true;
+        }
+        return false;
+    }
+};
+
+#endif
@@ -35,6 +35,11 @@
 #include <unistd.h>
 
 typedef u_int SOCKET;
+
+#ifdef __linux__
+// The socket handler waits with epoll instead of select, without the FD_SETSIZE limit
+#define USE_EPOLL 1
+#endif
 #endif
 
 
@@ -57,6 +62,10 @@ typedef int socklen_t;
 #define SOCKET_ERROR        -1
 #endif
 
+#ifndef SOCK_CLOEXEC
+#define SOCK_CLOEXEC        0
+#endif
+
 inline int myclosesocket(SOCKET& hSocket)
 {
     if (hSocket == INVALID_SOCKET)
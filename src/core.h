@@ -12,7 +12,13 @@
 
 #include <stdio.h>
 
+#include <boost/shared_ptr.hpp>
+
 class CTransaction;
+class CSharedTransaction;
+
+/** Transactions are shared by reference once they stop changing (main.h) */
+typedef boost::shared_ptr<const CSharedTransaction> CTransactionRef;
 
 /** An outpoint - a combination of a transaction hash and an index n into its vout */
 class COutPoint
@@ -54,17 +60,17 @@ public:
 };
 
 
-/** An inpoint - a combination of a transaction and an index n into its vin */
+/** An inpoint - a combination of a memory pool transaction and an index n into its vin */
 class CInPoint
 {
 public:
-    CTransaction* ptx;
+    CTransactionRef ptx;
     unsigned int n;
 
     CInPoint() { SetNull(); }
-    CInPoint(CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
-    void SetNull() { ptx = NULL; n = std::numeric_limits<uint32_t>::max(); }
-    bool IsNull() const { return (ptx == NULL && n == std::numeric_limits<uint32_t>::max()); }
+    CInPoint(const CTransactionRef& ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
+    void SetNull() { ptx.reset(); n = std::numeric_limits<uint32_t>::max(); }
+    bool IsNull() const { return (!ptx && n == std::numeric_limits<uint32_t>::max()); }
 };
 
 #endif
@@ -121,6 +121,10 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
     return Hash160(vch.begin(), vch.end());
 }
 
+/** SipHash-2-4 of a 256-bit value, keyed with (k0, k1). Cheap enough to
+    run over the whole memory pool, and unpredictable without the key. */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+
 typedef struct
 {
     SHA512_CTX ctxInner;
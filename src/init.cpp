@@ -104,9 +104,18 @@ void Shutdown()
     if (pwalletMain)
         bitdb.Flush(false);
     StopNode();
+    // Not before the dump was loaded, or a shutdown during the load would truncate it
+    if (fMempoolLoaded && GetBoolArg("-persistmempool", true))
+        DumpMempool();
     {
         LOCK(cs_main);
-        if (pwalletMain)
+        // The wallet keeps its older best chain if the index couldn't be
+        // saved, so it rescans from there on the next start
+        bool fIndexWritten = CTxDB::FlushDeferred();
+        if (!fIndexWritten)
+            LogPrintf("*** Error: Failed to write the deferred block index and transaction data; blocks since the last write will be downloaded again\n");
+        FlushBlockFiles();
+        if (pwalletMain && fIndexWritten)
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
     }
 
@@ -321,6 +330,15 @@ strUsage += "  -pid=<file>            " + _("Specify pid file (default: Beancash
 strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
 strUsage += "  -wallet=<file>         " + _("Specify wallet file (within data directory)") + " " + strprintf(_("(default: %s)"), DEFAULT_WALLET_FILENAME) + "\n";
 strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n";
+strUsage += "  -blockservecache=<n>   " + _("Set the size of the cache of recently served blocks in megabytes (default: 16)") + "\n";
+strUsage += "  -blockfilemmap         " + _("Read blocks through memory maps of the block files (default: 1 on 64-bit systems)") + "\n";
+strUsage += "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE) + "\n";
+strUsage += "  -limitancestorcount=<n> " + strprintf(_("Refuse transactions with more than <n> unconfirmed ancestors in the memory pool, themselves included (default: %u)"), DEFAULT_ANCESTOR_LIMIT) + "\n";
+strUsage += "  -limitdescendantcount=<n> " + strprintf(_("Refuse transactions that would give a memory pool transaction more than <n> unconfirmed descendants, itself included (default: %u)"), DEFAULT_DESCENDANT_LIMIT) + "\n";
+strUsage += "  -persistmempool        " + _("Save the memory pool on shutdown and load it on restart (default: 1)") + "\n";
+strUsage += "  -compressblocks        " + _("Store new blocks compressed in the block files (default: 0)") + "\n";
+strUsage += "  -prune=<n>             " + strprintf(_("Delete the oldest block files to keep them under <n> MiB (default: 0 = off, minimum: %u). Pruned nodes don't serve old blocks or rescan wallets"), MIN_PRUNE_TARGET >> 20) + "\n";
+strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (up to %d, 0 = auto, <0 = leave that many cores free, default: 0)"), MAX_SCRIPTCHECK_THREADS) + "\n";
 strUsage += "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n";
 strUsage += "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
 strUsage += "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n";
@@ -346,6 +364,7 @@ strUsage += "  -banscore=<n>          " + _("Threshold for disconnecting misbeha
 strUsage += "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n";
 strUsage += "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n";
 strUsage += "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n";
+strUsage += "  -compactblocks         " + _("Ask peers for new blocks as compact blocks, rebuilt from the memory pool (default: 1)") + "\n";
 strUsage += "  -detachdb              " + _("Detach block and address databases. Increases shutdown time (default: 1)") + "\n";
 strUsage += "  -paytxfee=<amt>        " + _("Fee per KB to add to transactions you send") + "\n";
 strUsage += "  -mininput=<amt>        " + _("When creating transactions, ignore inputs with value less than this (default: 0.01)") + "\n";
@@ -388,6 +407,7 @@ strUsage += "  -rescan                " + _("Rescan the block chain for missing
 strUsage += "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet file") + "\n";
 strUsage += "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 600, 0 = all)") + "\n";
 strUsage += "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n";
+strUsage += "  -asynccheck            " + _("Verify the -checkblocks blocks in the background after startup (default: 0)") + "\n";
 strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n";
 strUsage += "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n";
 strUsage += "  -blockmaxsize=<n>      "   + _("Set maximum block size in bytes (default: 250000)") + "\n";
@@ -523,6 +543,11 @@ static void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
             LoadExternalBlockFile(file);
         }
     }
+
+    // Off the init path, as it checks every transaction again
+    if (GetBoolArg("-persistmempool", true))
+        LoadMempool();
+    fMempoolLoaded = !ShutdownRequested();
 }
 
 
@@ -635,10 +660,15 @@ bool AppInit2(boost::thread_group& threadGroup)
             LogPrintf("init: parameter interaction: -zapwallet=<mode> -> setting -rescan=1\n");
 	 }
 
-    // Make sure there are enough file descriptors
-    int nBind = std::max((int)mapArgs.count("-bind"), 1);
+    // Make sure there are enough file descriptors. epoll has no FD_SETSIZE
+    // limit, but the select the socket handler falls back to does
     nMaxConnections = GetArg("-maxconnections", 200);
-    nMaxConnections = std::max(std::min(nMaxConnections, FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS), 0);
+    if (!InitSocketEvents())
+    {
+        int nBind = std::max((int)mapArgs.count("-bind"), 1);
+        nMaxConnections = std::min(nMaxConnections, FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS);
+    }
+    nMaxConnections = std::max(nMaxConnections, 0);
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -647,6 +677,41 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     // ********************************************************* Step 3: parameter-to-internal-flags
 
+    blockcache.SetMaxSize((size_t)GetArg("-blockservecache", 16) << 20);
+    // Half of -dbcache, the other half goes to deferred commits
+    txdbcache.SetMaxSize((uint64_t)GetArg("-dbcache", 25) << 19);
+    // Mapping every block file would exhaust a 32-bit address space
+    blockFileMap.SetEnabled(GetBoolArg("-blockfilemmap", sizeof(void*) >= 8));
+
+    fCompressBlocks = GetBoolArg("-compressblocks", false);
+    fCompactBlocks = GetBoolArg("-compactblocks", true);
+    int64_t nMaxMempoolMB = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE);
+    if (nMaxMempoolMB < MIN_MAX_MEMPOOL_SIZE)
+        return InitError(strprintf(_("-maxmempool must be at least %u MB"), MIN_MAX_MEMPOOL_SIZE));
+    nMaxMempoolSize = (uint64_t)nMaxMempoolMB * 1000000;
+    nMempoolAncestorLimit = (unsigned int)std::max(GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT), (int64_t)1);
+    nMempoolDescendantLimit = (unsigned int)std::max(GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT), (int64_t)1);
+
+    nPruneTarget = (uint64_t)std::max(GetArg("-prune", 0), (int64_t)0) << 20;
+    if (nPruneTarget)
+    {
+        if (nPruneTarget < MIN_PRUNE_TARGET)
+            return InitError(strprintf(_("-prune must be at least %u MiB"), MIN_PRUNE_TARGET >> 20));
+        fPruneMode = true;
+        // We can't serve the whole chain any more
+        nLocalServices &= ~NODE_NETWORK;
+        LogPrintf("Pruning block files to %u MiB\n", nPruneTarget >> 20);
+    }
+
+    // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
+    nScriptCheckThreads = GetArg("-par", 0);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+
     if (mapMultiArgs.count("-debug")) fDebug = true;
 
     // -debug implies fDebug*
@@ -729,6 +794,12 @@ if (!fHaveGUI)
     if (fDaemon)
         fprintf(stdout, "Beancash server starting\n");
 
+    if (nScriptCheckThreads) {
+        LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadScriptCheck);
+    }
+
     int64_t nStart;
 
     // ********************************************************* Step 5: verify database integrity
@@ -896,6 +967,8 @@ if (!fHaveGUI)
     nStart = GetTimeMillis();
     if (!LoadBlockIndex())
         return InitError(_("Error loading blkindex.dat"));
+    if (!fPruneMode && IsBlockFilePruned(1))
+        return InitError(_("Block files have been pruned, restart with -prune"));
     
     // If the loaded chain has the wrong genesis, bail out immediately
     // It is likely using a Testnet data directory or visversa.
@@ -913,6 +986,9 @@ if (!fHaveGUI)
     }
     LogPrintf(" block index %15" PRId64 "ms\n", GetTimeMillis() - nStart);
 
+    if (GetBoolArg("-asynccheck", false))
+        threadGroup.create_thread(&ThreadVerifyBlockIndex);
+
     if (GetBoolArg("-printblockindex") || GetBoolArg("-printblocktree"))
     {
         PrintBlockTree();
@@ -923,7 +999,7 @@ if (!fHaveGUI)
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -1047,6 +1123,8 @@ if (!fHaveGUI)
     }
     if (pindexBest != pindexRescan && pindexBest && pindexRescan && pindexBest->nHeight > pindexRescan->nHeight)
     {
+        if (IsBlockFilePruned(pindexRescan->nFile))
+            return InitError(_("The wallet needs blocks that have been pruned, rescan them on a node without -prune"));
         uiInterface.InitMessage(_("Rescanning..."));
         LogPrintf("Rescanning last %i blocks (from block %i)...\n", pindexBest->nHeight - pindexRescan->nHeight, pindexRescan->nHeight);
         nStart = GetTimeMillis();
@@ -1078,6 +1156,12 @@ if (!fHaveGUI)
 	 	}    
     }
 
+    // The wallet has seen everything it needs, so old block files can go
+    {
+        LOCK(cs_main);
+        PruneBlockFiles();
+    }
+
     // ********************************************************* Step 9: import blocks
 
     std::vector<boost::filesystem::path> vPath;
@@ -13,6 +13,9 @@
 #include "ui_interface.h"
 #include "chainparams.h"
 #include "kernel.h"
+#include "checkqueue.h"
+#include "blockcompress.h"
+#include "blockencodings.h"
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -40,7 +43,9 @@ CCriticalSection cs_main;
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
+CBlockIndexArena blockIndexArena;
+CBlockCache blockcache(16 << 20);
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 
 CBigNum bnProofOfStakeLimit(~uint256(0) >> 20);
@@ -63,6 +68,7 @@ uint256 nBestInvalidTrust = 0;
 
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+CChain chainActive;
 int64_t nTimeBestReceived = 0;
 
 CMedianFilter<int> cPeerBlockCounts(5, 0); // Amount of blocks that other nodes claim to have
@@ -71,6 +77,30 @@ map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
 
+/** A header received ahead of its block during headers-first sync */
+struct CHeaderIndex
+{
+    uint256 hashPrev;
+    int nHeight;
+    unsigned int nTime;
+    uint256 nChainTrust; // as claimed by the nBits of the headers
+};
+// Headers whose blocks aren't in mapBlockIndex yet
+static map<uint256, CHeaderIndex> mapHeaders;
+static uint256 hashBestHeader = 0;
+static int nBestHeaderHeight = -1;
+static uint256 nBestHeaderTrust = 0;
+// Best header chain above the block index, starting at nHeaderChainHeight
+static vector<uint256> vHeaderChain;
+static int nHeaderChainHeight = 0;
+static unsigned int nHeaderChainCursor = 0;
+// Bumped whenever vHeaderChain is replaced or cut, expiring CNode::nSyncHeaderIndex
+static unsigned int nHeaderChainGeneration = 1;
+// Block bodies requested from peers, with the time of the request
+static map<uint256, pair<CNode*, int64_t> > mapBlocksInFlight;
+// Compact blocks waiting for "blocktxn", by the peer that sent them, with the time asked
+static map<pair<CNode*, uint256>, pair<int64_t, CPartialBlock> > mapPartialBlocks;
+
 map<uint256, CTransaction> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
 
@@ -85,6 +115,16 @@ const string strMessageMagic = "Beancash Signed Message:\n";
 int64_t nTransactionFee = MIN_TX_FEE;
 int64_t nReserveBalance = 0;
 int64_t nMinimumInputValue = 0;
+int nScriptCheckThreads = 0;
+bool fPruneMode = false;
+uint64_t nPruneTarget = 0;
+bool fCompressBlocks = false;
+std::atomic<bool> fMempoolLoaded(false);
+bool fCompactBlocks = true;
+uint64_t nMaxMempoolSize = DEFAULT_MAX_MEMPOOL_SIZE * 1000000;
+unsigned int nMempoolAncestorLimit = DEFAULT_ANCESTOR_LIMIT;
+unsigned int nMempoolDescendantLimit = DEFAULT_DESCENDANT_LIMIT;
+static bool fBlockStoreCompressed = false;  // some block may be stored compressed
 
 extern enum Checkpoints::CPMode CheckpointsMode;
 
@@ -205,6 +245,325 @@ void ResendWalletTransactions(bool fForce)
         pwallet->ResendWalletTransactions(fForce);
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Headers-first sync
+//
+// Headers are fetched ahead of the blocks into mapHeaders, a tree hanging off
+// mapBlockIndex, and the one with the most chain trust becomes the best
+// header. Block bodies along the best header chain are then requested from
+// the peers that announced them, a few at a time per peer, and requests left
+// unanswered for BLOCK_STALL_TIMEOUT or answered with "notfound" are handed
+// to another peer. Blocks arriving out of order wait in mapOrphanBlocks as
+// before.
+//
+// Proof-of-bean headers can't be checked without the coinstake, so only
+// linkage, timestamps and the hardened checkpoints are validated for them;
+// proof-of-work headers are checked against their target as well. The blocks
+// themselves go through ProcessBlock as usual.
+//
+
+/** Trust of a block with the given target, see CBlockIndex::GetBlockTrust. */
+static uint256 GetBlockTrustFromBits(unsigned int nBits)
+{
+    CBigNum bnTarget;
+    bnTarget.SetCompact(nBits);
+
+    if (bnTarget <= 0)
+        return 0;
+
+    return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
+}
+
+/** Height of a block or header we know of, -1 if none. */
+static int GetHeaderHeight(const uint256& hash)
+{
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+        return (*mi).second->nHeight;
+    map<uint256, CHeaderIndex>::iterator it = mapHeaders.find(hash);
+    return it != mapHeaders.end() ? (*it).second.nHeight : -1;
+}
+
+static uint256 GetHeaderPrev(const uint256& hash)
+{
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+        return (*mi).second->pprev ? (*mi).second->pprev->GetBlockHash() : uint256(0);
+    map<uint256, CHeaderIndex>::iterator it = mapHeaders.find(hash);
+    return it != mapHeaders.end() ? (*it).second.hashPrev : uint256(0);
+}
+
+/** Like CBlockLocator::Set, but can start from a header we don't have the block of. */
+static CBlockLocator GetHeaderLocator(uint256 hash)
+{
+    vector<uint256> vHave;
+    int nStep = 1;
+    while (hash != 0)
+    {
+        vHave.push_back(hash);
+
+        // Exponentially larger steps back
+        for (int i = 0; hash != 0 && i < nStep; i++)
+            hash = GetHeaderPrev(hash);
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+    vHave.push_back(Params().HashGenesisBlock());
+    return CBlockLocator(vHave);
+}
+
+/** Drop the headers on branches off the best header chain to make room for new ones. */
+static void PruneHeaders()
+{
+    unsigned int nBefore = mapHeaders.size();
+    for (map<uint256, CHeaderIndex>::iterator it = mapHeaders.begin(); it != mapHeaders.end(); )
+    {
+        int i = (*it).second.nHeight - nHeaderChainHeight;
+        if (i >= 0 && i < (int)vHeaderChain.size() && vHeaderChain[i] == (*it).first)
+            ++it;
+        else
+            mapHeaders.erase(it++);
+    }
+    LogPrint("net", "pruned %u headers off the best header chain\n", nBefore - mapHeaders.size());
+}
+
+/** Check a header received ahead of its block and add it to mapHeaders. */
+static bool AcceptBlockHeader(const CBlock& header, const uint256& hash, int& nHeight)
+{
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+    {
+        nHeight = (*mi).second->nHeight;
+        return true;
+    }
+    map<uint256, CHeaderIndex>::iterator it = mapHeaders.find(hash);
+    if (it != mapHeaders.end())
+    {
+        nHeight = (*it).second.nHeight;
+        return true;
+    }
+
+    // Get prev header
+    int nHeightPrev;
+    int64_t nTimePrev;
+    uint256 nChainTrustPrev;
+    mi = mapBlockIndex.find(header.hashPrevBlock);
+    if (mi != mapBlockIndex.end())
+    {
+        nHeightPrev = (*mi).second->nHeight;
+        nTimePrev = (*mi).second->GetBlockTime();
+        nChainTrustPrev = (*mi).second->nChainTrust;
+    }
+    else
+    {
+        it = mapHeaders.find(header.hashPrevBlock);
+        if (it == mapHeaders.end())
+            return error("AcceptBlockHeader() : header %s does not connect", hash.ToString().substr(0,20).c_str());
+        nHeightPrev = (*it).second.nHeight;
+        nTimePrev = (*it).second.nTime;
+        nChainTrustPrev = (*it).second.nChainTrust;
+    }
+    nHeight = nHeightPrev + 1;
+
+    if (header.GetBlockTime() > FutureDrift(GetAdjustedTime()))
+        return error("AcceptBlockHeader() : header %s has a timestamp too far in the future", hash.ToString().substr(0,20).c_str());
+    if (FutureDrift(header.GetBlockTime()) < nTimePrev)
+        return header.DoS(10, error("AcceptBlockHeader() : header %s has a timestamp too early", hash.ToString().substr(0,20).c_str()));
+    if (!Checkpoints::CheckHardened(nHeight, hash))
+        return header.DoS(100, error("AcceptBlockHeader() : rejected by hardened checkpoint lock-in at %d", nHeight));
+
+    // Only proof-of-work headers are taken ahead of their blocks, so the
+    // trust they claim is backed by the work in them. A proof-of-bean
+    // header can't be checked without its coinstake; its block arrives
+    // through getblocks instead
+    if (nHeight > LAST_POW_BLOCK || !CheckProofOfWork(header.GetPoWHash(), header.nBits))
+    {
+        LogPrint("net", "AcceptBlockHeader() : header %s at %d can't be checked ahead of its block\n", hash.ToString().substr(0,20).c_str(), nHeight);
+        return false;
+    }
+
+    // Make room by dropping the branches that lost out to the best header
+    if (mapHeaders.size() >= 2 * MAX_HEADERS_AHEAD)
+    {
+        PruneHeaders();
+        if (mapHeaders.size() >= 2 * MAX_HEADERS_AHEAD)
+            return error("AcceptBlockHeader() : too many headers");
+        if (mi == mapBlockIndex.end() && !mapHeaders.count(header.hashPrevBlock))
+            return error("AcceptBlockHeader() : header %s does not connect", hash.ToString().substr(0,20).c_str());
+    }
+
+    CHeaderIndex& entry = mapHeaders[hash];
+    entry.hashPrev = header.hashPrevBlock;
+    entry.nHeight = nHeight;
+    entry.nTime = header.nTime;
+    entry.nChainTrust = nChainTrustPrev + GetBlockTrustFromBits(header.nBits);
+    return true;
+}
+
+/** Make hash the tip of the header chain that blocks are downloaded along. */
+static void SetBestHeader(const uint256& hash, int nHeight)
+{
+    hashBestHeader = hash;
+    nBestHeaderHeight = nHeight;
+    nBestHeaderTrust = mapHeaders[hash].nChainTrust;
+
+    nHeaderChainGeneration++;
+    vHeaderChain.clear();
+    uint256 hashWalk = hash;
+    map<uint256, CHeaderIndex>::iterator it;
+    while ((it = mapHeaders.find(hashWalk)) != mapHeaders.end())
+    {
+        vHeaderChain.push_back(hashWalk);
+        hashWalk = (*it).second.hashPrev;
+    }
+    reverse(vHeaderChain.begin(), vHeaderChain.end());
+    nHeaderChainHeight = nHeight - vHeaderChain.size() + 1;
+    nHeaderChainCursor = 0;
+}
+
+/** Forget a header whose block turned out to be invalid, and cut the header chain there. */
+static void InvalidateHeader(const uint256& hash)
+{
+    if (!mapHeaders.erase(hash))
+        return;
+    for (unsigned int i = 0; i < vHeaderChain.size(); i++)
+    {
+        if (vHeaderChain[i] != hash)
+            continue;
+        vHeaderChain.resize(i);
+        hashBestHeader = i > 0 ? vHeaderChain[i - 1] : uint256(0);
+        nBestHeaderHeight = i > 0 ? nHeaderChainHeight + i - 1 : -1;
+        map<uint256, CHeaderIndex>::iterator it = mapHeaders.find(hashBestHeader);
+        nBestHeaderTrust = it != mapHeaders.end() ? (*it).second.nChainTrust : uint256(0);
+        nHeaderChainCursor = min(nHeaderChainCursor, i);
+        nHeaderChainGeneration++;
+        break;
+    }
+}
+
+/** A requested block arrived; free up its slot with the peer it was asked from. */
+static void MarkBlockReceived(CNode* pfrom, const uint256& hash)
+{
+    map<uint256, pair<CNode*, int64_t> >::iterator mi = mapBlocksInFlight.find(hash);
+    if (mi == mapBlocksInFlight.end())
+        return;
+    CNode* pnode = (*mi).second.first;
+    pnode->nBlocksInFlight--;
+    if (pnode == pfrom)
+        pnode->nBlockStalls = 0;
+    mapBlocksInFlight.erase(mi);
+}
+
+/** Position of the last block on the header chain that pto has announced, -1 if none. */
+static int GetAnnouncedHeaderIndex(CNode* pto)
+{
+    if (pto->nSyncHeaderGeneration == nHeaderChainGeneration)
+        return pto->nSyncHeaderIndex;
+
+    // Walk back from its best header to where that meets the header chain
+    int nIndex = -1;
+    uint256 hash = pto->hashSyncHeader;
+    map<uint256, CHeaderIndex>::iterator it;
+    while (hash != 0 && (it = mapHeaders.find(hash)) != mapHeaders.end())
+    {
+        int i = (*it).second.nHeight - nHeaderChainHeight;
+        if (i < 0)
+            break;
+        if (i < (int)vHeaderChain.size() && vHeaderChain[i] == hash)
+        {
+            nIndex = i;
+            break;
+        }
+        hash = (*it).second.hashPrev;
+    }
+    pto->nSyncHeaderIndex = nIndex;
+    pto->nSyncHeaderGeneration = nHeaderChainGeneration;
+    return nIndex;
+}
+
+/** Request headers and blocks along the best header chain from pto. */
+static void SendBlockRequests(CNode* pto)
+{
+    int64_t nNow = GetTime();
+
+    // Ask for more headers while it has more than it announced and we aren't
+    // too far ahead. Past LAST_POW_BLOCK, or until the blocks have caught up
+    // with a header it sent that couldn't be checked, getblocks does the work
+    int nHeaderHeight = max(GetHeaderHeight(pto->hashSyncHeader), nBestHeight);
+    if (pto->nSyncHeight > nHeaderHeight && nHeaderHeight < nBestHeight + MAX_HEADERS_AHEAD &&
+        nHeaderHeight < LAST_POW_BLOCK && nBestHeight >= pto->nHeadersUncheckedHeight &&
+        nNow - pto->nTimeHeadersRequested > HEADERS_REQUEST_TIMEOUT)
+    {
+        pto->PushMessage("getheaders", GetHeaderLocator(nHeaderHeight > nBestHeight ? pto->hashSyncHeader : hashBestChain), uint256(0));
+        pto->nTimeHeadersRequested = nNow;
+    }
+
+    // Hand back requests this peer has sat on for too long
+    for (map<uint256, pair<CNode*, int64_t> >::iterator mi = mapBlocksInFlight.begin(); mi != mapBlocksInFlight.end(); )
+    {
+        if ((*mi).second.first == pto && nNow - (*mi).second.second > BLOCK_STALL_TIMEOUT)
+        {
+            LogPrint("net", "block %s from %s timed out\n", (*mi).first.ToString().substr(0,20).c_str(), pto->addr.ToString().c_str());
+            pto->nBlocksInFlight--;
+            pto->nBlockStalls++;
+            mapBlocksInFlight.erase(mi++);
+        }
+        else
+            ++mi;
+    }
+    if (pto->nBlockStalls >= MAX_BLOCK_STALLS)
+    {
+        LogPrintf("peer %s stalled block download, disconnecting\n", pto->addr.ToString().c_str());
+        pto->fDisconnect = true;
+        return;
+    }
+
+    // Skip what has already arrived
+    while (nHeaderChainCursor < vHeaderChain.size() && mapBlockIndex.count(vHeaderChain[nHeaderChainCursor]))
+        nHeaderChainCursor++;
+
+    // Only what it announced itself
+    int nAnnounced = GetAnnouncedHeaderIndex(pto);
+    vector<CInv> vGetData;
+    for (unsigned int i = nHeaderChainCursor; i < vHeaderChain.size() && i < nHeaderChainCursor + BLOCK_DOWNLOAD_WINDOW; i++)
+    {
+        if (pto->nBlocksInFlight >= MAX_BLOCKS_IN_FLIGHT_PER_PEER || (int)i > nAnnounced)
+            break;
+        // Pruned peers only keep their most recent blocks
+        if (!(pto->nServices & NODE_NETWORK) && nHeaderChainHeight + (int)i <= pto->nSyncHeight - MIN_BLOCKS_TO_KEEP)
+            continue;
+        const uint256& hash = vHeaderChain[i];
+        if (mapBlocksInFlight.count(hash) || mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash) ||
+            pto->setBlocksNotFound.count(hash))
+            continue;
+        mapBlocksInFlight[hash] = make_pair(pto, nNow);
+        pto->nBlocksInFlight++;
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+    }
+    if (!vGetData.empty())
+    {
+        LogPrint("net", "requesting %u blocks from %s\n", vGetData.size(), pto->addr.ToString().c_str());
+        pto->PushMessage("getdata", vGetData);
+    }
+}
+
+/** A peer is about to be deleted; let other peers pick up its block requests. */
+static void FinalizeNode(CNode* pnode)
+{
+    LOCK(cs_main);
+    for (map<uint256, pair<CNode*, int64_t> >::iterator mi = mapBlocksInFlight.begin(); mi != mapBlocksInFlight.end(); )
+    {
+        if ((*mi).second.first == pnode)
+            mapBlocksInFlight.erase(mi++);
+        else
+            ++mi;
+    }
+    map<pair<CNode*, uint256>, pair<int64_t, CPartialBlock> >::iterator mi = mapPartialBlocks.lower_bound(make_pair(pnode, uint256(0)));
+    while (mi != mapPartialBlocks.end() && (*mi).first.first == pnode)
+        mapPartialBlocks.erase(mi++);
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Registration of network node signals.
@@ -214,12 +573,14 @@ void RegisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.ProcessMessages.connect(&ProcessMessages);
     nodeSignals.SendMessages.connect(&SendMessages);
+    nodeSignals.FinalizeNode.connect(&FinalizeNode);
 }
 
 void UnregisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.ProcessMessages.disconnect(&ProcessMessages);
     nodeSignals.SendMessages.disconnect(&SendMessages);
+    nodeSignals.FinalizeNode.disconnect(&FinalizeNode);
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -229,7 +590,7 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals)
 
 CBlockLocator::CBlockLocator(uint256 hashBlock)
 {
-    std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi != mapBlockIndex.end())
         Set((*mi).second);
 }
@@ -258,7 +619,7 @@ int CBlockLocator::GetDistanceBack()
     int nStep = 1;
     for (const uint256& hash : vHave)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
         if (mi != mapBlockIndex.end())
         {
             CBlockIndex* pindex = (*mi).second;
@@ -277,7 +638,7 @@ CBlockIndex *CBlockLocator::GetBlockIndex()
     // Find the first block the caller has in the main chain
     for (const uint256& hash : vHave)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
         if (mi != mapBlockIndex.end())
         {
             CBlockIndex* pindex = (*mi).second;
@@ -293,7 +654,7 @@ uint256 CBlockLocator::GetBlockHash()
     // Find the first block the caller has in the main chain
     for (const uint256& hash : vHave)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
         if (mi != mapBlockIndex.end())
         {
             CBlockIndex* pindex = (*mi).second;
@@ -587,7 +948,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -686,8 +1047,29 @@ int64_t GetMinFee(const CTransaction& tx, unsigned int nBlockSize, enum GetMinFe
 }
 
 
-bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
-                        bool* pfMissingInputs)
+// Look up the prevouts of a transaction that skipped input checks, for its
+// pool entry: from the pool, or else the chain. Missing ones are left out.
+static void FetchMempoolEntryInputs(CTxDB& txdb, const CTransaction& tx, MapPrevTx& mapInputs)
+{
+    for (const CTxIn& txin : tx.vin)
+    {
+        if (txin.prevout.IsNull() || mapInputs.count(txin.prevout.hash))
+            continue;
+        CTxIndex txindex;
+        CCoins coins;
+        CTransaction txPrev;
+        if (mempool.lookup(txin.prevout.hash, txPrev))
+            mapInputs[txin.prevout.hash] = make_pair(CTxIndex(), CCoins(txPrev));
+        else if (txdb.ReadTxIndex(txin.prevout.hash, txindex) && txdb.ReadCoins(txin.prevout.hash, coins))
+            mapInputs[txin.prevout.hash] = make_pair(txindex, coins);
+    }
+}
+
+
+// Checks of accept() that come before the input scripts. Returns false
+// without an error if the transaction is already known.
+bool CTxMemPool::CheckAccept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs, bool* pfMissingInputs,
+                             MapPrevTx& mapInputs, const CTransaction*& ptxOld)
 {
     if (pfMissingInputs)
         *pfMissingInputs = false;
@@ -723,7 +1105,7 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
             return false;
 
     // Check for conflicts with in-memory transactions
-    CTransaction* ptxOld = NULL;
+    ptxOld = NULL;
     for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
         COutPoint outpoint = tx.vin[i].prevout;
@@ -735,7 +1117,7 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
             // Allow replacing with a newer version of the same transaction
             if (i != 0)
                 return false;
-            ptxOld = mapNextTx[outpoint].ptx;
+            ptxOld = mapNextTx[outpoint].ptx.get();
             if (ptxOld->IsFinal())
                 return false;
             if (!tx.IsNewerThan(*ptxOld))
@@ -743,93 +1125,170 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
             for (unsigned int i = 0; i < tx.vin.size(); i++)
             {
                 COutPoint outpoint = tx.vin[i].prevout;
-                if (!mapNextTx.count(outpoint) || mapNextTx[outpoint].ptx != ptxOld)
+                if (!mapNextTx.count(outpoint) || mapNextTx[outpoint].ptx.get() != ptxOld)
                     return false;
             }
             break;
         }
     }
 
-    if (fCheckInputs)
+    if (!fCheckInputs)
     {
-        MapPrevTx mapInputs;
-        map<uint256, CTxIndex> mapUnused;
-        bool fInvalid = false;
-        if (!tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
+        FetchMempoolEntryInputs(txdb, tx, mapInputs);
+        return true;
+    }
+
+    map<uint256, CTxIndex> mapUnused;
+    bool fInvalid = false;
+    if (!tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
+    {
+        if (fInvalid)
+            return error("CTxMemPool::accept() : FetchInputs found invalid tx %s", hash.ToString().substr(0,10).c_str());
+        if (pfMissingInputs)
+            *pfMissingInputs = true;
+        return false;
+    }
+
+    // Check for non-standard pay-to-script-hash in inputs
+    if (!TestNet() && !tx.AreInputsStandard(mapInputs))
+        return error("CTxMemPool::accept() : nonstandard transaction input");
+
+    // Note: if you modify this code to accept non-standard transactions, then
+    // you should add code here to check that the transaction does a
+    // reasonable number of ECDSA signature verifications.
+
+    int64_t nFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
+    unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+
+    // Don't accept it if it can't get into a block
+    int64_t txMinFee = GetMinFee(tx, 1000, GMF_RELAY);
+    if (nFees < txMinFee)
+        return error("CTxMemPool::accept() : not enough fees %s, %" PRId64 " < %" PRId64,
+                     hash.ToString().c_str(),
+                     nFees, txMinFee);
+
+    // Nor if it pays less than what was evicted to keep the pool in its memory limit
+    int64_t nRollingMinFee = GetRollingMinFee(nMaxMempoolSize) * nSize / 1000;
+    if (nFees < nRollingMinFee)
+        return error("CTxMemPool::accept() : mempool min fee not met %s, %" PRId64 " < %" PRId64,
+                     hash.ToString().c_str(),
+                     nFees, nRollingMinFee);
+
+    // Keep chains of unconfirmed transactions short, so the aggregate
+    // updates of adding and removing one stay cheap
+    set<uint256> setAncestors;
+    CalculateAncestors(tx, setAncestors);
+    if (setAncestors.size() + 1 > nMempoolAncestorLimit)
+        return error("CTxMemPool::accept() : too many unconfirmed ancestors %s, %u > %u",
+                     hash.ToString().c_str(), (unsigned int)setAncestors.size() + 1, nMempoolAncestorLimit);
+    {
+        LOCK(cs);
+        for (const uint256& hashAncestor : setAncestors)
         {
-            if (fInvalid)
-                return error("CTxMemPool::accept() : FetchInputs found invalid tx %s", hash.ToString().substr(0,10).c_str());
-            if (pfMissingInputs)
-                *pfMissingInputs = true;
-            return false;
+            txiter it = mapTx.find(hashAncestor);
+            if (it->GetCountWithDescendants() + 1 > nMempoolDescendantLimit)
+                return error("CTxMemPool::accept() : too many unconfirmed descendants of %s for %s",
+                             hashAncestor.ToString().c_str(), hash.ToString().c_str());
         }
+    }
+    return true;
+}
 
-        // Check for non-standard pay-to-script-hash in inputs
-        if (!TestNet() && !tx.AreInputsStandard(mapInputs))
-            return error("CTxMemPool::accept() : nonstandard transaction input");
+// Continuously rate-limit free transactions
+// This mitigates 'penny-flooding' -- sending thousands of free transactions just to
+// be annoying or make others' transactions take longer to confirm.
+// fCount false only asks whether tx would get through.
+static bool RateLimitFreeTx(CTransaction& tx, const MapPrevTx& mapInputs, bool fCount)
+{
+    int64_t nFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
+    if (nFees >= MIN_RELAY_TX_FEE)
+        return true;
 
-        // Note: if you modify this code to accept non-standard transactions, then
-        // you should add code here to check that the transaction does a
-        // reasonable number of ECDSA signature verifications.
+    static CCriticalSection cs;
+    static double dFreeCount;
+    static int64_t nLastTime;
+    int64_t nNow = GetTime();
+    unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
 
-        int64_t nFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
-        unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    LOCK(cs);
+    // Use an exponentially decaying ~10-minute window:
+    dFreeCount *= pow(1.0 - 1.0/600.0, (double)(nNow - nLastTime));
+    nLastTime = nNow;
+    // -limitfreerelay unit is thousand-bytes-per-minute
+    // At default rate it would take over a month to fill 1GB
+    if (dFreeCount > GetArg("-limitfreerelay", 15)*10*1000 && !IsFromMe(tx))
+        return error("CTxMemPool::accept() : free transaction rejected by rate limiter");
+    if (!fCount)
+        return true;
+    if (fDebug)
+        LogPrintf("Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount+nSize);
+    dFreeCount += nSize;
+    return true;
+}
 
-        // Don't accept it if it can't get into a block
-        int64_t txMinFee = GetMinFee(tx, 1000, GMF_RELAY);
-        if (nFees < txMinFee)
-            return error("CTxMemPool::accept() : not enough fees %s, %" PRId64 " < %" PRId64,
-                         hash.ToString().c_str(),
-                         nFees, txMinFee);
+bool CTxMemPool::PreAccept(CTxDB& txdb, CTransaction &tx, bool* pfMissingInputs, vector<CScriptCheck>& vChecks)
+{
+    MapPrevTx mapInputs;
+    const CTransaction* ptxOld;
+    if (!CheckAccept(txdb, tx, true, pfMissingInputs, mapInputs, ptxOld))
+        return false;
+    if (!RateLimitFreeTx(tx, mapInputs, false))
+        return false;
 
-        // Continuously rate-limit free transactions
-        // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
-        // be annoying or make others' transactions take longer to confirm.
-        if (nFees < MIN_RELAY_TX_FEE)
-        {
-            static CCriticalSection cs;
-            static double dFreeCount;
-            static int64_t nLastTime;
-            int64_t nNow = GetTime();
+    map<uint256, CTxIndex> mapUnused;
+    if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, &vChecks))
+        return error("CTxMemPool::accept() : ConnectInputs failed %s", tx.GetHash().ToString().substr(0,10).c_str());
+    return true;
+}
 
-            {
-                LOCK(cs);
-                // Use an exponentially decaying ~10-minute window:
-                dFreeCount *= pow(1.0 - 1.0/600.0, (double)(nNow - nLastTime));
-                nLastTime = nNow;
-                // -limitfreerelay unit is thousand-bytes-per-minute
-                // At default rate it would take over a month to fill 1GB
-                if (dFreeCount > GetArg("-limitfreerelay", 15)*10*1000 && !IsFromMe(tx))
-                    return error("CTxMemPool::accept() : free transaction rejected by rate limiter");
-                if (fDebug)
-                    LogPrintf("Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount+nSize);
-                dFreeCount += nSize;
-            }
-        }
+bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
+                        bool* pfMissingInputs, int64_t nAcceptTime, bool fScriptsChecked)
+{
+    uint256 hash = tx.GetHash();
+    MapPrevTx mapInputs;
+    const CTransaction* ptxOld;
+    if (!CheckAccept(txdb, tx, fCheckInputs, pfMissingInputs, mapInputs, ptxOld))
+        return false;
+
+    if (fCheckInputs)
+    {
+        if (!RateLimitFreeTx(tx, mapInputs, true))
+            return false;
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false))
+        // Inputs are named by txid, so the scripts they hold can't have
+        // changed since PreAccept: if those were checked they are skipped.
+        map<uint256, CTxIndex> mapUnused;
+        vector<CScriptCheck> vChecksDone;
+        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, fScriptsChecked ? &vChecksDone : NULL))
         {
             return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().substr(0,10).c_str());
         }
     }
 
     // Store transaction in memory
+    uint256 hashOld;
     {
         LOCK(cs);
         if (ptxOld)
         {
-            LogPrintf("CTxMemPool::accept() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
-            remove(*ptxOld);
+            hashOld = ptxOld->GetHash();
+            LogPrintf("CTxMemPool::accept() : replacing tx %s with new version\n", hashOld.ToString().c_str());
+            remove(hashOld);
         }
-        addUnchecked(hash, tx);
+        addUnchecked(hash, CTxMemPoolEntry(tx, mapInputs, nAcceptTime ? nAcceptTime : GetTime(), nBestHeight));
+
+        // Over the limit the lowest fee rate packages go, possibly this one
+        TrimToSize(nMaxMempoolSize);
+        if (!exists(hash))
+            return error("CTxMemPool::accept() : mempool full, %s evicted", hash.ToString().c_str());
     }
 
     ///// are we sure this is ok when loading transactions or restoring block txes
     // If updated, erase old tx from wallet
     if (ptxOld)
-        EraseFromWallets(ptxOld->GetHash());
+        EraseFromWallets(hashOld);
 
     LogPrint("mempool", "CTxMemPool::accept() : accepted %s (poolsz %u)\n",
            hash.ToString().substr(0,10).c_str(),
@@ -843,13 +1302,54 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
 }
 
 bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+{
+    CTxDB txdb("r");
+    MapPrevTx mapInputs;
+    FetchMempoolEntryInputs(txdb, tx, mapInputs);
+    return addUnchecked(hash, CTxMemPoolEntry(tx, mapInputs, GetTime(), nBestHeight));
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
     {
-        mapTx[hash] = tx;
+        LOCK(cs);
+        txiter it = mapTx.insert(entry).first;
+        nTotalTxSize += entry.GetTxSize();
+        nCachedInnerUsage += entry.GetDynamicMemoryUsage();
+        const CTransaction& tx = it->GetTx();
         for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+            mapNextTx[tx.vin[i].prevout] = CInPoint(it->GetSharedTx(), i);
+
+        set<uint256> setAncestors, setDescendants;
+        CalculateAncestors(tx, setAncestors);
+        CalculateDescendants(hash, setDescendants);
+        if (setDescendants.empty())
+        {
+            // The usual case: the new transaction is a leaf
+            int64_t nCount = 0, nSize = 0, nFees = 0;
+            for (const uint256& hashAncestor : setAncestors)
+            {
+                txiter itAncestor = mapTx.find(hashAncestor);
+                nCount++;
+                nSize += itAncestor->GetTxSize();
+                nFees += itAncestor->GetFee();
+                mapTx.modify(itAncestor, update_descendant_state(1, (int64_t)entry.GetTxSize(), entry.GetFee()));
+            }
+            mapTx.modify(it, update_ancestor_state(nCount, nSize, nFees));
+        }
+        else
+        {
+            // Its children got here first (added back by a reorg), so
+            // ancestors and descendants may now be linked along more than
+            // one path. Recount everything it touches.
+            UpdateAggregates(hash);
+            for (const uint256& hashAncestor : setAncestors)
+                UpdateAggregates(hashAncestor);
+            for (const uint256& hashDescendant : setDescendants)
+                UpdateAggregates(hashDescendant);
+        }
         nTransactionsUpdated++;
     }
     return true;
@@ -857,60 +1357,423 @@ bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
 
 
 bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
+{
+    return remove(tx.GetHash(), fRecursive);
+}
+
+// Pool transactions are walked by their memoized txids, never rehashed
+bool CTxMemPool::remove(uint256 hash, bool fRecursive)
 {
     // Remove transaction from memory pool
     {
         LOCK(cs);
-        uint256 hash = tx.GetHash();
         if (mapTx.count(hash))
         {
-            if (fRecursive) {
-                for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                    if (it != mapNextTx.end())
-                        remove(*it->second.ptx, true);
-                }
-            }
-            for (const CTxIn& txin : tx.vin)
-                mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
+            if (fRecursive) {
+                for (unsigned int i = 0; i < mapTx.find(hash)->GetTx().vout.size(); i++) {
+                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+                    if (it != mapNextTx.end())
+                        remove(it->second.ptx->GetCachedHash(), true);
+                }
+            }
+
+            // Take it out of the aggregates of everything related to it
+            txiter it = mapTx.find(hash);
+            set<uint256> setAncestors, setDescendants;
+            CalculateAncestors(it->GetTx(), setAncestors);
+            CalculateDescendants(hash, setDescendants);
+            for (const uint256& hashAncestor : setAncestors)
+                mapTx.modify(mapTx.find(hashAncestor), update_descendant_state(-1, -(int64_t)it->GetTxSize(), -it->GetFee()));
+            for (const uint256& hashDescendant : setDescendants)
+                mapTx.modify(mapTx.find(hashDescendant), update_ancestor_state(-1, -(int64_t)it->GetTxSize(), -it->GetFee()));
+
+            for (const CTxIn& txin : it->GetTx().vin)
+                mapNextTx.erase(txin.prevout);
+            nTotalTxSize -= it->GetTxSize();
+            nCachedInnerUsage -= it->GetDynamicMemoryUsage();
+            mapTx.erase(it);
+            nTransactionsUpdated++;
+            nTransactionsRemoved++;
+        }
+    }
+    return true;
+}
+
+bool CTxMemPool::removeConflicts(const CTransaction &tx)
+{
+    // Remove transactions which depend on inputs of tx, recursively
+    LOCK(cs);
+    for (const CTxIn &txin : tx.vin) {
+        std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(txin.prevout);
+        if (it != mapNextTx.end()) {
+            if (*it->second.ptx != tx)
+                remove(it->second.ptx->GetCachedHash(), true);
+        }
+    }
+    return true;
+}
+
+void CTxMemPool::clear()
+{
+    LOCK(cs);
+    mapTx.clear();
+    mapNextTx.clear();
+    nTotalTxSize = 0;
+    nCachedInnerUsage = 0;
+    ++nTransactionsUpdated;
+    ++nTransactionsRemoved;
+}
+
+void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
+{
+    vtxid.clear();
+
+    LOCK(cs);
+    vtxid.reserve(mapTx.size());
+    for (txiter mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+        vtxid.push_back(mi->GetHash());
+}
+
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    // Each of the four indexes of mapTx adds three pointers to an entry's node
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 12 * sizeof(void*)) * mapTx.size() +
+        memusage::DynamicUsage(mapNextTx) + nCachedInnerUsage;
+}
+
+void CTxMemPool::TrimToSize(size_t nSizeLimit)
+{
+    LOCK(cs);
+    unsigned int nEvicted = 0;
+    while (!mapTx.empty() && DynamicMemoryUsage() > nSizeLimit)
+    {
+        // The package with the lowest descendant score, and everything in it
+        const CTxMemPoolEntry& entry = *mapTx.get<descendant_score>().rbegin();
+
+        // Whatever comes next has to pay more than the package did
+        int64_t nFeeRate = entry.GetFeesWithDescendants() * 1000 / (int64_t)entry.GetSizeWithDescendants() + MIN_RELAY_TX_FEE;
+        if (nFeeRate > dRollingMinimumFeeRate)
+        {
+            dRollingMinimumFeeRate = nFeeRate;
+            nLastRollingFeeUpdate = GetTime();
+        }
+
+        nEvicted += entry.GetCountWithDescendants();
+        remove(entry.GetHash(), true);
+    }
+    if (nEvicted > 0)
+        LogPrint("mempool", "CTxMemPool::TrimToSize() : evicted %u transactions, min fee now %.0f per kB\n", nEvicted, dRollingMinimumFeeRate);
+}
+
+int64_t CTxMemPool::GetRollingMinFee(size_t nSizeLimit)
+{
+    LOCK(cs);
+    if (dRollingMinimumFeeRate == 0)
+        return 0;
+
+    int64_t nNow = GetTime();
+    if (nNow > nLastRollingFeeUpdate + 10)
+    {
+        double dHalfLife = ROLLING_FEE_HALFLIFE;
+        size_t nUsage = DynamicMemoryUsage();
+        if (nUsage < nSizeLimit / 4)
+            dHalfLife /= 4;
+        else if (nUsage < nSizeLimit / 2)
+            dHalfLife /= 2;
+        dRollingMinimumFeeRate /= pow(2.0, (nNow - nLastRollingFeeUpdate) / dHalfLife);
+        nLastRollingFeeUpdate = nNow;
+
+        // Back to the relay fee alone
+        if (dRollingMinimumFeeRate < MIN_RELAY_TX_FEE / 2)
+        {
+            dRollingMinimumFeeRate = 0;
+            return 0;
+        }
+    }
+    return (int64_t)dRollingMinimumFeeRate;
+}
+
+void CTxMemPool::CalculateAncestors(const CTransaction& tx, set<uint256>& setAncestors) const
+{
+    LOCK(cs);
+    vector<const CTransaction*> vToVisit(1, &tx);
+    while (!vToVisit.empty())
+    {
+        const CTransaction* ptx = vToVisit.back();
+        vToVisit.pop_back();
+        for (const CTxIn& txin : ptx->vin)
+        {
+            txiter it = mapTx.find(txin.prevout.hash);
+            if (it != mapTx.end() && setAncestors.insert(it->GetHash()).second)
+                vToVisit.push_back(&it->GetTx());
+        }
+    }
+}
+
+void CTxMemPool::CalculateDescendants(const uint256& hash, set<uint256>& setDescendants) const
+{
+    LOCK(cs);
+    vector<uint256> vToVisit(1, hash);
+    while (!vToVisit.empty())
+    {
+        uint256 hashParent = vToVisit.back();
+        vToVisit.pop_back();
+        txiter it = mapTx.find(hashParent);
+        if (it == mapTx.end())
+            continue;
+        for (unsigned int i = 0; i < it->GetTx().vout.size(); i++)
+        {
+            std::map<COutPoint, CInPoint>::const_iterator mi = mapNextTx.find(COutPoint(hashParent, i));
+            if (mi == mapNextTx.end())
+                continue;
+            uint256 hashChild = mi->second.ptx->GetCachedHash();
+            if (setDescendants.insert(hashChild).second)
+                vToVisit.push_back(hashChild);
+        }
+    }
+}
+
+void CTxMemPool::UpdateAggregates(const uint256& hash)
+{
+    txiter it = mapTx.find(hash);
+    set<uint256> setAncestors, setDescendants;
+    CalculateAncestors(it->GetTx(), setAncestors);
+    CalculateDescendants(hash, setDescendants);
+
+    // Reset to the entry alone, then add the others back
+    int64_t nCount = 1 - (int64_t)it->GetCountWithAncestors();
+    int64_t nSize = it->GetTxSize() - (int64_t)it->GetSizeWithAncestors();
+    int64_t nFees = it->GetFee() - it->GetFeesWithAncestors();
+    for (const uint256& hashAncestor : setAncestors)
+    {
+        txiter itAncestor = mapTx.find(hashAncestor);
+        nCount++;
+        nSize += itAncestor->GetTxSize();
+        nFees += itAncestor->GetFee();
+    }
+    mapTx.modify(it, update_ancestor_state(nCount, nSize, nFees));
+
+    nCount = 1 - (int64_t)it->GetCountWithDescendants();
+    nSize = it->GetTxSize() - (int64_t)it->GetSizeWithDescendants();
+    nFees = it->GetFee() - it->GetFeesWithDescendants();
+    for (const uint256& hashDescendant : setDescendants)
+    {
+        txiter itDescendant = mapTx.find(hashDescendant);
+        nCount++;
+        nSize += itDescendant->GetTxSize();
+        nFees += itDescendant->GetFee();
+    }
+    mapTx.modify(it, update_descendant_state(nCount, nSize, nFees));
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& txIn, const MapPrevTx& mapInputs, int64_t nTimeIn, unsigned int nHeight) :
+    tx(MakeTransactionRef(txIn)), nTime(nTimeIn), nEntryHeight(nHeight)
+{
+    nTxSize = ::GetSerializeSize(txIn, SER_NETWORK, PROTOCOL_VERSION);
+
+    int64_t nValueIn = 0;
+    dEntryPriority = 0;
+    nInChainInputValue = 0;
+    for (const CTxIn& txin : txIn.vin)
+    {
+        MapPrevTx::const_iterator mi = mapInputs.find(txin.prevout.hash);
+        if (mi == mapInputs.end() || txin.prevout.n >= mi->second.second.vout.size())
+            continue;
+        int64_t nValue = mi->second.second.vout[txin.prevout.n].nValue;
+        nValueIn += nValue;
+
+        // Inputs from other memory pool transactions add no priority yet
+        const CTxIndex& txindex = mi->second.first;
+        if (txindex.pos.IsNull() || txindex.pos == CDiskTxPos(1,1,1))
+            continue;
+        int nConf = txindex.GetDepthInMainChain();
+        if (nConf > 0)
+        {
+            dEntryPriority += (double)nValue * nConf;
+            nInChainInputValue += nValue;
+        }
+    }
+    dEntryPriority /= std::max(nTxSize, 1U);
+
+    nUsageSize = memusage::DynamicUsage(tx) + memusage::DynamicUsage(txIn.vin) + memusage::DynamicUsage(txIn.vout);
+    for (const CTxIn& txin : txIn.vin)
+        nUsageSize += memusage::DynamicUsage(txin.scriptSig);
+    for (const CTxOut& txout : txIn.vout)
+        nUsageSize += memusage::DynamicUsage(txout.scriptPubKey);
+    nFee = txIn.IsBeanBase() ? 0 : nValueIn - txIn.GetValueOut();
+
+    nCountWithAncestors = nCountWithDescendants = 1;
+    nSizeWithAncestors = nSizeWithDescendants = nTxSize;
+    nFeesWithAncestors = nFeesWithDescendants = nFee;
+}
+
+double CTxMemPoolEntry::GetPriority(unsigned int nCurrentHeight) const
+{
+    if (nCurrentHeight <= nEntryHeight)
+        return dEntryPriority;
+    return dEntryPriority + (double)nInChainInputValue * (nCurrentHeight - nEntryHeight) / std::max(nTxSize, 1U);
+}
+
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+// Parents have fewer in-pool ancestors than their children, so sorting on
+// the count writes every parent before the transactions spending it
+struct CompareTxMemPoolEntryByAncestorCount
+{
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        return a.GetCountWithAncestors() < b.GetCountWithAncestors();
+    }
+};
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMillis();
+
+    vector<CTxMemPoolEntry> vEntries;
+    {
+        LOCK(mempool.cs);
+        vEntries.assign(mempool.mapTx.begin(), mempool.mapTx.end());
+    }
+    sort(vEntries.begin(), vEntries.end(), CompareTxMemPoolEntryByAncestorCount());
+
+    // Same layout as peers.dat: magic, data, then a checksum of both
+    CDataStream ssMempool(SER_DISK, CLIENT_VERSION);
+    ssMempool << FLATDATA(Params().MessageStart());
+    ssMempool << MEMPOOL_DUMP_VERSION;
+    ssMempool << (uint64_t)vEntries.size();
+    for (const CTxMemPoolEntry& entry : vEntries)
+        ssMempool << entry.GetTx() << entry.GetTime() << entry.GetFee();
+    uint256 hash = Hash(ssMempool.begin(), ssMempool.end());
+    ssMempool << hash;
+
+    unsigned short randv = 0;
+    RAND_bytes((unsigned char *)&randv, sizeof(randv));
+    filesystem::path pathTmp = GetDataDir() / strprintf("mempool.dat.%04x", randv);
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("DumpMempool() : open failed");
+    try {
+        fileout << ssMempool;
+    }
+    catch (std::exception &e) {
+        fileout.fclose();
+        boost::system::error_code ec;
+        filesystem::remove(pathTmp, ec);
+        return error("DumpMempool() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, GetDataDir() / "mempool.dat"))
+    {
+        boost::system::error_code ec;
+        filesystem::remove(pathTmp, ec);
+        return error("DumpMempool() : Rename-into-place failed");
+    }
+
+    LogPrintf("Dumped mempool: %u transactions in %dms\n", vEntries.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool LoadMempool()
+{
+    int64_t nStart = GetTimeMillis();
+
+    filesystem::path path = GetDataDir() / "mempool.dat";
+    if (!filesystem::exists(path))
+        return true;
+    FILE *file = fopen(path.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("LoadMempool() : open failed");
+
+    // Magic, version and count come before the checksum in any valid dump
+    uint64_t nFileSize = filesystem::file_size(path);
+    if (nFileSize <= sizeof(uint256))
+        return error("LoadMempool() : file too small");
+    vector<unsigned char> vchData(nFileSize - sizeof(uint256));
+    uint256 hashIn;
+    try {
+        filein.read((char *)&vchData[0], vchData.size());
+        filein >> hashIn;
+    }
+    catch (std::exception &e) {
+        return error("LoadMempool() : I/O error or stream data corrupted");
+    }
+    filein.fclose();
+
+    CDataStream ssMempool(vchData, SER_DISK, CLIENT_VERSION);
+    if (Hash(ssMempool.begin(), ssMempool.end()) != hashIn)
+        return error("LoadMempool() : checksum mismatch; data corrupted");
+
+    unsigned char pchMsgTmp[4];
+    uint64_t nVersion, nCount;
+    try {
+        ssMempool >> FLATDATA(pchMsgTmp) >> nVersion >> nCount;
+    }
+    catch (std::exception &e) {
+        return error("LoadMempool() : stream data corrupted");
+    }
+    if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)))
+        return error("LoadMempool() : invalid network magic number");
+    if (nVersion != MEMPOOL_DUMP_VERSION)
+        return error("LoadMempool() : unknown version %" PRIu64, nVersion);
+
+    // Each transaction goes through the full checks again: the chain may
+    // have moved on while the node was down
+    int nAccepted = 0, nFailed = 0, nAlreadyThere = 0;
+    CTxDB txdb("r");
+    for (uint64_t i = 0; i < nCount && !ShutdownRequested(); i++)
+    {
+        CTransaction tx;
+        int64_t nTime, nFee;
+        try {
+            ssMempool >> tx >> nTime >> nFee;
+        }
+        catch (std::exception &e) {
+            return error("LoadMempool() : stream data corrupted");
+        }
+
+        LOCK(cs_main);
+        uint256 hash = tx.GetHash();
+        if (mempool.exists(hash))
+        {
+            nAlreadyThere++;
+            continue;
         }
-    }
-    return true;
-}
 
-bool CTxMemPool::removeConflicts(const CTransaction &tx)
-{
-    // Remove transactions which depend on inputs of tx, recursively
-    LOCK(cs);
-    for (const CTxIn &txin : tx.vin) {
-        std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(txin.prevout);
-        if (it != mapNextTx.end()) {
-            const CTransaction &txConflict = *it->second.ptx;
-            if (txConflict != tx)
-                remove(txConflict, true);
+        // The saved fee turns away what the pool no longer has room for
+        // before looking up inputs and checking signatures
+        unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        if (nFee < mempool.GetRollingMinFee(nMaxMempoolSize) * nSize / 1000 ||
+            !mempool.accept(txdb, tx, true, NULL, nTime))
+        {
+            nFailed++;
+            continue;
         }
+        nAccepted++;
     }
+
+    LogPrintf("Loaded mempool: %d accepted, %d failed, %d already there in %dms\n",
+        nAccepted, nFailed, nAlreadyThere, GetTimeMillis() - nStart);
     return true;
 }
 
-void CTxMemPool::clear()
+void CTxMemPoolEntry::UpdateAncestorState(int64_t nCountDelta, int64_t nSizeDelta, int64_t nFeeDelta)
 {
-    LOCK(cs);
-    mapTx.clear();
-    mapNextTx.clear();
-    ++nTransactionsUpdated;
+    nCountWithAncestors += nCountDelta;
+    nSizeWithAncestors += nSizeDelta;
+    nFeesWithAncestors += nFeeDelta;
 }
 
-void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
+void CTxMemPoolEntry::UpdateDescendantState(int64_t nCountDelta, int64_t nSizeDelta, int64_t nFeeDelta)
 {
-    vtxid.clear();
-
-    LOCK(cs);
-    vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
-        vtxid.push_back((*mi).first);
+    nCountWithDescendants += nCountDelta;
+    nSizeWithDescendants += nSizeDelta;
+    nFeesWithDescendants += nFeeDelta;
 }
 
 
@@ -922,7 +1785,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
         return 0;
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1007,18 +1870,10 @@ bool CWalletTx::AcceptWalletTransaction()
 
 int CTxIndex::GetDepthInMainChain() const
 {
-    // Read block header
-    CBlock block;
-    if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
-        return 0;
-    // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
-    if (mi == mapBlockIndex.end())
-        return 0;
-    CBlockIndex* pindex = (*mi).second;
-    if (!pindex || !pindex->IsInMainChain())
+    CBlockIndex* pindex = GetBlockIndexAtPos(pos.nFile, pos.nBlockPos);
+    if (!chainActive.Contains(pindex))
         return 0;
-    return 1 + nBestHeight - pindex->nHeight;
+    return 1 + chainActive.Height() - pindex->nHeight;
 }
 
 // Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock
@@ -1075,22 +1930,48 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
+static const uint64_t nBlockHasherK0 = GetRand(std::numeric_limits<uint64_t>::max());
+static const uint64_t nBlockHasherK1 = GetRand(std::numeric_limits<uint64_t>::max()) | 1;
+
+size_t BlockHasher::operator()(const uint256& hash) const
+{
+    uint64_t n = (hash.Get64(0) ^ nBlockHasherK0) * nBlockHasherK1 + hash.Get64(1);
+    return (size_t)(n ^ (n >> 32));
+}
+
+void CChain::SetTip(CBlockIndex *pindex)
+{
+    if (pindex == NULL)
+    {
+        vChain.clear();
+        return;
+    }
+    vChain.resize(pindex->nHeight + 1);
+    while (pindex && vChain[pindex->nHeight] != pindex)
+    {
+        vChain[pindex->nHeight] = pindex;
+        pindex = pindex->pprev;
+    }
+}
+
+static bool CompareBlockPos(const CBlockIndex* pindex, const pair<unsigned int, unsigned int>& pos)
+{
+    return make_pair(pindex->nFile, pindex->nBlockPos) < pos;
+}
+
+CBlockIndex *CChain::FindByPos(unsigned int nFile, unsigned int nBlockPos) const
+{
+    // A block is only written once its parent is, so positions grow along a chain
+    pair<unsigned int, unsigned int> pos(nFile, nBlockPos);
+    vector<CBlockIndex*>::const_iterator it = lower_bound(vChain.begin(), vChain.end(), pos, CompareBlockPos);
+    if (it == vChain.end() || (*it)->nFile != nFile || (*it)->nBlockPos != nBlockPos)
+        return NULL;
+    return *it;
+}
+
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    return chainActive[nHeight];
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -1327,6 +2208,12 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
             // Write back
             if (!txdb.UpdateTxIndex(prevout.hash, txindex))
                 return error("DisconnectInputs() : UpdateTxIndex failed");
+
+            // The previous transaction has an unspent output again, so it
+            // must be back in the coins table
+            CCoins coins;
+            if (!txdb.ReadCoins(prevout.hash, coins) || !txdb.WriteCoins(prevout.hash, coins))
+                return error("DisconnectInputs() : WriteCoins failed");
         }
     }
 
@@ -1335,6 +2222,7 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
     // reorganized away. This is only possible if this transaction was completely
     // spent, so erasing it would be a no-op anyway.
     txdb.EraseTxIndex(*this);
+    txdb.EraseCoins(GetHash());
 
     return true;
 }
@@ -1374,21 +2262,23 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
         if (!fFound && (fBlock || fMiner))
             return fMiner ? false : error("FetchInputs() : %s prev tx %s index entry not found", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
 
-        // Read txPrev
-        CTransaction& txPrev = inputsRet[prevout.hash].second;
+        // Read the outputs of txPrev
+        CCoins& coinsPrev = inputsRet[prevout.hash].second;
         if (!fFound || txindex.pos == CDiskTxPos(1,1,1))
         {
             // Get prev tx from single transactions in memory
+            CTransaction txPrev;
             if (!mempool.lookup(prevout.hash, txPrev))
                 return error("FetchInputs() : %s mempool Tx prev not found %s", GetHash().ToString().substr(0,10).c_str(),prevout.hash.ToString().substr(0,10).c_str());
+            coinsPrev = CCoins(txPrev);
             if (!fFound)
-                txindex.vSpent.resize(txPrev.vout.size());
+                txindex.vSpent.resize(coinsPrev.vout.size());
         }
         else
         {
-            // Get prev tx from disk
-            if (!txPrev.ReadFromDisk(txindex.pos))
-                return error("FetchInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
+            // Get prev outputs from the coins cache, falling back to disk
+            if (!txdb.ReadCoins(prevout.hash, coinsPrev))
+                return error("FetchInputs() : %s ReadCoins prev tx %s failed", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
         }
     }
 
@@ -1398,7 +2288,7 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
         const COutPoint prevout = vin[i].prevout;
         assert(inputsRet.count(prevout.hash) != 0);
         const CTxIndex& txindex = inputsRet[prevout.hash].first;
-        const CTransaction& txPrev = inputsRet[prevout.hash].second;
+        const CCoins& txPrev = inputsRet[prevout.hash].second;
         if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.vSpent.size())
         {
             // Revisit this if/when transaction replacement is implemented and allows
@@ -1417,7 +2307,7 @@ const CTxOut& CTransaction::GetOutputFor(const CTxIn& input, const MapPrevTx& in
     if (mi == inputs.end())
         throw std::runtime_error("CTransaction::GetOutputFor() : prevout.hash not found");
 
-    const CTransaction& txPrev = (mi->second).second;
+    const CCoins& txPrev = (mi->second).second;
     if (input.prevout.n >= txPrev.vout.size())
         throw std::runtime_error("CTransaction::GetOutputFor() : prevout.n out of range");
 
@@ -1454,7 +2344,7 @@ unsigned int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
 }
 
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner)
+    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, std::vector<CScriptCheck> *pvChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1469,7 +2359,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             COutPoint prevout = vin[i].prevout;
             assert(inputs.count(prevout.hash) > 0);
             CTxIndex& txindex = inputs[prevout.hash].first;
-            CTransaction& txPrev = inputs[prevout.hash].second;
+            CCoins& txPrev = inputs[prevout.hash].second;
 
             if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.vSpent.size())
                 return DoS(100, error("ConnectInputs() : %s prevout.n out of range %d %u %u prev tx %s\n%s", GetHash().ToString().substr(0,10).c_str(), prevout.n, txPrev.vout.size(), txindex.vSpent.size(), prevout.hash.ToString().substr(0,10).c_str(), txPrev.ToString().c_str()));
@@ -1498,7 +2388,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             COutPoint prevout = vin[i].prevout;
             assert(inputs.count(prevout.hash) > 0);
             CTxIndex& txindex = inputs[prevout.hash].first;
-            CTransaction& txPrev = inputs[prevout.hash].second;
+            CCoins& txPrev = inputs[prevout.hash].second;
 
             // Check for conflicts (double-spend)
             // This doesn't trigger the DoS code on purpose; if it did, it would make it easier
@@ -1512,7 +2402,13 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
                 // Verify signature
-                if (!VerifySignature(txPrev, *this, i, 0))
+                CScriptCheck check(txPrev, *this, i, 0);
+                if (pvChecks)
+                {
+                    pvChecks->push_back(CScriptCheck());
+                    check.swap(pvChecks->back());
+                }
+                else if (!check())
                 {
                     return DoS(100,error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,10).c_str()));
                 }
@@ -1553,6 +2449,15 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
 }
 
 
+bool CScriptCheck::operator()() const
+{
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nHashType))
+        return error("CScriptCheck() : %s VerifySignature failed on input %u", ptxTo->GetHash().ToString().substr(0,10).c_str(), nIn);
+    return true;
+}
+
+
 bool CTransaction::ClientConnectInputs()
 {
     if (IsBeanBase())
@@ -1603,6 +2508,18 @@ bool CTransaction::ClientConnectInputs()
 
 bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
+    // Restore the coins this block spent completely, so disconnecting the
+    // inputs finds them without going back to the block files
+    CBlockUndo undo;
+    if (txdb.ReadBlockUndo(pindex->GetBlockHash(), undo))
+    {
+        for (const PAIRTYPE(uint256, CCoins)& item : undo.vSpentCoins)
+            if (!txdb.WriteCoins(item.first, item.second))
+                return error("DisconnectBlock() : WriteCoins failed");
+        if (!txdb.EraseBlockUndo(pindex->GetBlockHash()))
+            return error("DisconnectBlock() : EraseBlockUndo failed");
+    }
+
     // Disconnect in reverse order
     for (int i = vtx.size()-1; i >= 0; i--)
         if (!vtx[i].DisconnectInputs(txdb))
@@ -1625,6 +2542,37 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     return true;
 }
 
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck() {
+    RenameThread("beancash-scriptch");
+    scriptcheckqueue.Thread();
+}
+
+bool CheckInputScripts(vector<CScriptCheck>& vChecks)
+{
+    if (!nScriptCheckThreads)
+    {
+        for (const CScriptCheck& check : vChecks)
+            if (!check())
+                return false;
+        return true;
+    }
+
+    // Waits while a block is being connected, which shares the queue
+    CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+    control.Add(vChecks);
+    return control.Wait();
+}
+
+void ThreadVerifyBlockIndex()
+{
+    RenameThread("beancash-verify");
+    CTxDB txdb("r");
+    if (!txdb.VerifyBlockIndex(GetArg("-checklevel", 1), GetArg("-checkblocks", 600), true))
+        LogPrintf("ThreadVerifyBlockIndex() : block verification failed, restart without -asynccheck for details\n");
+}
+
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 {
     // Check it again in case a previous version let a bad block in, but skip BlockSig checking
@@ -1640,7 +2588,10 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     else
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+
     map<uint256, CTxIndex> mapQueuedChanges;
+    map<uint256, const CTransaction*> mapBlockTx;
     int64_t nFees = 0;
     int64_t nValueIn = 0;
     int64_t nValueOut = 0;
@@ -1702,11 +2653,14 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             if (tx.IsBeanStake())
                 nStakeReward = nTxValueOut - nTxValueIn;
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false))
+            std::vector<CScriptCheck> vChecks;
+            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
+            control.Add(vChecks);
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
+        mapBlockTx[hashTx] = &tx;
     }
 
     if (IsProofOfWork())
@@ -1731,6 +2685,10 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return DoS(100, error("ConnectBlock() : beansprout pays too much(actual=%" PRId64 " vs calculated=%" PRId64 ")", nStakeReward, nCalculatedStakeReward));
     }
 
+    // Wait for the queued script checks before anything is written for this block
+    if (!control.Wait())
+        return DoS(100, error("ConnectBlock() : %s script verification failed", GetHash().ToString().substr(0,20).c_str()));
+
     // ppbean: track money supply and mint amount info
     pindex->nMint = nValueOut - nValueIn + nFees;
     pindex->nMoneySupply = (pindex->pprev? pindex->pprev->nMoneySupply : 0) + nValueOut - nValueIn;
@@ -1740,12 +2698,43 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     if (fJustCheck)
         return true;
 
-    // Write queued txindex changes
+    // Write queued txindex changes, and keep the coins table down to
+    // transactions that still have unspent outputs
+    CBlockUndo undo;
     for (map<uint256, CTxIndex>::iterator mi = mapQueuedChanges.begin(); mi != mapQueuedChanges.end(); ++mi)
     {
         if (!txdb.UpdateTxIndex((*mi).first, (*mi).second))
             return error("ConnectBlock() : UpdateTxIndex failed");
+
+        bool fSpent = true;
+        for (const CDiskTxPos& pos : (*mi).second.vSpent)
+            if (pos.IsNull())
+                fSpent = false;
+
+        map<uint256, const CTransaction*>::iterator it = mapBlockTx.find((*mi).first);
+        if (fSpent)
+        {
+            if (it == mapBlockTx.end())
+            {
+                // Pruning may delete the transaction, so remember its outputs
+                if (fPruneMode)
+                {
+                    undo.vSpentCoins.push_back(make_pair((*mi).first, CCoins()));
+                    if (!txdb.ReadCoins((*mi).first, undo.vSpentCoins.back().second))
+                        return error("ConnectBlock() : ReadCoins for undo failed");
+                }
+                if (!txdb.EraseCoins((*mi).first))
+                    return error("ConnectBlock() : EraseCoins failed");
+            }
+        }
+        else if (it != mapBlockTx.end())
+        {
+            if (!txdb.WriteCoins((*mi).first, CCoins(*it->second)))
+                return error("ConnectBlock() : WriteCoins failed");
+        }
     }
+    if (!undo.vSpentCoins.empty() && !txdb.WriteBlockUndo(pindex->GetBlockHash(), undo))
+        return error("ConnectBlock() : WriteBlockUndo failed");
 
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
@@ -1846,6 +2835,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     for (CBlockIndex* pindex : vConnect)
         if (pindex->pprev)
             pindex->pprev->pnext = pindex;
+    chainActive.SetTip(pindexNew);
 
     // Resurrect memory transactions that were in the disconnected branch
     for (CTransaction& tx : vResurrect)
@@ -1880,6 +2870,7 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 
     // Add to current best branch
     pindexNew->pprev->pnext = pindexNew;
+    chainActive.SetTip(pindexNew);
 
     // Delete redundant memory transactions
     for (CTransaction& tx : vtx)
@@ -1964,7 +2955,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
+    chainActive.SetTip(pindexNew);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
@@ -2024,19 +3015,20 @@ bool CTransaction::GetBeanAge(CTxDB& txdb, uint64_t& nBeanAge) const
 
     for (const CTxIn& txin : vin)
     {
-        // First try finding the previous transaction in database
-        CTransaction txPrev;
+        // First try finding the previous transaction's outputs in database;
+        // like the kernel check, this must work once its block file is pruned
+        CCoins txPrev;
         CTxIndex txindex;
-        if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+        if (!txdb.ReadTxIndex(txin.prevout.hash, txindex) || !txdb.ReadCoins(txin.prevout.hash, txPrev) || txin.prevout.n >= txPrev.vout.size())
             continue;  // previous transaction not in main chain
         if (nTime < txPrev.nTime)
             return false;  // Transaction timestamp violation
 
-        // Read block header
-        CBlock block;
-        if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-            return false; // unable to read block of previous transaction
-        if (block.GetBlockTime() + nStakeMinAge > nTime)
+        // Block time from the block index
+        CBlockIndex* pindexPrev = GetBlockIndexAtPos(txindex.pos.nFile, txindex.pos.nBlockPos);
+        if (!pindexPrev)
+            return false; // unable to find block of previous transaction
+        if (pindexPrev->GetBlockTime() + nStakeMinAge > nTime)
             continue; // only count beans meeting min age requirement
 
         int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
@@ -2083,11 +3075,12 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
         return error("AddToBlockIndex() : %s already exists", hash.ToString().substr(0,20).c_str());
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new(nothrow) CBlockIndex(nFile, nBlockPos, *this);
-    if (!pindexNew)
+    void* pmem = blockIndexArena.Allocate();
+    if (!pmem)
         return error("AddToBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = new(pmem) CBlockIndex(nFile, nBlockPos, *this);
     pindexNew->phashBlock = &hash;
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
@@ -2115,10 +3108,22 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
         //return error("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=0x%016" PRIx64, pindexNew->nHeight, nStakeModifier);
 
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
     pindexNew->phashBlock = &((*mi).first);
+    mapHeaders.erase(hash);
+
+    // Batch up index writes while catching up with the chain
+    if (!CTxDB::SetDeferCommit(IsInitialBlockDownload()))
+    {
+        string strMessage = _("Error: Failed to write the deferred block index and transaction data! Shutting down...");
+        strMiscWarning = strMessage;
+        LogPrintf("*** %s\n", strMessage.c_str());
+        uiInterface.ThreadSafeMessageBox(strMessage, "", CClientUIInterface::MSG_ERROR);
+        StartShutdown();
+        return error("AddToBlockIndex() : writing deferred commits failed");
+    }
 
     // Write to disk block index
     CTxDB txdb;
@@ -2244,7 +3249,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -2316,10 +3321,34 @@ bool CBlock::AcceptBlock()
     int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
     if (hashBestChain == hash)
     {
+        // Peers that asked for compact blocks get one right away instead of an inv
+        CInv inv(MSG_BLOCK, hash);
+        bool fCompact = !IsInitialBlockDownload() && vtx.size() <= MAX_COMPACT_BLOCK_TXS;
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        if (fCompact)
+            cmpctblock = CBlockHeaderAndShortTxIDs(*this);
+
         LOCK(cs_vNodes);
         for (CNode* pnode : vNodes)
-            if (nBestHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                pnode->PushInventory(CInv(MSG_BLOCK, hash));
+        {
+            if (nBestHeight <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                continue;
+            if (!fCompact || !pnode->fPreferCompactBlocks)
+            {
+                pnode->PushInventory(inv);
+                continue;
+            }
+            bool fKnown;
+            {
+                LOCK(pnode->cs_inventory);
+                fKnown = pnode->setInventoryKnown.count(inv);
+            }
+            if (!fKnown)
+            {
+                pnode->AddInventoryKnown(inv);
+                pnode->PushMessage("cmpctblock", cmpctblock);
+            }
+        }
     }
 
     // Check pending sync-checkpoint
@@ -2330,13 +3359,7 @@ bool CBlock::AcceptBlock()
 
 uint256 CBlockIndex::GetBlockTrust() const
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
-
-    if (bnTarget <= 0)
-        return 0;
-
-    return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
+    return GetBlockTrustFromBits(nBits);
 }
 
 bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned int nRequired, unsigned int nToCheck)
@@ -2425,8 +3448,9 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
         mapOrphanBlocks.insert(make_pair(hash, pblock2));
         mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
 
-        // Ask this guy to fill in what we're missing
-        if (pfrom)
+        // Ask this guy to fill in what we're missing, unless headers-first
+        // sync is already fetching it
+        if (pfrom && !mapHeaders.count(hash))
         {
             PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(pblock2));
             // getblocks may not obtain the ancestor block rejected
@@ -2463,6 +3487,13 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 
     LogPrintf("ProcessBlock: ACCEPTED\n");
 
+    // Peers will be asking for it as soon as it's announced
+    if (!IsInitialBlockDownload())
+        blockcache.Insert(hash, *pblock);
+
+    // A new block file may have pushed us over -prune
+    PruneBlockFiles();
+
     // If responsible for sync-checkpoint send it
     if (pfrom && !CSyncCheckpoint::strMasterPrivKey.empty())
         Checkpoints::SendSyncCheckpoint(Checkpoints::AutoSelectSyncCheckpoint());
@@ -2563,6 +3594,8 @@ static filesystem::path BlockFilePath(unsigned int nFile)
     return GetDataDir() / strBlockFn;
 }
 
+CBlockFileMap blockFileMap(BlockFilePath);
+
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode)
 {
     if ((nFile < 1) || (nFile == std::numeric_limits<uint32_t>::max()))
@@ -2581,26 +3614,378 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
     return file;
 }
 
+// Copy nSize bytes at nPos of block file nFile, from the map or else through
+// filein, which is opened on first use
+static bool ReadBlockFileBytes(unsigned int nFile, unsigned int nPos, char* pch, unsigned int nSize, CAutoFile& filein)
+{
+    if (nSize == 0)
+        return true;
+    if (!filein && blockFileMap.ReadBytes(nFile, nPos, pch, nSize))
+        return true;
+    if (!filein)
+        filein = OpenBlockFile(nFile, nPos, "rb");
+    else if (fseek(filein, nPos, SEEK_SET) != 0)
+        return false;
+    return filein && fread(pch, 1, nSize, filein) == nSize;
+}
+
+// The record is [message start][size][block], with nBlockPos at the block.
+// A compressed record has BLOCK_RECORD_COMPRESSED set in its size, and its
+// block is [raw size][compressed bytes].
+static bool ReadBlockRecordSize(unsigned int nFile, unsigned int nBlockPos, unsigned int& nSizeRet, CAutoFile& filein)
+{
+    const unsigned int nHeaderSize = MESSAGE_START_SIZE + sizeof(unsigned int);
+    if (nBlockPos < nHeaderSize)
+        return error("ReadBlockRecordSize() : bad block position %u:%u", nFile, nBlockPos);
+
+    unsigned char pchHeader[nHeaderSize];
+    if (!ReadBlockFileBytes(nFile, nBlockPos - nHeaderSize, (char*)pchHeader, nHeaderSize, filein))
+        return error("ReadBlockRecordSize() : short read at %u:%u", nFile, nBlockPos);
+    memcpy(&nSizeRet, pchHeader + MESSAGE_START_SIZE, sizeof(nSizeRet));
+    if (memcmp(pchHeader, Params().MessageStart(), MESSAGE_START_SIZE) != 0 || (nSizeRet & ~BLOCK_RECORD_COMPRESSED) > MAX_BLOCK_SIZE)
+        return error("ReadBlockRecordSize() : bad block record at %u:%u", nFile, nBlockPos);
+    return true;
+}
+
+bool IsBlockRecordCompressed(unsigned int nFile, unsigned int nBlockPos)
+{
+    // Nothing to look up until -compressblocks has been used at least once
+    if (!fBlockStoreCompressed)
+        return false;
+    CAutoFile filein = CAutoFile(NULL, SER_DISK, CLIENT_VERSION);
+    unsigned int nSize;
+    return ReadBlockRecordSize(nFile, nBlockPos, nSize, filein) && (nSize & BLOCK_RECORD_COMPRESSED);
+}
+
+bool ReadRawBlockFromDisk(CDataStream& ssBlock, unsigned int nFile, unsigned int nBlockPos, unsigned int nMaxSize)
+{
+    CAutoFile filein = CAutoFile(NULL, SER_DISK, CLIENT_VERSION);
+    unsigned int nSize;
+    if (!ReadBlockRecordSize(nFile, nBlockPos, nSize, filein))
+        return false;
+
+    // Copy straight into the message buffer, no CBlock in between
+    if (!(nSize & BLOCK_RECORD_COMPRESSED))
+    {
+        ssBlock.resize(std::min(nSize, nMaxSize));
+        if (!ReadBlockFileBytes(nFile, nBlockPos, ssBlock.empty() ? NULL : &ssBlock[0], ssBlock.size(), filein))
+            return error("ReadRawBlockFromDisk() : short read at %u:%u", nFile, nBlockPos);
+        return true;
+    }
+
+    nSize &= ~BLOCK_RECORD_COMPRESSED;
+    unsigned int nRawSize;
+    std::vector<char> vchCompressed(nSize);
+    if (nSize < sizeof(nRawSize) || !ReadBlockFileBytes(nFile, nBlockPos, &vchCompressed[0], nSize, filein))
+        return error("ReadRawBlockFromDisk() : short read at %u:%u", nFile, nBlockPos);
+    memcpy(&nRawSize, &vchCompressed[0], sizeof(nRawSize));
+    if (nRawSize > MAX_BLOCK_SIZE)
+        return error("ReadRawBlockFromDisk() : bad block record at %u:%u", nFile, nBlockPos);
+    ssBlock.resize(std::min(nRawSize, nMaxSize));
+    if (!ssBlock.empty() && !DecompressBlock((const unsigned char*)&vchCompressed[sizeof(nRawSize)], nSize - sizeof(nRawSize), (unsigned char*)&ssBlock[0], ssBlock.size()))
+        return error("ReadRawBlockFromDisk() : corrupt compressed block at %u:%u", nFile, nBlockPos);
+    return true;
+}
+
+// Append state of the block files, guarded by cs_BlockFiles
+static CCriticalSection cs_BlockFiles;
 static unsigned int nCurrentBlockFile = 1;
+static FILE* fileAppend = NULL;             // kept open on nCurrentBlockFile between blocks
+static unsigned int nAppendPos = 0;         // end of the data in nCurrentBlockFile
+static unsigned int nAllocatedPos = 0;      // nCurrentBlockFile is preallocated up to here
+static unsigned int nUncommittedBytes = 0;  // appended since the last FileCommit
+static unsigned int nFirstUnflushedBlockFile = 1;
+static unsigned int nLastPrunedFile = 0;    // files up to this one were deleted by -prune
+static bool fCheckPrune = true;             // a new file was started since PruneBlockFiles() last looked
+
+static void CloseAppendFile()
+{
+    if (fileAppend)
+        fclose(fileAppend);
+    fileAppend = NULL;
+}
 
-FILE* AppendBlockFile(unsigned int& nFileRet)
+// Must be called with cs_BlockFiles held
+static FILE* AppendBlockFile()
 {
-    nFileRet = 0;
     while (true)
     {
-        FILE* file = OpenBlockFile(nCurrentBlockFile, 0, "ab");
+        if (!fileAppend)
+        {
+            fileAppend = OpenBlockFile(nCurrentBlockFile, 0, "ab");
+            if (!fileAppend)
+                return NULL;
+            if (fseek(fileAppend, 0, SEEK_END) != 0)
+            {
+                CloseAppendFile();
+                return NULL;
+            }
+            long nEnd = ftell(fileAppend);
+            if (nEnd < 0)
+            {
+                CloseAppendFile();
+                return NULL;
+            }
+            nAppendPos = nAllocatedPos = nEnd;
+        }
+        // FAT32 file size max 4GB, fseek and ftell max 2GB, so we must stay under 2GB.
+        // Pruning deletes whole files, so it uses much smaller ones.
+        if (nAppendPos < (fPruneMode ? PRUNE_BLOCKFILE_SIZE : (unsigned int)(0x7F000000 - MAX_SIZE)))
+            return fileAppend;
+        // Release the unused preallocation; FlushBlockFiles still commits this file
+        TruncateFile(fileAppend, nAppendPos);
+        CloseAppendFile();
+        nCurrentBlockFile++;
+        fCheckPrune = true;
+    }
+}
+
+bool WriteBlockToDisk(const CBlock& block, unsigned int& nFileRet, unsigned int& nBlockPosRet)
+{
+    LOCK(cs_BlockFiles);
+    FILE* file = AppendBlockFile();
+    if (!file)
+        return error("WriteBlockToDisk() : AppendBlockFile failed");
+
+    // With -compressblocks the block is stored as [raw size][compressed
+    // bytes] when that is smaller. Readers find the flag in the size field.
+    CDataStream ssBlock(SER_DISK, CLIENT_VERSION);
+    ssBlock << block;
+    unsigned int nRawSize = ssBlock.size();
+    unsigned int nSize = nRawSize;
+    std::vector<unsigned char> vchCompressed;
+    if (fCompressBlocks)
+    {
+        CompressBlock((const unsigned char*)&ssBlock[0], ssBlock.size(), vchCompressed);
+        if (sizeof(nRawSize) + vchCompressed.size() < nRawSize)
+            nSize = sizeof(nRawSize) + vchCompressed.size();
+        else
+            vchCompressed.clear();
+    }
+
+    // Grow the file in whole chunks so it doesn't fragment one block at a time
+    unsigned int nRecordSize = MESSAGE_START_SIZE + sizeof(nSize) + nSize;
+    if (nAppendPos + nRecordSize > nAllocatedPos)
+    {
+        unsigned int nNewAllocatedPos = (nAppendPos + nRecordSize + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE * BLOCKFILE_CHUNK_SIZE;
+        PreallocateFile(file, nAllocatedPos, nNewAllocatedPos - nAllocatedPos);
+        nAllocatedPos = nNewAllocatedPos;
+    }
+
+    // Write index header and block
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    try {
+        if (vchCompressed.empty())
+        {
+            fileout << FLATDATA(Params().MessageStart()) << nSize;
+            fileout.write(&ssBlock[0], nRawSize);
+        }
+        else
+        {
+            fileout << FLATDATA(Params().MessageStart()) << (nSize | BLOCK_RECORD_COMPRESSED) << nRawSize;
+            fileout.write((const char*)&vchCompressed[0], vchCompressed.size());
+        }
+    }
+    catch (std::exception &e) {
+        fileout.release();
+        // Reopen at the real end of the file next time
+        CloseAppendFile();
+        return error("%s() : I/O error", __PRETTY_FUNCTION__);
+    }
+    fileout.release();
+
+    // Flush stdio buffers so readers see the block
+    if (fflush(file) != 0)
+    {
+        CloseAppendFile();
+        return error("WriteBlockToDisk() : fflush failed");
+    }
+    nFileRet = nCurrentBlockFile;
+    nBlockPosRet = nAppendPos + MESSAGE_START_SIZE + sizeof(nSize);
+    nAppendPos += nRecordSize;
+    nUncommittedBytes += nRecordSize;
+
+    // Outside initial download every block is committed on its own. During
+    // it index writes are deferred and FlushBlockFiles() commits the block
+    // data first, so here it is enough to commit about once per chunk.
+    if (!IsInitialBlockDownload() || nUncommittedBytes >= BLOCKFILE_CHUNK_SIZE)
+    {
+        FileCommit(file);
+        nUncommittedBytes = 0;
+    }
+    return true;
+}
+
+bool FlushBlockFiles()
+{
+    LOCK(cs_BlockFiles);
+    for (unsigned int nFile = nFirstUnflushedBlockFile; nFile < nCurrentBlockFile; nFile++)
+    {
+        FILE* file = OpenBlockFile(nFile, 0, "ab");
         if (!file)
-            return NULL;
-        if (fseek(file, 0, SEEK_END) != 0)
-            return NULL;
-        // FAT32 file size max 4GB, fseek and ftell max 2GB, so we must stay under 2GB
-        if (ftell(file) < (long)(0x7F000000 - MAX_SIZE))
+            continue;
+        FileCommit(file);
+        fclose(file);
+    }
+    if (fileAppend)
+        FileCommit(fileAppend);
+    nUncommittedBytes = 0;
+    nFirstUnflushedBlockFile = nCurrentBlockFile;
+    return true;
+}
+
+bool IsBlockFilePruned(unsigned int nFile)
+{
+    return nFile <= nLastPrunedFile;
+}
+
+// Block index entries of pruned block files, sorted by position, so stake
+// kernels spending old outputs still find the header of their block
+typedef vector<pair<unsigned int, CBlockIndex*> > BlockPosVector;
+static CCriticalSection cs_mapPrunedBlockPos;
+static map<unsigned int, BlockPosVector> mapPrunedBlockPos;
+
+static void IndexPrunedBlocks(const vector<CBlockIndex*>& vBlocks)
+{
+    LOCK(cs_mapPrunedBlockPos);
+    for (CBlockIndex* pindex : vBlocks)
+        mapPrunedBlockPos[pindex->nFile].push_back(make_pair(pindex->nBlockPos, pindex));
+    for (PAIRTYPE(const unsigned int, BlockPosVector)& item : mapPrunedBlockPos)
+        sort(item.second.begin(), item.second.end());
+}
+
+bool ReadBlockHeader(unsigned int nFile, unsigned int nBlockPos, CBlock& block)
+{
+    if (!IsBlockFilePruned(nFile))
+        return block.ReadFromDisk(nFile, nBlockPos, false);
+
+    LOCK(cs_mapPrunedBlockPos);
+    map<unsigned int, BlockPosVector>::iterator mi = mapPrunedBlockPos.find(nFile);
+    if (mi == mapPrunedBlockPos.end())
+        return false;
+    BlockPosVector::iterator it = lower_bound(mi->second.begin(), mi->second.end(), make_pair(nBlockPos, (CBlockIndex*)NULL));
+    if (it == mi->second.end() || it->first != nBlockPos)
+        return false;
+    block = it->second->GetBlockHeader();
+    return true;
+}
+
+// The active chain is searched by position first; blocks off it, such as
+// those of a branch being connected, are found through their header
+CBlockIndex* GetBlockIndexAtPos(unsigned int nFile, unsigned int nBlockPos)
+{
+    CBlockIndex* pindex = chainActive.FindByPos(nFile, nBlockPos);
+    if (pindex)
+        return pindex;
+
+    CBlock block;
+    if (!ReadBlockHeader(nFile, nBlockPos, block))
+        return NULL;
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
+    return mi == mapBlockIndex.end() ? NULL : (*mi).second;
+}
+
+// Make block file nFile safe to delete: every transaction in it that still
+// has unspent outputs must be in the coins table, and undo data for its
+// blocks is no longer needed. Must be called with cs_main held.
+static bool PrepareBlockFilePrune(CTxDB& txdb, unsigned int nFile, const vector<CBlockIndex*>& vBlocks)
+{
+    if (!txdb.TxnBegin())
+        return error("PrepareBlockFilePrune() : TxnBegin failed");
+    for (CBlockIndex* pindex : vBlocks)
+    {
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+        {
+            txdb.TxnAbort();
+            return error("PrepareBlockFilePrune() : can't read block %s", pindex->GetBlockHash().ToString().c_str());
+        }
+        for (const CTransaction& tx : block.vtx)
+        {
+            // Databases from before the coins table may lack these records
+            uint256 hashTx = tx.GetHash();
+            CTxIndex txindex;
+            if (!txdb.ReadTxIndex(hashTx, txindex) || txindex.pos.nFile != nFile)
+                continue;
+            for (const CDiskTxPos& pos : txindex.vSpent)
+            {
+                if (pos.IsNull())
+                {
+                    if (!txdb.ContainsCoins(hashTx) && !txdb.WriteCoins(hashTx, CCoins(tx)))
+                    {
+                        txdb.TxnAbort();
+                        return error("PrepareBlockFilePrune() : WriteCoins failed");
+                    }
+                    break;
+                }
+            }
+        }
+        txdb.EraseBlockUndo(pindex->GetBlockHash());
+    }
+    txdb.WriteLastPrunedFile(nFile);
+    if (!txdb.TxnCommit())
+        return error("PrepareBlockFilePrune() : TxnCommit failed");
+
+    // The database must not lose any of this once the file is gone
+    return CTxDB::Sync();
+}
+
+void PruneBlockFiles()
+{
+    if (!fPruneMode || !pindexBest)
+        return;
+
+    unsigned int nLastFile;
+    {
+        LOCK(cs_BlockFiles);
+        if (!fCheckPrune)
+            return;
+        fCheckPrune = false;
+        nLastFile = nCurrentBlockFile;
+    }
+
+    uint64_t nBytes = 0;
+    for (unsigned int nFile = nLastPrunedFile + 1; nFile <= nLastFile; nFile++)
+    {
+        boost::system::error_code ec;
+        uint64_t nFileBytes = filesystem::file_size(BlockFilePath(nFile), ec);
+        if (!ec)
+            nBytes += nFileBytes;
+    }
+
+    // Keep room for the current file to fill up, and never touch it
+    CTxDB txdb;
+    while (nBytes + PRUNE_BLOCKFILE_SIZE > nPruneTarget && nLastPrunedFile + 1 < nLastFile)
+    {
+        unsigned int nFile = nLastPrunedFile + 1;
+        vector<CBlockIndex*> vBlocks;
+        bool fRecent = false;
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
-            nFileRet = nCurrentBlockFile;
-            return file;
+            if ((*mi).second->nFile != nFile)
+                continue;
+            vBlocks.push_back((*mi).second);
+            if ((*mi).second->nHeight > nBestHeight - MIN_BLOCKS_TO_KEEP)
+                fRecent = true;
         }
-        fclose(file);
-        nCurrentBlockFile++;
+        if (fRecent || !PrepareBlockFilePrune(txdb, nFile, vBlocks))
+            break;
+
+        boost::system::error_code ec;
+        uint64_t nFileBytes = filesystem::file_size(BlockFilePath(nFile), ec);
+        blockFileMap.Erase(nFile);
+        filesystem::remove(BlockFilePath(nFile), ec);
+        if (ec)
+            LogPrintf("PruneBlockFiles() : can't remove %s: %s\n", BlockFilePath(nFile).string().c_str(), ec.message().c_str());
+        {
+            LOCK(cs_BlockFiles);
+            nLastPrunedFile = nFile;
+            nFirstUnflushedBlockFile = max(nFirstUnflushedBlockFile, nFile + 1);
+        }
+        IndexPrunedBlocks(vBlocks);
+        nBytes -= min(nBytes, nFileBytes);
+        LogPrintf("PruneBlockFiles() : deleted block file %u (%u blocks, %" PRIu64 " bytes), %" PRIu64 " MiB left\n",
+            nFile, vBlocks.size(), nFileBytes, nBytes >> 20);
     }
 }
 
@@ -2613,9 +3998,36 @@ bool LoadBlockIndex(bool fAllowNew)
     // Load block index
     //
     CTxDB txdb("cr+");
+
+    // Once a compressed block is written every read has to check for one,
+    // even after -compressblocks is turned off again
+    txdb.ReadBlocksCompressed(fBlockStoreCompressed);
+    if (fCompressBlocks && !fBlockStoreCompressed)
+    {
+        if (!txdb.WriteBlocksCompressed(true))
+            return error("LoadBlockIndex() : WriteBlocksCompressed failed");
+        fBlockStoreCompressed = true;
+    }
+
     if (!txdb.LoadBlockIndex())
         return false;
 
+    // Never write to or flush block files -prune has deleted
+    if (txdb.ReadLastPrunedFile(nLastPrunedFile) && nLastPrunedFile > 0)
+    {
+        {
+            LOCK(cs_BlockFiles);
+            nCurrentBlockFile = max(nCurrentBlockFile, nLastPrunedFile + 1);
+            nFirstUnflushedBlockFile = max(nFirstUnflushedBlockFile, nLastPrunedFile + 1);
+        }
+        vector<CBlockIndex*> vBlocks;
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+            if (IsBlockFilePruned((*mi).second->nFile))
+                vBlocks.push_back((*mi).second);
+        IndexPrunedBlocks(vBlocks);
+        LogPrintf("LoadBlockIndex() : block files up to %u are pruned\n", nLastPrunedFile);
+    }
+
     //
     // Init with genesis block
     //
@@ -2661,7 +4073,7 @@ void PrintBlockTree()
 {
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -2813,7 +4225,8 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash) ||
-               mapOrphanBlocks.count(inv.hash);
+               mapOrphanBlocks.count(inv.hash) ||
+               mapBlocksInFlight.count(inv.hash);
     }
     // Don't know what it is, just say we already got one
     return true;
@@ -2827,6 +4240,308 @@ static bool NodeRecentlyStarted()
     return (timediff < (2 * 60 * 60));
 }
 
+/** Whether the block hash commits to all of block, so that its failures are the header's. */
+static bool IsBlockCommitted(CBlock& block)
+{
+    if (block.vtx.empty() || block.hashMerkleRoot != block.BuildMerkleTree())
+        return false;
+
+    // Repeating transactions can leave the merkle root unchanged
+    set<uint256> setTxHashes;
+    for (const CTransaction& tx : block.vtx)
+        if (!setTxHashes.insert(tx.GetHash()).second)
+            return false;
+
+    // The block signature isn't hashed
+    return !block.IsProofOfStake() || block.CheckBlockSignature();
+}
+
+/** Process a block a peer sent, in full or rebuilt from a compact block. */
+static void ProcessReceivedBlock(CNode* pfrom, CBlock& block)
+{
+    uint256 hashBlock = block.GetHash();
+    CInv inv(MSG_BLOCK, hashBlock);
+    pfrom->AddInventoryKnown(inv);
+    MarkBlockReceived(pfrom, hashBlock);
+
+    if (ProcessBlock(pfrom, &block))
+        mapAlreadyAskedFor.erase(inv);
+    if (block.nDoS)
+    {
+        // A peer mangling what the hash doesn't cover mustn't get the
+        // header of a good block dropped; it is asked from another peer
+        if (IsBlockCommitted(block))
+            InvalidateHeader(hashBlock);
+        pfrom->Misbehaving(block.nDoS);
+    }
+}
+
+/** A compact block couldn't be rebuilt; ask its sender for the whole block. */
+static void RequestFullBlock(CNode* pfrom, const uint256& hashBlock)
+{
+    LogPrint("net", "requesting full block %s from %s\n", hashBlock.ToString().substr(0,20).c_str(), pfrom->addr.ToString().c_str());
+    pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, hashBlock)));
+}
+
+/** The checks of a compact block's header that need none of the pool: its
+ * time, target and checkpoint, and its proof-of-work or, from the prefilled
+ * beansprout, its stake kernel and signature. Requires the parent in
+ * mapBlockIndex. Fails without a DoS score when the stake can't be checked
+ * here, so the full block goes through the usual path. */
+static bool CheckCompactBlockHeader(const CBlockHeaderAndShortTxIDs& cmpctblock, const uint256& hashBlock)
+{
+    const CBlock& header = cmpctblock.header;
+    CBlockIndex* pindexPrev = mapBlockIndex[header.hashPrevBlock];
+    int nHeight = pindexPrev->nHeight + 1;
+
+    if (header.GetBlockTime() > FutureDrift(GetAdjustedTime()))
+        return error("CheckCompactBlockHeader() : block timestamp too far in the future");
+    if (header.GetBlockTime() <= pindexPrev->GetPastTimeLimit() || FutureDrift(header.GetBlockTime()) < pindexPrev->GetBlockTime())
+        return header.DoS(10, error("CheckCompactBlockHeader() : block timestamp too early"));
+    if (!Checkpoints::CheckHardened(nHeight, hashBlock))
+        return header.DoS(100, error("CheckCompactBlockHeader() : rejected by hardened checkpoint lock-in at %d", nHeight));
+
+    CBlock blockStake(header);
+    for (const CPrefilledTransaction& prefilled : cmpctblock.vPrefilledTx)
+    {
+        if (prefilled.nIndex == 1 && prefilled.tx.IsBeanStake())
+        {
+            blockStake.vtx.resize(2);
+            blockStake.vtx[1] = prefilled.tx;
+        }
+    }
+    bool fProofOfStake = !blockStake.vtx.empty();
+    if (header.nBits != GetNextTargetRequired(pindexPrev, fProofOfStake))
+        return header.DoS(100, error("CheckCompactBlockHeader() : incorrect %s", fProofOfStake ? "proof-of-bean" : "proof-of-work"));
+    if (!fProofOfStake)
+    {
+        if (nHeight > LAST_POW_BLOCK)
+            return header.DoS(100, error("CheckCompactBlockHeader() : reject proof-of-work at height %d", nHeight));
+        if (!CheckProofOfWork(header.GetPoWHash(), header.nBits))
+            return header.DoS(50, error("CheckCompactBlockHeader() : proof of work failed"));
+        return true;
+    }
+
+    // The block signature alone is made with a key the sender chose; the
+    // kernel ties the block to a stake that exists
+    const CTransaction& txStake = blockStake.vtx[1];
+    if (!CheckBeanStakeTimestamp(header.GetBlockTime(), (int64_t)txStake.nTime))
+        return header.DoS(50, error("CheckCompactBlockHeader() : beansprout timestamp violation"));
+    uint256 hashProof, targetProofOfStake;
+    if (!CheckProofOfStake(txStake, header.nBits, hashProof, targetProofOfStake))
+        return header.DoS(txStake.nDoS, error("CheckCompactBlockHeader() : proof-of-bean failed for %s", hashBlock.ToString().substr(0,20).c_str()));
+    if (!blockStake.CheckBlockSignature())
+        return header.DoS(100, error("CheckCompactBlockHeader() : bad proof-of-bean block signature"));
+    return true;
+}
+
+/** Get the blocks pto has left waiting for "blocktxn" too long in full, from
+ * another peer that announced them if there is one. */
+static void ExpirePartialBlocks(CNode* pto)
+{
+    int64_t nNow = GetTime();
+    map<pair<CNode*, uint256>, pair<int64_t, CPartialBlock> >::iterator mi = mapPartialBlocks.lower_bound(make_pair(pto, uint256(0)));
+    while (mi != mapPartialBlocks.end() && (*mi).first.first == pto)
+    {
+        if (nNow - (*mi).second.first <= BLOCKTXN_TIMEOUT)
+        {
+            ++mi;
+            continue;
+        }
+        uint256 hashBlock = (*mi).first.second;
+        mapPartialBlocks.erase(mi++);
+        if (mapBlockIndex.count(hashBlock) || mapOrphanBlocks.count(hashBlock))
+            continue;
+        LogPrint("net", "blocktxn for %s from %s timed out\n", hashBlock.ToString().substr(0,20).c_str(), pto->addr.ToString().c_str());
+
+        CInv inv(MSG_BLOCK, hashBlock);
+        CNode* pnodeFrom = pto;
+        LOCK(cs_vNodes);
+        for (CNode* pnode : vNodes)
+        {
+            if (pnode == pto || pnode->fDisconnect)
+                continue;
+            LOCK(pnode->cs_inventory);
+            if (pnode->setInventoryKnown.count(inv))
+            {
+                pnodeFrom = pnode;
+                break;
+            }
+        }
+        RequestFullBlock(pnodeFrom, hashBlock);
+    }
+}
+
+// Serve queued "getdata" items until MAX_GETDATA_BLOCKS_PER_PASS blocks have
+// gone out or the peer's send buffer is full; the rest waits for the next
+// pass, so other peers get their turn in between. Requires cs_vRecvMsg.
+void static ProcessGetData(CNode* pfrom)
+{
+    LOCK(cs_main);
+
+    unsigned int nBlocks = 0;
+    vector<CInv> vNotFound;
+    while (!pfrom->vRecvGetData.empty() && !pfrom->fDisconnect)
+    {
+        if (nBlocks >= MAX_GETDATA_BLOCKS_PER_PASS || pfrom->nSendSize >= SendBufferSize())
+            break;
+        boost::this_thread::interruption_point();
+
+        const CInv inv = pfrom->vRecvGetData.front();
+        pfrom->vRecvGetData.pop_front();
+        if (fDebugNet)
+            LogPrint("net", "serving getdata for: %s\n", inv.ToString().c_str());
+
+        if (inv.type == MSG_BLOCK)
+        {
+            // Send block from disk
+            BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+            if (mi != mapBlockIndex.end())
+            {
+                CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+                bool fFound = blockcache.Get(inv.hash, ssBlock);
+                if (!fFound)
+                {
+                    // The on-disk record is the network serialization already
+                    fFound = ReadRawBlockFromDisk(ssBlock, (*mi).second->nFile, (*mi).second->nBlockPos);
+                    // Keep blocks near the tip for the next peers asking
+                    if (fFound && (*mi).second->nHeight > nBestHeight - BLOCK_CACHE_DEPTH)
+                        blockcache.Insert(inv.hash, ssBlock);
+                }
+                if (fFound)
+                {
+                    pfrom->PushMessage("block", ssBlock);
+                    nBlocks++;
+                }
+                else
+                    vNotFound.push_back(inv);
+
+                // Trigger them to send a getblocks request for the next batch of inventory
+                if (inv.hash == pfrom->hashContinue)
+                {
+                    // Send latest proof-of-work block to allow the
+                    // download node to accept as orphan (proof-of-bean
+                    // block might be rejected by stake connection check)
+                    vector<CInv> vInv;
+                    vInv.push_back(CInv(MSG_BLOCK, GetLastBlockIndex(pindexBest, false)->GetBlockHash()));
+                    pfrom->PushMessage("inv", vInv);
+                    pfrom->hashContinue = 0;
+                }
+            }
+            else
+                vNotFound.push_back(inv);
+        }
+        else if (inv.IsKnownType())
+        {
+            // Send from relay memory, or the memory pool, without copying
+            CTransactionRef ptx;
+            {
+                LOCK(cs_mapRelay);
+                map<CInv, CTransactionRef>::iterator mi = mapRelay.find(inv);
+                if (mi != mapRelay.end())
+                    ptx = (*mi).second;
+            }
+            if (!ptx && inv.type == MSG_TX)
+                ptx = mempool.get(inv.hash);
+            if (ptx)
+                pfrom->PushMessage(inv.GetCommand(), *ptx);
+            else
+                vNotFound.push_back(inv);
+        }
+
+        // Track requests for our stuff
+        Inventory(inv.hash);
+    }
+
+    // Let the peer ask someone else instead of waiting for a timeout
+    if (!vNotFound.empty())
+        pfrom->PushMessage("notfound", vNotFound);
+
+    // Stopped by the quota rather than a full send buffer, which wakes the
+    // message handler itself once it drains
+    if (!pfrom->vRecvGetData.empty() && pfrom->nSendSize < SendBufferSize())
+        WakeMessageHandler();
+}
+
+// The input scripts of a relayed transaction are checked without cs_main,
+// between a snapshot of its inputs and the recheck that adds it. Orphans it
+// unblocks are few and go through the plain accept.
+bool static ProcessTxMessage(CNode* pfrom, CDataStream& vRecv)
+{
+    vector<uint256> vWorkQueue;
+    vector<uint256> vEraseQueue;
+    CTxDB txdb("r");
+    CTransaction tx;
+    vRecv >> tx;
+
+    CInv inv(MSG_TX, tx.GetHash());
+    pfrom->AddInventoryKnown(inv);
+
+    bool fMissingInputs = false;
+    vector<CScriptCheck> vChecks;
+    bool fChecked;
+    {
+        LOCK(cs_main);
+        fChecked = mempool.PreAccept(txdb, tx, &fMissingInputs, vChecks);
+    }
+    if (fChecked && !CheckInputScripts(vChecks))
+        fChecked = tx.DoS(100, error("ProcessTxMessage() : %s VerifySignature failed", inv.hash.ToString().substr(0,10).c_str()));
+
+    LOCK(cs_main);
+    if (fChecked && mempool.accept(txdb, tx, true, &fMissingInputs, 0, true))
+    {
+        SyncWithWallets(tx, NULL, true);
+        RelayTransaction(tx, inv.hash);
+        mapAlreadyAskedFor.erase(inv);
+        vWorkQueue.push_back(inv.hash);
+        vEraseQueue.push_back(inv.hash);
+
+        // Recursively process any orphan transactions that depended on this one
+        for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+        {
+            uint256 hashPrev = vWorkQueue[i];
+            for (set<uint256>::iterator mi = mapOrphanTransactionsByPrev[hashPrev].begin();
+                 mi != mapOrphanTransactionsByPrev[hashPrev].end();
+                 ++mi)
+            {
+                const uint256& orphanTxHash = *mi;
+                CTransaction& orphanTx = mapOrphanTransactions[orphanTxHash];
+                bool fMissingInputs2 = false;
+
+                if (orphanTx.AcceptToMemoryPool(txdb, true, &fMissingInputs2))
+                {
+                    LogPrint("mempool", "   accepted orphan tx %s\n", orphanTxHash.ToString().substr(0,10).c_str());
+                    SyncWithWallets(tx, NULL, true);
+                    RelayTransaction(orphanTx, orphanTxHash);
+                    mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanTxHash));
+                    vWorkQueue.push_back(orphanTxHash);
+                    vEraseQueue.push_back(orphanTxHash);
+                }
+                else if (!fMissingInputs2)
+                {
+                    // invalid orphan
+                    vEraseQueue.push_back(orphanTxHash);
+                    LogPrint("mempool", "   removed invalid orphan tx %s\n", orphanTxHash.ToString().substr(0,10).c_str());
+                }
+            }
+        }
+
+        for (uint256 hash : vEraseQueue)
+            EraseOrphanTx(hash);
+    }
+    else if (fMissingInputs)
+    {
+        AddOrphanTx(tx);
+
+        // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+        unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
+        if (nEvicted > 0)
+            LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+    }
+    if (tx.nDoS) pfrom->Misbehaving(tx.nDoS);
+    return true;
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     static map<CService, CPubKey> mapReuseKey;
@@ -2839,6 +4554,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         return true;
     }
 
+    if (strCommand == "tx" && pfrom->nVersion != 0)
+        return ProcessTxMessage(pfrom, vRecv);
+
+    LOCK(cs_main);
     if (strCommand == "version")
     {
         // Each connection can only send one version message
@@ -2898,6 +4617,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         pfrom->PushMessage("verack");
         pfrom->ssSend.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
 
+        // Ask for new blocks as compact blocks
+        if (fCompactBlocks && pfrom->nVersion >= COMPACT_BLOCKS_VERSION)
+            pfrom->PushMessage("sendcmpct");
+
         if (!pfrom->fInbound)
         {
             // Advertise our address
@@ -2934,7 +4657,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     pfrom->nVersion >= MEMPOOL_GD_VERSION)
                     pfrom->PushMessage("mempool");
 
-        // Ask the first connected node for block updates
+        // Block updates are fetched headers-first by SendMessages where the
+        // headers can be checked
+        if (pfrom->nVersion < NOBLKS_VERSION_START || pfrom->nVersion >= NOBLKS_VERSION_END)
+            pfrom->nSyncHeight = pfrom->nStartingHeight;
+
+        // Proof-of-bean blocks come through getblocks; ask the first
+        // connected node for them
         static int nAskedForBlocks = 0;
         if (!pfrom->fClient && !pfrom->fOneShot && !fImporting &&
             (pfrom->nStartingHeight > (nBestHeight - 144)) &&
@@ -3114,60 +4843,34 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (fDebugNet || (vInv.size() != 1))
             LogPrint("net", "received getdata (%u invsz)\n", vInv.size());
 
-        for (const CInv& inv : vInv)
-        {
-            boost::this_thread::interruption_point();
-            if (fDebugNet || (vInv.size() == 1))
-                LogPrint("net", "received getdata for: %s\n", inv.ToString().c_str());
+        // Served a bit at a time by ProcessMessages, starting now
+        pfrom->vRecvGetData.insert(pfrom->vRecvGetData.end(), vInv.begin(), vInv.end());
+        ProcessGetData(pfrom);
+    }
 
-            if (inv.type == MSG_BLOCK)
-            {
-                // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
-                {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
 
-                    // Trigger them to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue)
-                    {
-                        // Send latest proof-of-work block to allow the
-                        // download node to accept as orphan (proof-of-bean
-                        // block might be rejected by stake connection check)
-                        vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, GetLastBlockIndex(pindexBest, false)->GetBlockHash()));
-                        pfrom->PushMessage("inv", vInv);
-                        pfrom->hashContinue = 0;
-                    }
-                }
-            }
-            else if (inv.IsKnownType())
-            {
-                // Send stream from relay memory
-                bool pushed = false;
-                {
-                    LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                    if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                        pushed = true;
-                    }
-                }
-                if (!pushed && inv.type == MSG_TX) {
-                    CTransaction tx;
-                    if (mempool.lookup(inv.hash, tx)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << tx;
-                        pfrom->PushMessage("tx", ss);
-                    }
-                }
-            }
+    else if (strCommand == "notfound")
+    {
+        vector<CInv> vInv;
+        vRecv >> vInv;
+        if (vInv.size() > MAX_INV_SZ)
+        {
+            pfrom->Misbehaving(20);
+            return error("message notfound size() = %u", vInv.size());
+        }
 
-            // Track requests for our stuff
-            Inventory(inv.hash);
+        // Hand its block requests to other peers, without counting a stall
+        for (const CInv& inv : vInv)
+        {
+            if (inv.type != MSG_BLOCK)
+                continue;
+            map<uint256, pair<CNode*, int64_t> >::iterator mi = mapBlocksInFlight.find(inv.hash);
+            if (mi == mapBlocksInFlight.end() || (*mi).second.first != pfrom)
+                continue;
+            LogPrint("net", "block %s not found by %s\n", inv.hash.ToString().substr(0,20).c_str(), pfrom->addr.ToString().c_str());
+            pfrom->nBlocksInFlight--;
+            pfrom->setBlocksNotFound.insert(inv.hash);
+            mapBlocksInFlight.erase(mi);
         }
     }
 
@@ -3181,9 +4884,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         // Find the last block the caller has in the main chain
         CBlockIndex* pindex = locator.GetBlockIndex();
 
-        // Send the rest of the chain
+        // Send the rest of the chain, unless we no longer have it
         if (pindex)
             pindex = pindex->pnext;
+        if (pindex && IsBlockFilePruned(pindex->nFile))
+            pindex = NULL;
         int nLimit = 500;
         LogPrint("net", "getblocks %d to %s limit %d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().substr(0,20).c_str(), nLimit);
         for (; pindex; pindex = pindex->pnext)
@@ -3233,7 +4938,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3247,7 +4952,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
 
         vector<CBlock> vHeaders;
-        int nLimit = 2000;
+        int nLimit = MAX_HEADERS_RESULTS;
         LogPrint("net", "getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().substr(0,20).c_str());
         for (; pindex; pindex = pindex->pnext)
         {
@@ -3259,94 +4964,236 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "tx")
+    else if (strCommand == "headers")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
-        CDataStream vMsg(vRecv);
-        CTxDB txdb("r");
-        CTransaction tx;
-        vRecv >> tx;
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %u", vHeaders.size());
+        }
+        pfrom->nTimeHeadersRequested = 0;
 
-        CInv inv(MSG_TX, tx.GetHash());
-        pfrom->AddInventoryKnown(inv);
+        uint256 hashLast = 0;
+        int nHeightLast = -1;
+        int nHeadersNew = 0;
+        for (CBlock& header : vHeaders)
+        {
+            boost::this_thread::interruption_point();
+            uint256 hash = header.GetHash();
+            bool fNew = !mapBlockIndex.count(hash) && !mapHeaders.count(hash);
+            if (fNew && pfrom->nHeadersOffChain + nHeadersNew >= MAX_HEADERS_OFF_CHAIN)
+            {
+                LogPrint("net", "too many headers off the header chain from %s\n", pfrom->addr.ToString().c_str());
+                break;
+            }
+            int nHeight = -1;
+            if (!AcceptBlockHeader(header, hash, nHeight))
+            {
+                if (header.nDoS)
+                    pfrom->Misbehaving(header.nDoS);
+                else if (nHeight >= 0)
+                    pfrom->nHeadersUncheckedHeight = nHeight;
+                break;
+            }
+            if (fNew)
+                nHeadersNew++;
+            hashLast = hash;
+            nHeightLast = nHeight;
+            if (nHeight >= nBestHeight + MAX_HEADERS_AHEAD)
+                break;
+        }
+        if (nHeightLast < 0)
+        {
+            // Nothing past what we asked from, whatever its version said
+            if (vHeaders.empty())
+                pfrom->nSyncHeight = min(pfrom->nSyncHeight, max(GetHeaderHeight(pfrom->hashSyncHeader), nBestHeight));
+            return true;
+        }
 
-        // Truncate messages to the size of the tx inside
-        unsigned int nSize = ::GetSerializeSize(tx,SER_NETWORK,PROTOCOL_VERSION);
-        if (nSize < vMsg.size()) {
-            vMsg.resize(nSize);
+        pfrom->nSyncHeight = max(pfrom->nSyncHeight, nHeightLast);
+        map<uint256, CHeaderIndex>::iterator it = mapHeaders.find(hashLast);
+        if (it != mapHeaders.end())
+        {
+            // Blocks are only asked from the peers that announced them
+            pfrom->hashSyncHeader = hashLast;
+            pfrom->nSyncHeaderGeneration = 0;
+            pfrom->setBlocksNotFound.clear();
+
+            const uint256& nChainTrust = (*it).second.nChainTrust;
+            if (nChainTrust > nBestHeaderTrust && nChainTrust > pindexBest->nChainTrust)
+                SetBestHeader(hashLast, nHeightLast);
         }
 
-        bool fMissingInputs = false;
-        if (tx.AcceptToMemoryPool(txdb, true, &fMissingInputs))
+        // What a peer adds off the header chain is capped, so a branch that
+        // loses out can't fill mapHeaders
+        if (hashLast == hashBestHeader)
+            pfrom->nHeadersOffChain = 0;
+        else
+            pfrom->nHeadersOffChain += nHeadersNew;
+        LogPrint("net", "received %u headers up to %d from %s, best header %d\n", vHeaders.size(), nHeightLast, pfrom->addr.ToString().c_str(), nBestHeaderHeight);
+
+        // Keep going while the peer has more
+        if (vHeaders.size() == MAX_HEADERS_RESULTS && nHeightLast < nBestHeight + MAX_HEADERS_AHEAD)
         {
-            SyncWithWallets(tx, NULL, true);
-            RelayTransaction(tx, inv.hash);
-            mapAlreadyAskedFor.erase(inv);
-            vWorkQueue.push_back(inv.hash);
-            vEraseQueue.push_back(inv.hash);
+            pfrom->PushMessage("getheaders", GetHeaderLocator(hashLast), uint256(0));
+            pfrom->nTimeHeadersRequested = GetTime();
+        }
+    }
 
-            // Recursively process any orphan transactions that depended on this one
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                uint256 hashPrev = vWorkQueue[i];
-                for (set<uint256>::iterator mi = mapOrphanTransactionsByPrev[hashPrev].begin();
-                     mi != mapOrphanTransactionsByPrev[hashPrev].end();
-                     ++mi)
-                {
-                    const uint256& orphanTxHash = *mi;
-                    CTransaction& orphanTx = mapOrphanTransactions[orphanTxHash];
-                    bool fMissingInputs2 = false;
 
-                    if (orphanTx.AcceptToMemoryPool(txdb, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanTxHash.ToString().substr(0,10).c_str());
-                        SyncWithWallets(tx, NULL, true);
-                        RelayTransaction(orphanTx, orphanTxHash);
-                        mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanTxHash));
-                        vWorkQueue.push_back(orphanTxHash);
-                        vEraseQueue.push_back(orphanTxHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        // invalid orphan
-                        vEraseQueue.push_back(orphanTxHash);
-                        LogPrint("mempool", "   removed invalid orphan tx %s\n", orphanTxHash.ToString().substr(0,10).c_str());
-                    }
-                }
+    else if (strCommand == "block")
+    {
+        CBlock block;
+        vRecv >> block;
+
+        LogPrint("net", "received block %s\n", block.GetHash().ToString().substr(0,20).c_str());
+        // block.print();
+
+        ProcessReceivedBlock(pfrom, block);
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        pfrom->fPreferCompactBlocks = true;
+    }
+
+
+    else if (strCommand == "cmpctblock")
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+
+        LogPrint("net", "received cmpctblock %s (%u txs)\n", hashBlock.ToString().substr(0,20).c_str(), cmpctblock.BlockTxCount());
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hashBlock));
+
+        if (mapBlockIndex.count(hashBlock) || mapOrphanBlocks.count(hashBlock) || mapPartialBlocks.count(make_pair(pfrom, hashBlock)))
+            return true;
+        // Without the parent it would only be an orphan; let the full block take that path
+        if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock))
+        {
+            RequestFullBlock(pfrom, hashBlock);
+            return true;
+        }
+
+        // Weed out made up blocks before searching the pool for them
+        if (!CheckCompactBlockHeader(cmpctblock, hashBlock))
+        {
+            // A stake that can't be checked yet, e.g. while behind, is
+            // left to the full block
+            if (cmpctblock.header.nDoS <= 1)
+            {
+                RequestFullBlock(pfrom, hashBlock);
+                return true;
             }
+            pfrom->Misbehaving(cmpctblock.header.nDoS);
+            return error("ProcessMessage() : bad cmpctblock %s", hashBlock.ToString().substr(0,20).c_str());
+        }
 
-            for (uint256 hash : vEraseQueue)
-                EraseOrphanTx(hash);
+        CPartialBlock partial;
+        vector<unsigned short> vMissing;
+        CompactReadStatus status = partial.Init(cmpctblock, mempool, vMissing);
+        if (status == READ_STATUS_INVALID)
+        {
+            pfrom->Misbehaving(100);
+            return error("ProcessMessage() : invalid cmpctblock %s", hashBlock.ToString().substr(0,20).c_str());
         }
-        else if (fMissingInputs)
+        if (status == READ_STATUS_FAILED)
         {
-            AddOrphanTx(tx);
+            RequestFullBlock(pfrom, hashBlock);
+            return true;
+        }
 
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
-            if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+        if (vMissing.empty())
+        {
+            CBlock block;
+            if (partial.Fill(vector<CTransaction>(), block) != READ_STATUS_OK)
+                RequestFullBlock(pfrom, hashBlock);
+            else
+                ProcessReceivedBlock(pfrom, block);
+            return true;
         }
-        if (tx.nDoS) pfrom->Misbehaving(tx.nDoS);
+
+        // One block waiting per peer is plenty
+        map<pair<CNode*, uint256>, pair<int64_t, CPartialBlock> >::iterator mi = mapPartialBlocks.lower_bound(make_pair(pfrom, uint256(0)));
+        while (mi != mapPartialBlocks.end() && (*mi).first.first == pfrom)
+            mapPartialBlocks.erase(mi++);
+        mapPartialBlocks[make_pair(pfrom, hashBlock)] = make_pair(GetTime(), partial);
+
+        LogPrint("net", "cmpctblock %s: asking for %u of %u transactions\n", hashBlock.ToString().substr(0,20).c_str(), vMissing.size(), cmpctblock.BlockTxCount());
+        CBlockTransactionsRequest req;
+        req.hashBlock = hashBlock;
+        req.vIndexes = vMissing;
+        pfrom->PushMessage("getblocktxn", req);
     }
 
 
-    else if (strCommand == "block")
+    else if (strCommand == "getblocktxn")
     {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+        if (req.vIndexes.size() > MAX_COMPACT_BLOCK_TXS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message getblocktxn size() = %u", req.vIndexes.size());
+        }
+
+        BlockMap::iterator mi = mapBlockIndex.find(req.hashBlock);
+        if (mi == mapBlockIndex.end())
+            return true;
+        // Only recent blocks are announced compactly; anything older goes in full
+        CBlockIndex* pindex = (*mi).second;
         CBlock block;
-        vRecv >> block;
-        uint256 hashBlock = block.GetHash();
+        if (pindex->nHeight < nBestHeight - MAX_BLOCKTXN_DEPTH || !block.ReadFromDisk(pindex))
+        {
+            vector<CInv> vInv(1, CInv(MSG_BLOCK, req.hashBlock));
+            pfrom->PushMessage("inv", vInv);
+            return true;
+        }
 
-        LogPrint("net", "received block %s\n", hashBlock.ToString().substr(0,20).c_str());
-        // block.print();
+        CBlockTransactions resp(req);
+        for (unsigned int i = 0; i < req.vIndexes.size(); i++)
+        {
+            if (req.vIndexes[i] >= block.vtx.size())
+            {
+                pfrom->Misbehaving(100);
+                return error("ProcessMessage() : getblocktxn index out of range");
+            }
+            resp.vtx[i] = block.vtx[req.vIndexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
 
-        CInv inv(MSG_BLOCK, hashBlock);
-        pfrom->AddInventoryKnown(inv);
 
-        if (ProcessBlock(pfrom, &block))
-            mapAlreadyAskedFor.erase(inv);
-        if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+    else if (strCommand == "blocktxn")
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        map<pair<CNode*, uint256>, pair<int64_t, CPartialBlock> >::iterator mi = mapPartialBlocks.find(make_pair(pfrom, resp.hashBlock));
+        if (mi == mapPartialBlocks.end())
+            return true;
+        // Another peer may have completed it first
+        if (mapBlockIndex.count(resp.hashBlock) || mapOrphanBlocks.count(resp.hashBlock))
+        {
+            mapPartialBlocks.erase(mi);
+            return true;
+        }
+        CBlock block;
+        CompactReadStatus status = (*mi).second.second.Fill(resp.vtx, block);
+        mapPartialBlocks.erase(mi);
+        if (status == READ_STATUS_INVALID)
+        {
+            pfrom->Misbehaving(100);
+            return error("ProcessMessage() : invalid blocktxn for %s", resp.hashBlock.ToString().substr(0,20).c_str());
+        }
+        if (status == READ_STATUS_FAILED)
+            RequestFullBlock(pfrom, resp.hashBlock);
+        else
+            ProcessReceivedBlock(pfrom, block);
     }
 
 
@@ -3564,8 +5411,15 @@ bool ProcessMessages(CNode* pfrom)
     //
     bool fOk = true;
 
+    if (!pfrom->vRecvGetData.empty())
+        ProcessGetData(pfrom);
+
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
+        // Answer a getdata in full before the messages after it
+        if (!pfrom->vRecvGetData.empty())
+            break;
+
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
             break;
@@ -3620,10 +5474,7 @@ bool ProcessMessages(CNode* pfrom)
         bool fRet = false;
         try
         {
-            {
-                LOCK(cs_main);
-                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
-            }
+            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
             boost::this_thread::interruption_point();
         }
         catch (std::ios_base::failure& e)
@@ -3809,6 +5660,16 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             pto->PushMessage("inv", vInv);
 
 
+        //
+        // Message: getheaders, getdata (headers-first sync)
+        //
+        if (!pto->fClient && !pto->fOneShot && !fImporting)
+            SendBlockRequests(pto);
+
+        // Compact blocks stuck waiting for their transactions
+        ExpirePartialBlocks(pto);
+
+
         //
         // Message: getdata
         //
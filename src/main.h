@@ -7,16 +7,25 @@
 #define BITBEAN_MAIN_H
 
 #include "core.h"
+#include "blockcache.h"
+#include "blockfile.h"
 #include "bignum.h"
 #include "sync.h"
 #include "net.h"
 #include "script.h"
 
 #include "util.h"
+#include "memusage.h"
 
 
+#include <atomic>
 #include <iostream>
 #include <list>
+#include <unordered_map>
+
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/identity.hpp>
+#include <boost/multi_index/ordered_index.hpp>
 
 class CWallet;
 class CBlock;
@@ -36,9 +45,53 @@ static const unsigned int MAX_BLOCK_SIZE = 20000000;
 static const unsigned int MAX_BLOCK_SIZE_GEN = MAX_BLOCK_SIZE/2;
 static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+/** Block files are preallocated in chunks of this size (16 MiB) */
+static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000;
+/** Set in the size field of a block record whose block is stored compressed */
+static const unsigned int BLOCK_RECORD_COMPRESSED = 0x80000000;
 static const unsigned int MAX_INV_SZ = 100000;
+/** Number of headers sent in one "headers" message */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Headers-first sync: how far past our best block headers are fetched */
+static const int MAX_HEADERS_AHEAD = 50000;
+/** Headers-first sync: new headers one peer may add off the best header chain */
+static const int MAX_HEADERS_OFF_CHAIN = 2 * MAX_HEADERS_RESULTS;
+/** Headers-first sync: how far past our best block bodies are fetched */
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Headers-first sync: block requests outstanding to one peer */
+static const int MAX_BLOCKS_IN_FLIGHT_PER_PEER = 16;
+/** Blocks this close to the best block are kept in the serving cache when read from disk */
+static const int BLOCK_CACHE_DEPTH = 144;
+/** Seconds before an unanswered block request is handed to another peer */
+static const int64_t BLOCK_STALL_TIMEOUT = 60;
+/** Seconds before a peer that left getheaders unanswered is asked again */
+static const int64_t HEADERS_REQUEST_TIMEOUT = 30;
+/** Timed out block requests after which a peer is disconnected */
+static const int MAX_BLOCK_STALLS = 3;
+/** Blocks served to one peer per message handler pass, so a syncing peer can't hold up the others */
+static const unsigned int MAX_GETDATA_BLOCKS_PER_PASS = 1;
+/** Seconds to wait for "blocktxn" before getting the block in full, from another peer if one announced it */
+static const int64_t BLOCKTXN_TIMEOUT = 10;
+/** Deepest block whose transactions are served for a compact block ("getblocktxn") */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Blocks this close to the best block are never pruned, so reorganizations can read them */
+static const int MIN_BLOCKS_TO_KEEP = 500;
+/** Smallest -prune target in bytes (550 MiB) */
+static const uint64_t MIN_PRUNE_TARGET = 550 * 1024 * 1024;
+/** Block files roll over at this size when pruning (128 MiB), so space comes back in small steps */
+static const unsigned int PRUNE_BLOCKFILE_SIZE = 0x8000000;
 static const int64_t MIN_TX_FEE =  1000000;
 static const int64_t MIN_RELAY_TX_FEE = MIN_TX_FEE;
+/** Default for -maxmempool, the memory pool size limit in megabytes */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Smallest -maxmempool accepted, in megabytes; below it the pool can't hold a full package of transactions */
+static const unsigned int MIN_MAX_MEMPOOL_SIZE = 5;
+/** Default for -limitancestorcount, the most in-pool ancestors of a new transaction, itself included */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitdescendantcount, the most in-pool descendants it may give one of them, itself included */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** The memory pool's minimum fee after an eviction halves this often (seconds) */
+static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
 // BITB Maximum Supply Reduced from 50 Billion to 21 Billion, to match Bitcoin supply ratio (1000 BITB to 1 Bitcoin)
 static const int64_t MAX_MONEY = 21000000000 * bean;
 static const int64_t bean_YEAR_REWARD = 5 * CENT; // 5% per year
@@ -52,7 +105,16 @@ inline int64_t FutureDrift(int64_t nTime) { return nTime + 10 * 60; } // up to 1
 
 extern CScript beanBASE_FLAGS;
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+/** Hasher for block hashes. Mixes the low 128 bits of the hash with a
+ * per-process random key, so bucket placement can't be predicted by peers.
+ */
+struct BlockHasher
+{
+    size_t operator()(const uint256& hash) const;
+};
+typedef std::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+
+extern BlockMap mapBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
 extern unsigned int nTargetSpacing;
@@ -82,17 +144,31 @@ extern int64_t nTransactionFee;
 extern int64_t nReserveBalance;
 extern int64_t nMinimumInputValue;
 extern bool fUseFastIndex;
+extern int nScriptCheckThreads;
+extern bool fPruneMode;
+extern uint64_t nPruneTarget;
+extern bool fCompressBlocks;
+extern std::atomic<bool> fMempoolLoaded;
+extern bool fCompactBlocks;
+extern uint64_t nMaxMempoolSize;
+extern unsigned int nMempoolAncestorLimit;
+extern unsigned int nMempoolDescendantLimit;
 extern unsigned int nDerivationMethodIndex;
 
 extern bool fEnforceCanonical;
 extern bool fMinimizeCoinAge;
 
+// Maximum number of script-checking threads allowed
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64_t nMinDiskSpace = 52428800;
 
 class CReserveKey;
 class CTxDB;
 class CTxIndex;
+class CCoins;
+class CScriptCheck;
 
 /** Register a wallet to receive updates from core */
 void RegisterWallet(CWallet* pwalletIn);
@@ -124,8 +200,40 @@ bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
 /** Open a block file (default: blk?????.dat) */
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 
-/** Append to a block file (default: blk?????.dat) */
-FILE* AppendBlockFile(unsigned int& nFileRet);
+/** Read-only maps of the block files used by the ReadFromDisk methods */
+extern CBlockFileMap blockFileMap;
+
+/** Read a block's record from its block file as raw bytes, which are already its network serialization.
+ * Compressed records are decompressed; at most nMaxSize bytes are returned, enough for a header-only read.
+ */
+bool ReadRawBlockFromDisk(CDataStream& ssBlock, unsigned int nFile, unsigned int nBlockPos, unsigned int nMaxSize=MAX_BLOCK_SIZE);
+
+/** Whether the block at nBlockPos is stored compressed (-compressblocks) */
+bool IsBlockRecordCompressed(unsigned int nFile, unsigned int nBlockPos);
+
+/** Append a block to the current block file, which stays open and preallocated between calls */
+bool WriteBlockToDisk(const CBlock& block, unsigned int& nFileRet, unsigned int& nBlockPosRet);
+
+/** Commit block file data appended since the last call to disk */
+bool FlushBlockFiles();
+
+/** Write the memory pool to mempool.dat, with each transaction's entry time and fee */
+bool DumpMempool();
+
+/** Accept the transactions in mempool.dat back into the memory pool */
+bool LoadMempool();
+
+/** Whether block file nFile was deleted by -prune */
+bool IsBlockFilePruned(unsigned int nFile);
+
+/** Delete the oldest block files while they use more than -prune allows */
+void PruneBlockFiles();
+
+/** Read a block header, taking it from the block index if its block file was pruned */
+bool ReadBlockHeader(unsigned int nFile, unsigned int nBlockPos, CBlock& block);
+
+/** The index entry of the block stored at a position, without a disk read for main chain blocks */
+CBlockIndex* GetBlockIndexAtPos(unsigned int nFile, unsigned int nBlockPos);
 
 /** Load Block Tree database of Beans from disk */
 bool LoadBlockIndex(bool fAllowNew=true);
@@ -170,6 +278,14 @@ const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfSta
 
 void ThreadStakeMiner(CWallet *pwallet);
 
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck();
+/** Run script checks, on the script check threads if there are any. Used
+    without cs_main for the checks of CTxMemPool::PreAccept */
+bool CheckInputScripts(std::vector<CScriptCheck>& vChecks);
+/** Run the -checkblocks verification in the background (-asynccheck) */
+void ThreadVerifyBlockIndex();
+
 void ResendWalletTransactions(bool fForce = false);
 
 bool GetWalletFile(CWallet* pwallet, std::string &strWalletFileOut);
@@ -391,7 +507,7 @@ enum GetMinFee_mode
     GMF_SEND,
 };
 
-typedef std::map<uint256, std::pair<CTxIndex, CTransaction> > MapPrevTx;
+typedef std::map<uint256, std::pair<CTxIndex, CCoins> > MapPrevTx;
 
 int64_t GetMinFee(const CTransaction& tx, unsigned int nBlockSize = 1, enum GetMinFee_mode mode = GMF_BLOCK);
 
@@ -563,6 +679,30 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
+        // nTxPos counts from the start of the raw block, so it isn't a file
+        // offset in a compressed record
+        if (IsBlockRecordCompressed(pos.nFile, pos.nBlockPos))
+        {
+            if (pfileRet)
+                return error("CTransaction::ReadFromDisk() : can't return a file pointer into a compressed block");
+            CDataStream ssBlock(SER_DISK, CLIENT_VERSION);
+            if (!ReadRawBlockFromDisk(ssBlock, pos.nFile, pos.nBlockPos))
+                return false;
+            if (pos.nTxPos < pos.nBlockPos || pos.nTxPos - pos.nBlockPos >= ssBlock.size())
+                return error("CTransaction::ReadFromDisk() : bad position %s", pos.ToString());
+            try {
+                ssBlock.ignore(pos.nTxPos - pos.nBlockPos);
+                ssBlock >> *this;
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+            }
+            return true;
+        }
+
+        if (!pfileRet && blockFileMap.Read(pos.nFile, pos.nTxPos, *this, SER_DISK, CLIENT_VERSION))
+            return true;
+
         CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
@@ -661,11 +801,13 @@ public:
         @param[in] pindexBlock
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
+        @param[out] pvChecks	If non-NULL, script checks are appended here instead of being run inline
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner,
+                       std::vector<CScriptCheck> *pvChecks = NULL);
     bool ClientConnectInputs();
     bool CheckTransaction() const;
     bool AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
@@ -675,6 +817,163 @@ protected:
     const CTxOut& GetOutputFor(const CTxIn& input, const MapPrevTx& inputs) const;
 };
 
+/** A transaction that no longer changes, shared by the memory pool and
+ * relay instead of copied. Its txid is computed once, up front, and read
+ * with GetCachedHash(); GetHash() still hashes, as on any CTransaction.
+ */
+class CSharedTransaction : public CTransaction
+{
+private:
+    const uint256 hash;
+
+public:
+    explicit CSharedTransaction(const CTransaction& tx) : CTransaction(tx), hash(tx.GetHash()) {}
+
+    const uint256& GetCachedHash() const { return hash; }
+};
+
+static inline CTransactionRef MakeTransactionRef(const CTransaction& tx)
+{
+    return CTransactionRef(new CSharedTransaction(tx));
+}
+
+
+/** Compact copy of the parts of a transaction needed to validate spends of
+ * its outputs: version, timestamp, beanbase/beansprout flags and the outputs.
+ * Kept in the "coins" table of the tx database while any output is unspent,
+ * so inputs can be resolved without reading the whole transaction from the
+ * block files.  Spentness itself is still tracked by CTxIndex::vSpent.
+ */
+class CCoins
+{
+public:
+    int nVersion;
+    unsigned int nTime;
+    bool fBeanBase;
+    bool fBeanStake;
+    std::vector<CTxOut> vout;
+
+    CCoins()
+    {
+        SetNull();
+    }
+
+    explicit CCoins(const CTransaction& tx)
+    {
+        nVersion = tx.nVersion;
+        nTime = tx.nTime;
+        fBeanBase = tx.IsBeanBase();
+        fBeanStake = tx.IsBeanStake();
+        vout = tx.vout;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(this->nVersion);
+        nVersion = this->nVersion;
+        READWRITE(nTime);
+        unsigned char nFlags = (fBeanBase ? 1 : 0) | (fBeanStake ? 2 : 0);
+        READWRITE(nFlags);
+        if (fRead)
+        {
+            const_cast<CCoins*>(this)->fBeanBase = (nFlags & 1) != 0;
+            const_cast<CCoins*>(this)->fBeanStake = (nFlags & 2) != 0;
+        }
+        READWRITE(vout);
+    )
+
+    void SetNull()
+    {
+        nVersion = 0;
+        nTime = 0;
+        fBeanBase = false;
+        fBeanStake = false;
+        vout.clear();
+    }
+
+    bool IsNull() const
+    {
+        return vout.empty();
+    }
+
+    bool IsBeanBase() const
+    {
+        return fBeanBase;
+    }
+
+    bool IsBeanStake() const
+    {
+        return fBeanStake;
+    }
+
+    friend bool operator==(const CCoins& a, const CCoins& b)
+    {
+        return (a.nVersion   == b.nVersion &&
+                a.nTime      == b.nTime &&
+                a.fBeanBase  == b.fBeanBase &&
+                a.fBeanStake == b.fBeanStake &&
+                a.vout       == b.vout);
+    }
+
+    friend bool operator!=(const CCoins& a, const CCoins& b)
+    {
+        return !(a == b);
+    }
+
+    std::string ToString() const
+    {
+        std::string str;
+        str += strprintf("CCoins(ver=%d, nTime=%d, %s, vout.size=%u)\n",
+            nVersion, nTime, IsBeanBase() ? "beanbase" : (IsBeanStake() ? "beansprout" : "tx"), vout.size());
+        for (unsigned int i = 0; i < vout.size(); i++)
+            str += "    " + vout[i].ToString() + "\n";
+        return str;
+    }
+};
+
+/** Coins records a block erased by spending them completely. Kept while
+ * pruning, so the block can be disconnected without reading the spent
+ * transactions back from block files that may be gone.
+ */
+class CBlockUndo
+{
+public:
+    std::vector<std::pair<uint256, CCoins> > vSpentCoins;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(vSpentCoins);
+    )
+};
+
+
+/** Closure representing one script verification.
+ *  Note that this stores a pointer to the spending transaction, so it must
+ *  not outlive the block (or transaction) it was created for. */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction *ptxTo;
+    unsigned int nIn;
+    int nHashType;
+
+public:
+    CScriptCheck() : ptxTo(0), nIn(0), nHashType(0) {}
+    CScriptCheck(const CCoins& coinsFromIn, const CTransaction& txToIn, unsigned int nInIn, int nHashTypeIn) :
+        scriptPubKey(coinsFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+        ptxTo(&txToIn), nIn(nInIn), nHashType(nHashTypeIn) { }
+
+    bool operator()() const;
+
+    void swap(CScriptCheck &check) {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(nHashType, check.nHashType);
+    }
+};
+
 
 
 
@@ -773,7 +1072,7 @@ public:
         vSpent.clear();
     }
 
-    bool IsNull()
+    bool IsNull() const
     {
         return pos.IsNull();
     }
@@ -983,34 +1282,38 @@ public:
 
     bool WriteToDisk(unsigned int& nFileRet, unsigned int& nBlockPosRet)
     {
-        // Open history file to append
-        CAutoFile fileout = CAutoFile(AppendBlockFile(nFileRet), SER_DISK, CLIENT_VERSION);
-        if (!fileout)
-            return error("CBlock::WriteToDisk() : AppendBlockFile failed");
-
-        // Write index header
-        unsigned int nSize = fileout.GetSerializeSize(*this);
-        fileout << FLATDATA(Params().MessageStart()) << nSize;
-
-        // Write block
-        long fileOutPos = ftell(fileout);
-        if (fileOutPos < 0)
-            return error("CBlock::WriteToDisk() : ftell failed");
-        nBlockPosRet = fileOutPos;
-        fileout << *this;
-
-        // Flush stdio buffers and commit to disk before returning
-        fflush(fileout);
-        if (!IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0)
-            FileCommit(fileout);
-
-        return true;
+        return WriteBlockToDisk(*this, nFileRet, nBlockPosRet);
     }
 
     bool ReadFromDisk(unsigned int nFile, unsigned int nBlockPos, bool fReadTransactions=true)
     {
         SetNull();
 
+        if (IsBlockRecordCompressed(nFile, nBlockPos))
+        {
+            CDataStream ssBlock(SER_DISK | (fReadTransactions ? 0 : SER_BLOCKHEADERONLY), CLIENT_VERSION);
+            if (!ReadRawBlockFromDisk(ssBlock, nFile, nBlockPos, fReadTransactions ? MAX_BLOCK_SIZE : ::GetSerializeSize(CBlock(), SER_DISK | SER_BLOCKHEADERONLY, CLIENT_VERSION)))
+                return false;
+            try {
+                ssBlock >> *this;
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+            }
+            if (fReadTransactions && IsProofOfWork() && !CheckProofOfWork(GetPoWHash(), nBits))
+                return error("CBlock::ReadFromDisk() : errors in block header");
+            return true;
+        }
+
+        // Read from the mapped block file, falling back to stdio
+        if (blockFileMap.Read(nFile, nBlockPos, *this, SER_DISK | (fReadTransactions ? 0 : SER_BLOCKHEADERONLY), CLIENT_VERSION))
+        {
+            if (fReadTransactions && IsProofOfWork() && !CheckProofOfWork(GetPoWHash(), nBits))
+                return error("CBlock::ReadFromDisk() : errors in block header");
+            return true;
+        }
+        SetNull();
+
         // Open history file to read
         CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
         if (!filein)
@@ -1401,6 +1704,45 @@ public:
 
 
 
+/** Contiguous storage for CBlockIndex objects. Entries are placed in large
+ * chunks rather than allocated one by one, and are never freed, so pointers
+ * handed out stay valid for the life of the process. Callers hold cs_main.
+ */
+class CBlockIndexArena
+{
+private:
+    enum { CHUNK_ENTRIES = 16384 };
+    std::vector<char*> vChunks;
+    size_t nUsed;
+
+public:
+    CBlockIndexArena() : nUsed(0) {}
+
+    /** Returns raw storage for one CBlockIndex, to be used with placement new, or NULL if out of memory. */
+    void* Allocate()
+    {
+        if (nUsed == vChunks.size() * CHUNK_ENTRIES)
+        {
+            char* pchunk = (char*)::operator new(CHUNK_ENTRIES * sizeof(CBlockIndex), std::nothrow);
+            if (!pchunk)
+                return NULL;
+            vChunks.push_back(pchunk);
+        }
+        return vChunks.back() + (nUsed++ % CHUNK_ENTRIES) * sizeof(CBlockIndex);
+    }
+
+    size_t size() const { return nUsed; }
+
+    /** Bytes held by the arena, including unused space in the last chunk. */
+    size_t GetBytes() const { return vChunks.size() * CHUNK_ENTRIES * sizeof(CBlockIndex); }
+};
+
+extern CBlockIndexArena blockIndexArena;
+/** Recently served blocks in network serialization */
+extern CBlockCache blockcache;
+
+
+
 
 
 
@@ -1461,21 +1803,292 @@ int GetHeight();
 };
 
 
+/** An in-memory indexed chain of blocks. Gives O(1) access by height to the
+ * blocks of the active chain, instead of walking pprev/pnext.
+ */
+class CChain
+{
+private:
+    std::vector<CBlockIndex*> vChain;
+
+public:
+    /** Returns the index entry for the genesis block of this chain, or NULL if none. */
+    CBlockIndex *Genesis() const
+    {
+        return vChain.size() > 0 ? vChain[0] : NULL;
+    }
+
+    /** Returns the index entry for the tip of this chain, or NULL if none. */
+    CBlockIndex *Tip() const
+    {
+        return vChain.size() > 0 ? vChain[vChain.size() - 1] : NULL;
+    }
+
+    /** Returns the index entry at a particular height in this chain, or NULL if no such height exists. */
+    CBlockIndex *operator[](int nHeight) const
+    {
+        if (nHeight < 0 || nHeight >= (int)vChain.size())
+            return NULL;
+        return vChain[nHeight];
+    }
+
+    /** Efficiently check whether a block is present in this chain. */
+    bool Contains(const CBlockIndex *pindex) const
+    {
+        return pindex && (*this)[pindex->nHeight] == pindex;
+    }
+
+    /** Find the successor of a block in this chain, or NULL if the given index is not found or is the tip. */
+    CBlockIndex *Next(const CBlockIndex *pindex) const
+    {
+        if (Contains(pindex))
+            return (*this)[pindex->nHeight + 1];
+        return NULL;
+    }
+
+    /** Return the maximal height in the chain. Is equal to chain.Tip() ? chain.Tip()->nHeight : -1. */
+    int Height() const
+    {
+        return vChain.size() - 1;
+    }
+
+    /** Set/initialize a chain with a given tip. Only the entries above the fork point are rewritten. */
+    void SetTip(CBlockIndex *pindex);
+
+    /** Find the block of this chain stored at a position in the block files, or NULL. */
+    CBlockIndex *FindByPos(unsigned int nFile, unsigned int nBlockPos) const;
+};
+
+/** The currently-connected chain of blocks. Kept in step with pindexBest by SetBestChain. */
+extern CChain chainActive;
+
+
+/** A transaction in the memory pool, with the figures block assembly needs
+ * computed once on entry: size, fee, the inputs of its priority, and the
+ * size and fees of it together with its in-pool ancestors and descendants.
+ */
+class CTxMemPoolEntry
+{
+private:
+    CTransactionRef tx;
+    int64_t nFee;
+    unsigned int nTxSize;
+    int64_t nTime;                  // when it entered the pool
+    double dEntryPriority;          // priority at nEntryHeight
+    unsigned int nEntryHeight;
+    int64_t nInChainInputValue;     // inputs already in the chain, which age with it
+    size_t nUsageSize;              // heap memory of tx, shared or not
+
+    // Aggregates over this transaction and its in-pool ancestors
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    int64_t nFeesWithAncestors;
+
+    // Aggregates over this transaction and its in-pool descendants
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    int64_t nFeesWithDescendants;
+
+public:
+    /** Takes fee and priority from the prevouts in mapInputs; missing ones count as zero */
+    CTxMemPoolEntry(const CTransaction& txIn, const MapPrevTx& mapInputs, int64_t nTimeIn, unsigned int nHeight);
+
+    const CTransaction& GetTx() const { return *tx; }
+    const CTransactionRef& GetSharedTx() const { return tx; }
+    const uint256& GetHash() const { return tx->GetCachedHash(); }
+    int64_t GetFee() const { return nFee; }
+    unsigned int GetTxSize() const { return nTxSize; }
+    int64_t GetTime() const { return nTime; }
+    size_t GetDynamicMemoryUsage() const { return nUsageSize; }
+    /** Sum of valuein * confirmations / size, as it stands at nCurrentHeight */
+    double GetPriority(unsigned int nCurrentHeight) const;
+
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    int64_t GetFeesWithAncestors() const { return nFeesWithAncestors; }
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    int64_t GetFeesWithDescendants() const { return nFeesWithDescendants; }
+
+    void UpdateAncestorState(int64_t nCountDelta, int64_t nSizeDelta, int64_t nFeeDelta);
+    void UpdateDescendantState(int64_t nCountDelta, int64_t nSizeDelta, int64_t nFeeDelta);
+};
+
+/** Adjusts the aggregates of an entry in place, through CTxMemPool::mapTx.modify() */
+struct update_ancestor_state
+{
+    int64_t nCount, nSize, nFee;
+    update_ancestor_state(int64_t nCountIn, int64_t nSizeIn, int64_t nFeeIn) : nCount(nCountIn), nSize(nSizeIn), nFee(nFeeIn) {}
+    void operator()(CTxMemPoolEntry& e) { e.UpdateAncestorState(nCount, nSize, nFee); }
+};
+
+struct update_descendant_state
+{
+    int64_t nCount, nSize, nFee;
+    update_descendant_state(int64_t nCountIn, int64_t nSizeIn, int64_t nFeeIn) : nCount(nCountIn), nSize(nSizeIn), nFee(nFeeIn) {}
+    void operator()(CTxMemPoolEntry& e) { e.UpdateDescendantState(nCount, nSize, nFee); }
+};
+
+/** Orders pool entries best first by their own fee per byte */
+class CompareTxMemPoolEntryByFeeRate
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double f1 = (double)a.GetFee() * b.GetTxSize();
+        double f2 = (double)b.GetFee() * a.GetTxSize();
+        if (f1 == f2)
+            return a.GetHash() < b.GetHash();
+        return f1 > f2;
+    }
+};
+
+/** Orders pool entries best first by the fee per byte of the package of the
+ * transaction and its ancestors, or its own fee per byte if that is lower,
+ * so a well paying parent doesn't carry a cheap child along.
+ */
+class CompareTxMemPoolEntryByAncestorScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double aFees, aSize, bFees, bSize;
+        GetScore(a, aFees, aSize);
+        GetScore(b, bFees, bSize);
+        double f1 = aFees * bSize;
+        double f2 = bFees * aSize;
+        if (f1 == f2)
+            return a.GetHash() < b.GetHash();
+        return f1 > f2;
+    }
+
+    static void GetScore(const CTxMemPoolEntry& e, double& dFees, double& dSize)
+    {
+        if ((double)e.GetFeesWithAncestors() * e.GetTxSize() > (double)e.GetFee() * e.GetSizeWithAncestors())
+        {
+            dFees = e.GetFee();
+            dSize = e.GetTxSize();
+        }
+        else
+        {
+            dFees = e.GetFeesWithAncestors();
+            dSize = e.GetSizeWithAncestors();
+        }
+    }
+};
+
+/** Orders pool entries best first by the fee per byte of the transaction
+ * with its descendants, or its own fee per byte if that is higher. The
+ * worst go first when the pool is trimmed, together with their descendants.
+ */
+class CompareTxMemPoolEntryByDescendantScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double f1 = GetScore(a);
+        double f2 = GetScore(b);
+        if (f1 == f2)
+            return a.GetHash() < b.GetHash();
+        return f1 > f2;
+    }
+
+    /** Fee per byte */
+    static double GetScore(const CTxMemPoolEntry& e)
+    {
+        return std::max((double)e.GetFee() / e.GetTxSize(), (double)e.GetFeesWithDescendants() / e.GetSizeWithDescendants());
+    }
+};
+
+class CTxMemPoolEntryHash
+{
+public:
+    typedef uint256 result_type;
+    const result_type& operator()(const CTxMemPoolEntry& e) const { return e.GetHash(); }
+};
+
+// Index tags
+struct fee_rate {};
+struct ancestor_score {};
+struct descendant_score {};
+
 class CTxMemPool
 {
 public:
+    typedef boost::multi_index_container<
+        CTxMemPoolEntry,
+        boost::multi_index::indexed_by<
+            // by txid
+            boost::multi_index::ordered_unique<CTxMemPoolEntryHash>,
+            // by own fee rate, best first
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<fee_rate>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByFeeRate>,
+            // by ancestor package fee rate, best first
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<ancestor_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByAncestorScore>,
+            // by descendant package fee rate, best first
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<descendant_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByDescendantScore>
+        >
+    > indexed_transaction_set;
+    typedef indexed_transaction_set::iterator txiter;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
+    indexed_transaction_set mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    unsigned int nTransactionsRemoved;  // counts removals, unlike nTransactionsUpdated which counts every change
+
+private:
+    uint64_t nTotalTxSize;          // serialized size of all transactions
+    uint64_t nCachedInnerUsage;     // heap memory of all transactions
+    double dRollingMinimumFeeRate;  // per 1000 bytes, raised by evictions
+    int64_t nLastRollingFeeUpdate;
+
+public:
+    CTxMemPool() : nTransactionsRemoved(0), nTotalTxSize(0), nCachedInnerUsage(0), dRollingMinimumFeeRate(0), nLastRollingFeeUpdate(0) {}
 
+    /** nAcceptTime, if set, is the entry time to record instead of now (reloading a dump).
+        fScriptsChecked skips the input scripts, which the caller ran after PreAccept */
     bool accept(CTxDB& txdb, CTransaction &tx,
-                bool fCheckInputs, bool* pfMissingInputs);
+                bool fCheckInputs, bool* pfMissingInputs, int64_t nAcceptTime = 0, bool fScriptsChecked = false);
+    /** Every check of accept() but the input scripts, which are left in vChecks
+        so they can run without cs_main (CheckInputScripts). Adds nothing. */
+    bool PreAccept(CTxDB& txdb, CTransaction &tx, bool* pfMissingInputs, std::vector<CScriptCheck>& vChecks);
+    /** Add without checks, looking up fee and priority inputs itself (tests, and transactions added back by a reorg) */
     bool addUnchecked(const uint256& hash, CTransaction &tx);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry);
     bool remove(const CTransaction &tx, bool fRecursive = false);
+    bool remove(uint256 hash, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
 
+    /** Evict the lowest descendant score packages until the pool uses at most nSizeLimit bytes */
+    void TrimToSize(size_t nSizeLimit);
+    /** Fee per 1000 bytes a transaction needs to get in: 0 until the pool
+        has been full, then the fee rate of what was evicted, decaying over
+        ROLLING_FEE_HALFLIFE, faster while the pool is well below nSizeLimit */
+    int64_t GetRollingMinFee(size_t nSizeLimit);
+    /** Heap memory used by the pool, transactions and indexes included */
+    size_t DynamicMemoryUsage() const;
+
+    uint64_t GetTotalTxSize() const
+    {
+        LOCK(cs);
+        return nTotalTxSize;
+    }
+
+    /** In-pool ancestors of tx, not including tx itself */
+    void CalculateAncestors(const CTransaction& tx, std::set<uint256>& setAncestors) const;
+    /** In-pool descendants of the transaction hash, not including itself */
+    void CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const;
+
     unsigned long size() const
     {
         LOCK(cs);
@@ -1490,13 +2103,27 @@ public:
     bool lookup(uint256 hash, CTransaction& result) const
     {
         LOCK(cs);
-        std::map<uint256, CTransaction>::const_iterator i = mapTx.find(hash);
+        txiter i = mapTx.find(hash);
         if (i == mapTx.end()) return false;
-        result = i->second;
+        result = i->GetTx();
         return true;
     }
 
+    /** The pool's own copy of a transaction, without copying it; null if not in the pool */
+    CTransactionRef get(const uint256& hash) const
+    {
+        LOCK(cs);
+        txiter i = mapTx.find(hash);
+        if (i == mapTx.end()) return CTransactionRef();
+        return i->GetSharedTx();
+    }
 
+private:
+    /** Recompute the ancestor and descendant aggregates of one entry */
+    void UpdateAggregates(const uint256& hash);
+    /** The checks of accept() up to the fee checks; fetches the inputs */
+    bool CheckAccept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs, bool* pfMissingInputs,
+                     MapPrevTx& mapInputs, const CTransaction*& ptxOld);
 };
 
 extern CTxMemPool mempool;
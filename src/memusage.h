@@ -0,0 +1,70 @@
+// Copyright (c) 2015-2020 Bean Core www.beancash.org
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITBEAN_MEMUSAGE_H
+#define BITBEAN_MEMUSAGE_H
+
+#include <stddef.h>
+#include <map>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+/** Estimates of the heap memory used by containers, counting what malloc
+ * really hands out rather than just the bytes asked for.
+ */
+namespace memusage
+{
+
+/** Bytes malloc uses for an allocation of nAlloc bytes (glibc: 16 byte chunks with an 8 byte header on 64-bit) */
+static inline size_t MallocUsage(size_t nAlloc)
+{
+    if (nAlloc == 0)
+        return 0;
+    if (sizeof(void*) == 8)
+        return ((nAlloc + 31) >> 4) << 4;
+    return ((nAlloc + 15) >> 3) << 3;
+}
+
+/** Red-black tree node of a std::map or std::set: colour, parent, left and right, then the value */
+template<typename X>
+struct stl_tree_node
+{
+    int color;
+    void* parent;
+    void* left;
+    void* right;
+    X x;
+};
+
+/** Control block of a boost::shared_ptr: vtable, use and weak counts, and the pointer */
+struct shared_counter
+{
+    void* vtable;
+    int use_count;
+    int weak_count;
+    void* px;
+};
+
+template<typename X>
+static inline size_t DynamicUsage(const std::vector<X>& v)
+{
+    return MallocUsage(v.capacity() * sizeof(X));
+}
+
+template<typename X, typename Y>
+static inline size_t DynamicUsage(const std::map<X, Y>& m)
+{
+    return MallocUsage(sizeof(stl_tree_node<std::pair<const X, Y> >)) * m.size();
+}
+
+/** The object pointed to and the control block, counted in full by each owner */
+template<typename X>
+static inline size_t DynamicUsage(const boost::shared_ptr<X>& p)
+{
+    return p ? MallocUsage(sizeof(X)) + MallocUsage(sizeof(shared_counter)) : 0;
+}
+
+}
+
+#endif
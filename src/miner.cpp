@@ -55,69 +55,289 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
         ((uint32_t*)pstate)[i] = ctx.h[i];
 }
 
-// Some explaining would be appreciated
-class COrphan
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+int64_t nLastBeanStakeSearchInterval = 0;
+
+// The priority phase of block assembly sorts by priority, so:
+typedef std::pair<double, const CTxMemPoolEntry*> TxPriority;
+class TxPriorityCompare
 {
 public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
+    bool operator()(const TxPriority& a, const TxPriority& b)
+    {
+        return a.first < b.first;
+    }
+};
+
+// Fills a block from the memory pool. Transactions go in as packages, each
+// with its in-pool ancestors that aren't in the block yet in front of it.
+// The assembler lives on with a cached template, so that transactions that
+// join the pool later can be appended. Must be used with cs_main and
+// mempool.cs held.
+class CBlockAssembler
+{
+private:
+    CBlock* pblock;
+    CBlockIndex* pindexPrev;
+    bool fProofOfStake;
+    unsigned int nBlockMaxSize;
+    unsigned int nBlockPrioritySize;
+    unsigned int nBlockMinSize;
+    int64_t nMinTxFee;
+    map<uint256, CTxIndex> mapTestPool;
+    set<uint256> setIncluded;
+    set<uint256> setFailed;     // can't get into this block
+    set<uint256> setDeferred;   // not yet, retried by the next AddFeeTxs
+
+    // Why AddTx left a transaction out
+    enum AddResult
+    {
+        ADD_OK,
+        ADD_FAILED,     // too big, too many sigops or bad inputs (or fee, which rises with size): for good
+        ADD_NOT_YET,    // not final, or newer than the block may be yet
+    };
+
+    struct CompareByAncestorCount
+    {
+        bool operator()(CTxMemPool::txiter a, CTxMemPool::txiter b) const
+        {
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        }
+    };
 
-    COrphan(CTransaction* ptxIn)
+    AddResult AddTx(CTxDB& txdb, const CTxMemPoolEntry& entry)
     {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
+        // FetchInputs and ConnectInputs may mark it with DoS scores, so work on a copy
+        CTransaction tx(entry.GetTx());
+        if (tx.IsBeanBase() || tx.IsBeanStake())
+            return ADD_FAILED;
+        if (!tx.IsFinal())
+            return ADD_NOT_YET;
+
+        // Size limits
+        unsigned int nTxSize = entry.GetTxSize();
+        if (nBlockSize + nTxSize >= nBlockMaxSize)
+            return ADD_FAILED;
+
+        // Legacy limits on sigOps:
+        unsigned int nTxSigOps = tx.GetLegacySigOpCount();
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            return ADD_FAILED;
+
+        // Timestamp limit
+        if (tx.nTime > GetAdjustedTime() || (fProofOfStake && tx.nTime > pblock->vtx[0].nTime))
+            return ADD_NOT_YET;
+
+        // Transaction fee, known from the pool entry before any inputs are
+        // read. The minimum only rises as the block fills.
+        int64_t nMinFee = GetMinFee(tx, nBlockSize, GMF_BLOCK);
+        if (entry.GetFee() < nMinFee)
+            return ADD_FAILED;
+
+        // Connecting shouldn't fail due to dependency on other memory pool transactions
+        // because ancestors are always added first
+        map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
+        MapPrevTx mapInputs;
+        bool fInvalid;
+        if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
+            return ADD_FAILED;
+
+        int64_t nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
+        if (nTxFees < nMinFee)
+            return ADD_FAILED;
+
+        nTxSigOps += tx.GetP2SHSigOpCount(mapInputs);
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            return ADD_FAILED;
+
+        if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true))
+            return ADD_FAILED;
+        mapTestPoolTmp[entry.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
+        swap(mapTestPool, mapTestPoolTmp);
+
+        // Added
+        pblock->vtx.push_back(tx);
+        setIncluded.insert(entry.GetHash());
+        nBlockSize += nTxSize;
+        ++nBlockTx;
+        nBlockSigOps += nTxSigOps;
+        nFees += nTxFees;
+
+        if (fDebug && GetBoolArg("-printpriority"))
+        {
+            LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
+                   entry.GetPriority(pindexPrev->nHeight + 1), (double)nTxFees / (double(nTxSize)/1000.0), entry.GetHash().ToString().c_str());
+        }
+        return ADD_OK;
     }
 
-    void print() const
+    bool IsDone(const CTxMemPoolEntry& entry) const
     {
-        LogPrintf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-               ptx->GetHash().ToString().substr(0,10).c_str(), dPriority, dFeePerKb);
-        for (uint256 hash : setDependsOn)
-            LogPrintf("   setDependsOn %s\n", hash.ToString().substr(0,10).c_str());
+        return setIncluded.count(entry.GetHash()) || setFailed.count(entry.GetHash()) || setDeferred.count(entry.GetHash());
     }
-};
 
+    // Add entry with the ancestors it still needs. False if any of them
+    // doesn't fit or fails to connect.
+    bool AddPackage(CTxDB& txdb, const CTxMemPoolEntry& entry)
+    {
+        if (IsDone(entry))
+            return setIncluded.count(entry.GetHash());
+
+        set<uint256> setAncestors;
+        mempool.CalculateAncestors(entry.GetTx(), setAncestors);
+        vector<CTxMemPool::txiter> vPackage;
+        for (const uint256& hash : setAncestors)
+        {
+            if (setIncluded.count(hash))
+                continue;
+            if (setFailed.count(hash))
+            {
+                setFailed.insert(entry.GetHash());
+                return false;
+            }
+            if (setDeferred.count(hash))
+            {
+                setDeferred.insert(entry.GetHash());
+                return false;
+            }
+            vPackage.push_back(mempool.mapTx.find(hash));
+        }
+        vPackage.push_back(mempool.mapTx.find(entry.GetHash()));
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
-int64_t nLastBeanStakeSearchInterval = 0;
+        // A transaction has fewer ancestors than any of its descendants
+        std::sort(vPackage.begin(), vPackage.end(), CompareByAncestorCount());
+        for (CTxMemPool::txiter it : vPackage)
+        {
+            AddResult result = AddTx(txdb, *it);
+            if (result == ADD_OK)
+                continue;
+            // The block only grows, so whatever failed stays failed; time
+            // and finality may have moved on by the next pass
+            set<uint256>& setSkip = (result == ADD_FAILED ? setFailed : setDeferred);
+            setSkip.insert(it->GetHash());
+            setSkip.insert(entry.GetHash());
+            return false;
+        }
+        return true;
+    }
 
-// We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
-class TxPriorityCompare
-{
-    bool byFee;
 public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    int nBlockSigOps;
+    int64_t nFees;
+
+    CBlockAssembler(CBlock* pblockIn, CBlockIndex* pindexPrevIn, bool fProofOfStakeIn) :
+        pblock(pblockIn), pindexPrev(pindexPrevIn), fProofOfStake(fProofOfStakeIn),
+        nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0)
     {
-        if (byFee)
+        // Largest block you're willing to create:
+        nBlockMaxSize = GetArg("-blockmaxsize", MAX_BLOCK_SIZE_GEN/2);
+        // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+        nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
+
+        // How much of the block should be dedicated to high-priority transactions,
+        // included regardless of the fees they pay
+        nBlockPrioritySize = GetArg("-blockprioritysize", 27000);
+        nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+
+        // Minimum block size you want to create; block will be filled with free transactions
+        // until there are no more or the block reaches this size:
+        nBlockMinSize = GetArg("-blockminsize", 0);
+        nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+
+        // Fee-per-kilobyte amount considered the same as "free"
+        // Be careful setting this: if you set it to zero then
+        // a transaction spammer can cheaply fill blocks using
+        // 1-satoshi-fee transactions. It should be set above the real
+        // cost to you of processing a transaction.
+        nMinTxFee = MIN_TX_FEE;
+        if (mapArgs.count("-mintxfee"))
+            ParseMoney(mapArgs["-mintxfee"], nMinTxFee);
+    }
+
+    /** Fill nBlockPrioritySize with the highest priority transactions,
+     * regardless of their fees. Entries keep what priority needs, so this
+     * takes no disk reads. */
+    void AddPriorityTxs(CTxDB& txdb)
+    {
+        if (nBlockPrioritySize == 0)
+            return;
+
+        vector<TxPriority> vecPriority;
+        vecPriority.reserve(mempool.mapTx.size());
+        for (CTxMemPool::txiter it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it)
+            vecPriority.push_back(TxPriority(it->GetPriority(pindexPrev->nHeight + 1), &*it));
+        TxPriorityCompare comparer;
+        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        while (!vecPriority.empty())
         {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
+            double dPriority = vecPriority.front().first;
+            const CTxMemPoolEntry& entry = *vecPriority.front().second;
+            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+            vecPriority.pop_back();
+
+            if (nBlockSize + entry.GetTxSize() >= nBlockPrioritySize || dPriority < bean * 144 / 250)
+                break;
+            AddPackage(txdb, entry);
         }
-        else
+    }
+
+    /** Add by fee, walking the pool's ancestor score index best first.
+     * Whatever was already considered is skipped, so calling it again only
+     * looks at transactions that joined the pool since, and at those that
+     * were too new or not final before. */
+    void AddFeeTxs(CTxDB& txdb)
+    {
+        setDeferred.clear();
+
+        typedef CTxMemPool::indexed_transaction_set::index<ancestor_score>::type ancestor_score_index;
+        ancestor_score_index& index = mempool.mapTx.get<ancestor_score>();
+        for (ancestor_score_index::iterator it = index.begin(); it != index.end(); ++it)
         {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+            if (IsDone(*it))
+                continue;
+
+            // Skip free transactions if we're past the minimum block size:
+            double dFees, dSize;
+            CompareTxMemPoolEntryByAncestorScore::GetScore(*it, dFees, dSize);
+            if (dFees * 1000 / dSize < nMinTxFee && nBlockSize + it->GetTxSize() >= nBlockMinSize)
+                continue;
+
+            AddPackage(txdb, *it);
         }
     }
+
+    /** Set the reward and header fields from the transactions added so far */
+    void Finish()
+    {
+        nLastBlockTx = nBlockTx;
+        nLastBlockSize = nBlockSize;
+        if (fDebug && GetBoolArg("-printpriority"))
+            LogPrintf("CreateNewBlock(): total size %" PRIu64 "\n", nBlockSize);
+
+        if (!fProofOfStake)
+            pblock->vtx[0].vout[0].nValue = GetProofOfWorkReward(nFees);
+
+        // Fill in header
+        pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
+        pblock->nTime          = max(pindexPrev->GetPastTimeLimit()+1, pblock->GetMaxTransactionTime());
+        pblock->nTime          = max(pblock->GetBlockTime(), PastDrift(pindexPrev->GetBlockTime()));
+        if (!fProofOfStake)
+            pblock->UpdateTime(pindexPrev);
+        pblock->nNonce         = 0;
+    }
 };
 
-// CreateNewBlock: create new block (without proof-of-work/proof-of-bean)
-CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake, int64_t* pFees)
+// A block with only its beanbase, on top of pindexPrev
+static CBlock* CreateEmptyBlock(CWallet* pwallet, bool fProofOfStake, CBlockIndex* pindexPrev)
 {
     // Create new block
     std::unique_ptr<CBlock> pblock(new CBlock());
     if (!pblock.get())
         return NULL;
 
-    CBlockIndex* pindexPrev = pindexBest;
-
     // Create beanbase tx
     CTransaction txNew;
     txNew.vin.resize(1);
@@ -144,238 +364,105 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake, int64_t* pFees)
     // Add our beanbase tx as first transaction
     pblock->vtx.push_back(txNew);
 
-    // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", MAX_BLOCK_SIZE_GEN/2);
-    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
-
-    // How much of the block should be dedicated to high-priority transactions,
-    // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", 27000);
-    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
-
-    // Minimum block size you want to create; block will be filled with free transactions
-    // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", 0);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
-
-    // Fee-per-kilobyte amount considered the same as "free"
-    // Be careful setting this: if you set it to zero then
-    // a transaction spammer can cheaply fill blocks using
-    // 1-satoshi-fee transactions. It should be set above the real
-    // cost to you of processing a transaction.
-    int64_t nMinTxFee = MIN_TX_FEE;
-    if (mapArgs.count("-mintxfee"))
-        ParseMoney(mapArgs["-mintxfee"], nMinTxFee);
-
     pblock->nBits = GetNextTargetRequired(pindexPrev, fProofOfStake);
+    return pblock.release();
+}
+
+// CreateNewBlock: create new block (without proof-of-work/proof-of-bean)
+CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake, int64_t* pFees)
+{
+    CBlockIndex* pindexPrev = pindexBest;
+    std::unique_ptr<CBlock> pblock(CreateEmptyBlock(pwallet, fProofOfStake, pindexPrev));
+    if (!pblock.get())
+        return NULL;
 
     // Collect memory pool transactions into the block
-    int64_t nFees = 0;
     {
         LOCK2(cs_main, mempool.cs);
         CTxDB txdb("r");
+        CBlockAssembler assembler(pblock.get(), pindexPrev, fProofOfStake);
+        assembler.AddPriorityTxs(txdb);
+        assembler.AddFeeTxs(txdb);
+        assembler.Finish();
+        if (pFees)
+            *pFees = assembler.nFees;
+    }
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
-        {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsBeanBase() || tx.IsBeanStake() || !tx.IsFinal())
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-            bool fMissingInputs = false;
-            for (const CTxIn& txin : tx.vin)
-            {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = txindex.GetDepthInMainChain();
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
-            }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
-        }
+    return pblock.release();
+}
 
-        // Collect transactions into block
-        map<uint256, CTxIndex> mapTestPool;
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
+// The last template of each kind, kept for GetBlockTemplate
+class CBlockTemplate
+{
+public:
+    std::unique_ptr<CBlock> pblock;
+    std::unique_ptr<CBlockAssembler> assembler;
+    CBlockIndex* pindexPrev;
+    unsigned int nTransactionsUpdatedLast;
+    unsigned int nTransactionsRemovedLast;
+    int64_t nTimeBuilt;
+
+    CBlockTemplate() : pindexPrev(NULL), nTransactionsUpdatedLast(0), nTransactionsRemovedLast(0), nTimeBuilt(0) {}
+};
 
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+static CCriticalSection cs_blockTemplate;
+static CBlockTemplate blockTemplates[2]; // indexed by fProofOfStake
 
-        while (!vecPriority.empty())
+CBlock* GetBlockTemplate(CWallet* pwallet, bool fProofOfStake, int64_t* pFees)
+{
+    LOCK(cs_blockTemplate);
+    CBlockTemplate& tmpl = blockTemplates[fProofOfStake];
+    {
+        LOCK2(cs_main, mempool.cs);
+        if (tmpl.pblock && tmpl.pindexPrev == pindexBest && tmpl.nTransactionsRemovedLast == mempool.nTransactionsRemoved)
         {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = tx.GetLegacySigOpCount();
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Timestamp limit
-            if (tx.nTime > GetAdjustedTime() || (fProofOfStake && tx.nTime > pblock->vtx[0].nTime))
-                continue;
-
-            // Transaction fee
-            int64_t nMinFee = GetMinFee(tx, nBlockSize, GMF_BLOCK);
-
-            // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < bean * 144 / 250)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            // Connecting shouldn't fail due to dependency on other memory pool transactions
-            // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-            MapPrevTx mapInputs;
-            bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
-                continue;
-
-            int64_t nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
-            if (nTxFees < nMinFee)
-                continue;
-
-            nTxSigOps += tx.GetP2SHSigOpCount(mapInputs);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true))
-                continue;
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
-            swap(mapTestPool, mapTestPoolTmp);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fDebug && GetBoolArg("-printpriority"))
-            {
-                LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString().c_str());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
-            if (mapDependers.count(hash))
+            // Transactions only joined the pool since, so offer them to the
+            // template as it stands
+            if (tmpl.nTransactionsUpdatedLast != nTransactionsUpdated)
             {
-                for (COrphan* porphan : mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
+                if (fProofOfStake)
+                    tmpl.pblock->vtx[0].nTime = GetAdjustedTime();
+                CTxDB txdb("r");
+                tmpl.assembler->AddFeeTxs(txdb);
+                tmpl.assembler->Finish();
+                tmpl.nTransactionsUpdatedLast = nTransactionsUpdated;
             }
+            if (pFees)
+                *pFees = tmpl.assembler->nFees;
+            return new CBlock(*tmpl.pblock);
         }
+    }
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
-        if (fDebug && GetBoolArg("-printpriority"))
-            LogPrintf("CreateNewBlock(): total size %" PRIu64 "\n", nBlockSize);
-
-        if (!fProofOfStake)
-            pblock->vtx[0].vout[0].nValue = GetProofOfWorkReward(nFees);
-
-        if (pFees)
-            *pFees = nFees;
-
-        // Fill in header
-        pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
-        pblock->nTime          = max(pindexPrev->GetPastTimeLimit()+1, pblock->GetMaxTransactionTime());
-        pblock->nTime          = max(pblock->GetBlockTime(), PastDrift(pindexPrev->GetBlockTime()));
-        if (!fProofOfStake)
-            pblock->UpdateTime(pindexPrev);
-        pblock->nNonce         = 0;
+    // New tip, or transactions left the pool: start again
+    tmpl.assembler.reset();
+    CBlockIndex* pindexPrev = pindexBest;
+    tmpl.pblock.reset(CreateEmptyBlock(pwallet, fProofOfStake, pindexPrev));
+    if (!tmpl.pblock)
+        return NULL;
+    {
+        LOCK2(cs_main, mempool.cs);
+        CTxDB txdb("r");
+        tmpl.assembler.reset(new CBlockAssembler(tmpl.pblock.get(), pindexPrev, fProofOfStake));
+        tmpl.assembler->AddPriorityTxs(txdb);
+        tmpl.assembler->AddFeeTxs(txdb);
+        tmpl.assembler->Finish();
+        tmpl.pindexPrev = pindexPrev;
+        tmpl.nTransactionsUpdatedLast = nTransactionsUpdated;
+        tmpl.nTransactionsRemovedLast = mempool.nTransactionsRemoved;
+        tmpl.nTimeBuilt = GetTime();
     }
+    if (pFees)
+        *pFees = tmpl.assembler->nFees;
+    return new CBlock(*tmpl.pblock);
+}
 
-    return pblock.release();
+int64_t GetBlockTemplateAge(bool fProofOfStake)
+{
+    LOCK(cs_blockTemplate);
+    const CBlockTemplate& tmpl = blockTemplates[fProofOfStake];
+    if (!tmpl.pblock)
+        return -1;
+    return GetTime() - tmpl.nTimeBuilt;
 }
 
 
@@ -562,7 +649,7 @@ void ThreadStakeMiner(CWallet *pwallet)
         // Create new block
         //
         int64_t nFees;
-        std::unique_ptr<CBlock> pblock(CreateNewBlock(pwallet, true, &nFees));
+        std::unique_ptr<CBlock> pblock(GetBlockTemplate(pwallet, true, &nFees));
         if (!pblock.get())
             return;
 
@@ -13,6 +13,13 @@
 /* Generate a new block, without valid proof-of-work */
 CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake=false, int64_t* pFees = 0);
 
+/** Like CreateNewBlock, but from a cached template that is rebuilt only on a
+    new tip or when transactions leave the memory pool. The caller owns the copy returned. */
+CBlock* GetBlockTemplate(CWallet* pwallet, bool fProofOfStake=false, int64_t* pFees = 0);
+
+/** Seconds since the cached template was last built from scratch, or -1 */
+int64_t GetBlockTemplateAge(bool fProofOfStake);
+
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 
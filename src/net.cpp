@@ -15,12 +15,24 @@
 #include <string.h>
 #endif
 
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 using namespace std;
 using namespace boost;
 
 static const int MAX_OUTBOUND_CONNECTIONS = 32;
+/** Longest the socket handler waits for events when it has nothing to do (milliseconds) */
+static const int SOCKET_IDLE_WAIT = 500;
+/** How soon the socket handler retries a peer it had to skip (milliseconds) */
+static const int SOCKET_RETRY_WAIT = 50;
+/** Longest the message handler sleeps between passes, for trickling and pings (milliseconds) */
+static const int MESSAGE_HANDLER_WAIT = 100;
 
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
+static void RegisterSocketEvents(CNode* pnode);
 
 
 struct LocalServiceInfo {
@@ -42,14 +54,19 @@ static CNode* pnodeLocalHost = NULL;
 static CNode* pnodeSync = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<SOCKET> vhListenSocket;
+#ifdef USE_EPOLL
+static int hEpoll = -1;         // the listening sockets, hWakeupFd and every CNode socket, by fd
+static int hWakeupFd = -1;      // eventfd that ends an epoll_wait early
+#endif
 CAddrMan addrman;
 int nMaxConnections = 200;
 bool fImporting = false;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CTransactionRef> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
+static uint64_t nRelayBytes = 0;            // memory held by mapRelay, under cs_mapRelay
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
 
@@ -62,6 +79,12 @@ CCriticalSection cs_setservAddNodeAddresses;
 vector<std::string> vAddedNodes;
 CCriticalSection cs_vAddedNodes;
 
+// Wakes ThreadMessageHandler; fMsgProcWake keeps a wakeup from being lost
+// while it is in the middle of a pass
+static boost::mutex mutexMsgProc;
+static boost::condition_variable condMsgProc;
+static bool fMsgProcWake = false;
+
 static CSemaphore *semOutbound = NULL;
 
 // Signals for message handling
@@ -382,6 +405,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
         // Add node
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
         pnode->AddRef();
+        RegisterSocketEvents(pnode);
 
         {
             LOCK(cs_vNodes);
@@ -403,6 +427,12 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         LogPrint("net", "disconnecting node %s\n", addrName.c_str());
+#ifdef USE_EPOLL
+        // A copy of the fd inherited by a child process would keep the
+        // registration alive past closesocket
+        if (hEpoll != -1)
+            epoll_ctl(hEpoll, EPOLL_CTL_DEL, hSocket, NULL);
+#endif
         closesocket(hSocket);
         hSocket = INVALID_SOCKET;
 
@@ -519,8 +549,10 @@ void CNode::copyStats(CNodeStats &stats)
 #undef X
 
 // requires LOCK(cs_vRecvMsg)
-bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
+// fComplete is set if at least one message was completed
+bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& fComplete)
 {
+    fComplete = false;
     while (nBytes > 0) {
 
         // get current incomplete message, or create a new one
@@ -543,8 +575,10 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         pch += handled;
         nBytes -= handled;
 
-        if (msg.complete())
+        if (msg.complete()) {
             msg.nTime = GetTimeMicros();
+            fComplete = true;
+        }
     }
 
     return true;
@@ -609,6 +643,7 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 int SocketSendData(CNode *pnode)
 {
     int progress = 0;
+    bool fSendBufferFull = pnode->nSendSize >= SendBufferSize();
     std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
@@ -649,15 +684,108 @@ int SocketSendData(CNode *pnode)
         assert(pnode->nSendSize == 0);
     }
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+
+    // ProcessMessages stops reading from a peer whose send buffer is full
+    if (fSendBufferFull && pnode->nSendSize < SendBufferSize())
+        WakeMessageHandler();
     return progress;
 }
 
+// Set up epoll for the socket handler. Returns false if the handler has to
+// use select, which can't wait on sockets past FD_SETSIZE
+bool InitSocketEvents()
+{
+#ifdef USE_EPOLL
+    hEpoll = epoll_create1(EPOLL_CLOEXEC);
+    hWakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (hEpoll == -1 || hWakeupFd == -1)
+    {
+        LogPrintf("InitSocketEvents() : epoll unavailable, error %d; using select\n", errno);
+        if (hEpoll != -1)
+            close(hEpoll);
+        if (hWakeupFd != -1)
+            close(hWakeupFd);
+        hEpoll = hWakeupFd = -1;
+        return false;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = hWakeupFd;
+    epoll_ctl(hEpoll, EPOLL_CTL_ADD, hWakeupFd, &event);
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Level-triggered: one connection is accepted per pass, like before
+static bool RegisterListenSocket(SOCKET hListenSocket)
+{
+#ifdef USE_EPOLL
+    if (hEpoll == -1)
+        return true;
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = hListenSocket;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &event) == SOCKET_ERROR)
+        return false;
+#endif
+    return true;
+}
+
+// Edge-triggered: the socket is registered once, until CloseSocketDisconnect
+// removes it. Events carry the fd, not the CNode, so one that arrives for a
+// socket already closed can't reach a deleted node.
+static void RegisterSocketEvents(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    if (hEpoll == -1 || pnode->hSocket == INVALID_SOCKET)
+        return;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = pnode->hSocket;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) == SOCKET_ERROR)
+    {
+        LogPrintf("socket epoll_ctl error %d\n", errno);
+        pnode->CloseSocketDisconnect();
+    }
+#endif
+}
+
+void WakeSocketHandler()
+{
+#ifdef USE_EPOLL
+    if (hWakeupFd == -1)
+        return;
+    uint64_t nOne = 1;
+    if (write(hWakeupFd, &nOne, sizeof(nOne)) != sizeof(nOne))
+        return; // counter full, so a wakeup is pending anyway
+#endif
+}
+
+void WakeMessageHandler()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutexMsgProc);
+        fMsgProcWake = true;
+    }
+    condMsgProc.notify_one();
+}
+
+// requires LOCK(cs_vRecvMsg)
+static bool CanReceive(CNode* pnode)
+{
+    return pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() || pnode->GetTotalRecvSize() <= ReceiveFloodSize();
+}
+
 static list<CNode*> vNodesDisconnected;
 
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
     int progress;
+    int nWaitMillis = 0;
     while (true)
     {
         progress =0;
@@ -719,6 +847,7 @@ void ThreadSocketHandler()
                     if (fDelete)
                     {
                         vNodesDisconnected.remove(pnode);
+                        g_signals.FinalizeNode(pnode);
                         delete pnode;
                     }
                 }
@@ -733,65 +862,112 @@ void ThreadSocketHandler()
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
+        bool fEpoll = false;
+        bool fListenReady = false;
         fd_set fdsetRecv;
         fd_set fdsetSend;
         fd_set fdsetError;
         FD_ZERO(&fdsetRecv);
         FD_ZERO(&fdsetSend);
         FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
 
-        for (SOCKET hListenSocket : vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
+#ifdef USE_EPOLL
+        if (hEpoll != -1)
         {
-            LOCK(cs_vNodes);
-            for (CNode* pnode : vNodes)
+            // The kernel keeps the registrations, so there is no fd_set to
+            // rebuild and only sockets whose state changed are reported
+            fEpoll = true;
+            struct epoll_event events[256];
+            int nEvents = epoll_wait(hEpoll, events, 256, nWaitMillis);
+            boost::this_thread::interruption_point();
+            if (nEvents == SOCKET_ERROR && errno != EINTR)
             {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
+                LogPrintf("socket epoll_wait error %d\n", errno);
+                MilliSleep(SOCKET_RETRY_WAIT);
+            }
+            set<SOCKET> setReadable;
+            for (int i = 0; i < nEvents; i++)
+            {
+                if (events[i].data.fd == hWakeupFd)
                 {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
+                    uint64_t nCount;
+                    if (read(hWakeupFd, &nCount, sizeof(nCount)) != sizeof(nCount))
                         continue;
-                    }
                 }
+                else if (count(vhListenSocket.begin(), vhListenSocket.end(), (SOCKET)events[i].data.fd))
+                    fListenReady = true;
+                else if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                    setReadable.insert(events[i].data.fd);
+            }
+            if (!setReadable.empty())
+            {
+                LOCK(cs_vNodes);
+                for (CNode* pnode : vNodes)
+                    if (pnode->hSocket != INVALID_SOCKET && setReadable.count(pnode->hSocket))
+                        pnode->fReadable = true;
+            }
+        }
+        else
+#endif
+        {
+            struct timeval timeout;
+            timeout.tv_sec  = 0;
+            timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+
+            SOCKET hSocketMax = 0;
+            bool have_fds = false;
+
+            for (SOCKET hListenSocket : vhListenSocket) {
+                FD_SET(hListenSocket, &fdsetRecv);
+                hSocketMax = max(hSocketMax, hListenSocket);
+                have_fds = true;
+            }
+            {
+                LOCK(cs_vNodes);
+                for (CNode* pnode : vNodes)
                 {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() || pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
+                    if (pnode->hSocket == INVALID_SOCKET)
+                        continue;
+#ifdef USE_EPOLL
+                    // Without epoll, sockets past FD_SETSIZE can't be waited on
+                    if (pnode->hSocket >= (SOCKET)FD_SETSIZE)
+                        continue;
+#endif
+                    FD_SET(pnode->hSocket, &fdsetError);
+                    hSocketMax = max(hSocketMax, pnode->hSocket);
+                    have_fds = true;
+                    {
+                        TRY_LOCK(pnode->cs_vSend, lockSend);
+                        if (lockSend && !pnode->vSendMsg.empty()) {
+                            FD_SET(pnode->hSocket, &fdsetSend);
+                            continue;
+                        }
+                    }
+                    {
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv && CanReceive(pnode))
+                            FD_SET(pnode->hSocket, &fdsetRecv);
+                    }
                 }
             }
-        }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
+            int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                                 &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+            boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
+            if (nSelect == SOCKET_ERROR)
             {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %d\n", nErr);
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                if (have_fds)
+                {
+                    int nErr = WSAGetLastError();
+                    LogPrintf("socket select error %d\n", nErr);
+                    for (unsigned int i = 0; i <= hSocketMax; i++)
+                        FD_SET(i, &fdsetRecv);
+                }
+                FD_ZERO(&fdsetSend);
+                FD_ZERO(&fdsetError);
+                MilliSleep(timeout.tv_usec/1000);
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
         }
 
 
@@ -799,11 +975,16 @@ void ThreadSocketHandler()
         // Accept new connections
         //
         for (SOCKET hListenSocket : vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        if (hListenSocket != INVALID_SOCKET && (fEpoll ? fListenReady : FD_ISSET(hListenSocket, &fdsetRecv)))
         {
             struct sockaddr_storage sockaddr;
             socklen_t len = sizeof(sockaddr);
+#ifdef USE_EPOLL
+            // Not inherited by the processes runCommand starts
+            SOCKET hSocket = accept4(hListenSocket, (struct sockaddr*)&sockaddr, &len, SOCK_CLOEXEC);
+#else
             SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+#endif
             CAddress addr;
             int nInbound = 0;
 
@@ -838,6 +1019,7 @@ void ThreadSocketHandler()
                 LogPrint("net", "accepted connection %s\n", addr.ToString().c_str());
                 CNode* pnode = new CNode(hSocket, addr, "", true);
                 pnode->AddRef();
+                RegisterSocketEvents(pnode);
                 {
                     LOCK(cs_vNodes);
                     vNodes.push_back(pnode);
@@ -849,6 +1031,7 @@ void ThreadSocketHandler()
         //
         // Service each socket
         //
+        nWaitMillis = SOCKET_IDLE_WAIT;
         vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
@@ -865,10 +1048,17 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            bool fMessageComplete = false;
+            if (fEpoll ? pnode->fReadable : (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError)))
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                if (!lockRecv || (fEpoll && !CanReceive(pnode)))
+                {
+                    // Still readable: come back once the lock is free or
+                    // the message handler has made room
+                    nWaitMillis = min(nWaitMillis, SOCKET_RETRY_WAIT);
+                }
+                else
                 {
                     progress++;
                     {
@@ -878,7 +1068,7 @@ void ThreadSocketHandler()
                         int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
                         if (nBytes > 0)
                         {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, fMessageComplete))
                                 pnode->CloseSocketDisconnect();
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
@@ -902,20 +1092,34 @@ void ThreadSocketHandler()
                                 pnode->CloseSocketDisconnect();
                             }
                         }
+
+                        // A short read emptied the socket; more data brings a
+                        // new edge. A full one may have left some behind.
+                        if (nBytes < (int)sizeof(pchBuf))
+                            pnode->fReadable = false;
+                        else if (fEpoll)
+                            nWaitMillis = 0;
                     }
                 }
             }
+            // Only once cs_vRecvMsg is released can the message handler get at it
+            if (fMessageComplete)
+                WakeMessageHandler();
 
             //
             // Send
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            // With epoll a queue that didn't drain is retried on every pass;
+            // a full socket reports an edge once it has room again
+            if (fEpoll || FD_ISSET(pnode->hSocket, &fdsetSend))
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
                     progress += SocketSendData(pnode);
+                else
+                    nWaitMillis = min(nWaitMillis, SOCKET_RETRY_WAIT);
             }
 
             //
@@ -950,7 +1154,7 @@ void ThreadSocketHandler()
             LOCK(cs_vNodes);
             for (CNode* pnode : vNodesCopy)
                 pnode->Release();
-            if (progress == 0) // Slow down, nothing happened
+            if (progress == 0 && !fEpoll) // Slow down, nothing happened
                 MilliSleep(50);
         }
     }
@@ -1260,8 +1464,14 @@ void ThreadMessageHandler()
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
+                {
+                    bool fFlooded = !CanReceive(pnode);
                     if (!g_signals.ProcessMessages(pnode))
                         pnode->CloseSocketDisconnect();
+                    // The socket handler stopped reading from it until now
+                    if (fFlooded && CanReceive(pnode))
+                        WakeSocketHandler();
+                }
             }
             boost::this_thread::interruption_point();
 
@@ -1280,7 +1490,14 @@ void ThreadMessageHandler()
                 pnode->Release();
         }
 
-        MilliSleep(100);
+        // Sleep until a message arrives or something is queued to send, but
+        // no longer than it takes to trickle and ping
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+            if (!fMsgProcWake)
+                condMsgProc.timed_wait(lock, boost::posix_time::milliseconds(MESSAGE_HANDLER_WAIT));
+            fMsgProcWake = false;
+        }
     }
 }
 
@@ -1316,7 +1533,7 @@ bool BindListenPort(const CService &addrBind, string& strError)
         return false;
     }
 
-    SOCKET hListenSocket = socket(((struct sockaddr*)&sockaddr)->sa_family, SOCK_STREAM, IPPROTO_TCP);
+    SOCKET hListenSocket = socket(((struct sockaddr*)&sockaddr)->sa_family, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
     if (hListenSocket == INVALID_SOCKET)
     {
         strError = strprintf("Error: Couldn't open socket for incoming connections (socket returned error %d)", WSAGetLastError());
@@ -1386,6 +1603,12 @@ bool BindListenPort(const CService &addrBind, string& strError)
         return false;
     }
 
+    if (!RegisterListenSocket(hListenSocket))
+    {
+        strError = strprintf("Error: Couldn't wait for incoming connections (epoll_ctl returned error %d)", errno);
+        LogPrintf("%s\n", strError.c_str());
+        return false;
+    }
     vhListenSocket.push_back(hListenSocket);
 
     if (addrBind.IsRoutable() && fDiscover)
@@ -1513,6 +1736,12 @@ public:
             if (hListenSocket != INVALID_SOCKET)
                 if (closesocket(hListenSocket) == SOCKET_ERROR)
                     LogPrintf("closesocket(hListenSocket) failed with error %d\n", WSAGetLastError());
+#ifdef USE_EPOLL
+        if (hEpoll != -1)
+            close(hEpoll);
+        if (hWakeupFd != -1)
+            close(hWakeupFd);
+#endif
 
 #ifdef WIN32
         // Shutdown Windows Sockets
@@ -1524,26 +1753,40 @@ instance_of_cnetcleanup;
 
 void RelayTransaction(const CTransaction& tx, const uint256& hash)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    RelayTransaction(tx, hash, ss);
+    // Share the memory pool's copy when there is one
+    CTransactionRef ptx = mempool.get(hash);
+    if (!ptx)
+        ptx = MakeTransactionRef(tx);
+    RelayTransaction(ptx);
+}
+
+// The serialized size stands in for the heap memory of the inputs and outputs
+static size_t RelayUsage(const CTransactionRef& ptx)
+{
+    return memusage::DynamicUsage(ptx) + ::GetSerializeSize(*ptx, SER_NETWORK, PROTOCOL_VERSION);
 }
 
-void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss)
+void RelayTransaction(const CTransactionRef& ptx)
 {
-    CInv inv(MSG_TX, hash);
+    CInv inv(MSG_TX, ptx->GetCachedHash());
     {
         LOCK(cs_mapRelay);
-        // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime())
+        // Expire old relay messages, and early ones too while they hold
+        // more than MAX_RELAY_BYTES
+        while (!vRelayExpiration.empty() && (vRelayExpiration.front().first < GetTime() || nRelayBytes > MAX_RELAY_BYTES))
         {
-            mapRelay.erase(vRelayExpiration.front().second);
+            map<CInv, CTransactionRef>::iterator mi = mapRelay.find(vRelayExpiration.front().second);
+            if (mi != mapRelay.end())
+            {
+                nRelayBytes -= RelayUsage(mi->second);
+                mapRelay.erase(mi);
+            }
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Once it leaves the memory pool this is the last reference
+        if (mapRelay.insert(std::make_pair(inv, ptx)).second)
+            nRelayBytes += RelayUsage(ptx);
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
 
@@ -8,6 +8,7 @@
 
 #include <deque>
 #include <boost/array.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 #include <openssl/rand.h>
 
@@ -21,6 +22,7 @@
 #include "protocol.h"
 #include "addrman.h"
 #include "hash.h"
+#include "core.h"
 
 
 class CRequestTracker;
@@ -32,6 +34,8 @@ extern int nBestHeight;
 static const int PING_INTERVAL = 2 * 60;
 /** Time after which to disconnect, after waiting for a ping response (or inactivity). */
 static const int TIMEOUT_INTERVAL = 20 * 60;
+/** Memory mapRelay may hold before transactions leave it ahead of their 15 minutes */
+static const uint64_t MAX_RELAY_BYTES = 100 * 1000000;
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
@@ -45,9 +49,15 @@ CNode* ConnectNode(CAddress addrConnect, const char *strDest = NULL);
 void MapPort();
 unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
+/** Set up epoll for the socket handler; false if it falls back to select and its FD_SETSIZE limit */
+bool InitSocketEvents();
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 int SocketSendData(CNode *pnode);
+/** Make the socket handler look at the send queues now, not at its next event */
+void WakeSocketHandler();
+/** Make the message handler start a pass now instead of after its timeout */
+void WakeMessageHandler();
 
 //
 // Signals for message handling
@@ -56,6 +66,7 @@ struct CNodeSignals
 {
     boost::signals2::signal<bool (CNode*)> ProcessMessages;
     boost::signals2::signal<bool (CNode*, bool)> SendMessages;
+    boost::signals2::signal<void (CNode*)> FinalizeNode;
 };
 
 CNodeSignals& GetNodeSignals();
@@ -119,7 +130,7 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CTransactionRef> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -209,6 +220,7 @@ public:
 
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    std::deque<CInv> vRecvGetData; // "getdata" items not served yet, under cs_vRecvMsg
     uint64_t nRecvBytes;
     int nRecvVersion;
 
@@ -226,6 +238,7 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    bool fReadable; // socket handler only: epoll said readable, not yet read dry
     CSemaphoreGrant grantOutbound;
     int nRefCount;
 protected:
@@ -244,6 +257,19 @@ public:
     uint256 hashLastGetBlocksEnd;
     int nStartingHeight;
 
+    // headers-first sync, guarded by cs_main
+    int nSyncHeight; // best height this peer is known to have
+    uint256 hashSyncHeader; // best header this peer has announced
+    int nSyncHeaderIndex; // where that header meets the header chain
+    unsigned int nSyncHeaderGeneration; // header chain nSyncHeaderIndex refers to
+    int64_t nTimeHeadersRequested;
+    int nHeadersOffChain; // new headers it sent that aren't on the header chain
+    int nHeadersUncheckedHeight; // height of a header it sent that couldn't be checked
+    int nBlocksInFlight;
+    int nBlockStalls;
+    std::set<uint256> setBlocksNotFound; // blocks it answered "notfound" for
+    bool fPreferCompactBlocks; // send new blocks as "cmpctblock"
+
     // flood relay
     std::vector<CAddress> vAddrToSend;
     mruset<CAddress> setAddrKnown;
@@ -287,6 +313,7 @@ public:
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
+        fReadable = false;
         nRefCount = 0;
         nSendSize = 0;
         nSendOffset = 0;
@@ -294,6 +321,16 @@ public:
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
+        nSyncHeight = -1;
+        hashSyncHeader = 0;
+        nSyncHeaderIndex = -1;
+        nSyncHeaderGeneration = 0;
+        nTimeHeadersRequested = 0;
+        nHeadersOffChain = 0;
+        nHeadersUncheckedHeight = -1;
+        nBlocksInFlight = 0;
+        nBlockStalls = 0;
+        fPreferCompactBlocks = false;
         fGetAddr = false;
         nMisbehavior = 0;
         hashCheckpointKnown = 0;
@@ -347,7 +384,7 @@ public:
     }
 
     // requires LOCK(cs_vRecvMsg)
-    bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
+    bool ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& fComplete);
 
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
@@ -397,9 +434,12 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
-                vInventoryToSend.push_back(inv);
+            if (setInventoryKnown.count(inv))
+                return;
+            vInventoryToSend.push_back(inv);
         }
+        // SendMessages turns it into an "inv"
+        WakeMessageHandler();
     }
 
     void AskFor(const CInv& inv)
@@ -478,9 +518,14 @@ public:
         ssSend.GetAndClear(*it);
         nSendSize += (*it).size();
 
-        // If write queue empty, attempt "optimistic write"
+        // If write queue empty, attempt "optimistic write", and have the
+        // socket handler pick up whatever didn't fit
         if (it == vSendMsg.begin())
+        {
             SocketSendData(this);
+            if (!vSendMsg.empty())
+                WakeSocketHandler();
+        }
 
         LEAVE_CRITICAL_SECTION(cs_vSend);
     }
@@ -737,7 +782,7 @@ inline void RelayInventory(const CInv& inv)
 
 class CTransaction;
 void RelayTransaction(const CTransaction& tx, const uint256& hash);
-void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss);
+void RelayTransaction(const CTransactionRef& ptx);
 
 
 #endif
@@ -51,13 +51,25 @@ double GetPoWMHashPS()
         return 0;
 
     int nPoWInterval = 72;
-    int64_t nTargetSpacingWorkMin = 30, nTargetSpacingWork = 30;
+    int64_t nTargetSpacingWorkMin = 30;
 
-    CBlockIndex* pindex = pindexGenesisBlock;
-    CBlockIndex* pindexPrevWork = pindexGenesisBlock;
+    // The average runs over the whole chain, so it is kept for the tip it
+    // was computed at and only the blocks connected since are added to it
+    static CBlockIndex* pindexLast = NULL;
+    static CBlockIndex* pindexPrevWork = NULL;
+    static int64_t nTargetSpacingWork = 30;
 
-    while (pindex)
+    LOCK(cs_main);
+    if (!pindexLast || !chainActive.Contains(pindexLast))
     {
+        pindexLast = NULL;
+        pindexPrevWork = chainActive.Genesis();
+        nTargetSpacingWork = 30;
+    }
+
+    for (int nHeight = pindexLast ? pindexLast->nHeight + 1 : 0; nHeight <= chainActive.Height(); nHeight++)
+    {
+        CBlockIndex* pindex = chainActive[nHeight];
         if (pindex->IsProofOfWork())
         {
             int64_t nActualSpacingWork = pindex->GetBlockTime() - pindexPrevWork->GetBlockTime();
@@ -65,9 +77,8 @@ double GetPoWMHashPS()
             nTargetSpacingWork = max(nTargetSpacingWork, nTargetSpacingWorkMin);
             pindexPrevWork = pindex;
         }
-
-        pindex = pindex->pnext;
     }
+    pindexLast = chainActive.Tip();
 
     return GetDifficulty() * 4294.967296 / nTargetSpacingWork;
 }
@@ -221,6 +232,39 @@ Value getrawmempool(const Array& params, bool fHelp)
     return a;
 }
 
+Value getmempoolinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmempoolinfo\n"
+            "Returns details on the transaction memory pool: its size in transactions, their\n"
+            "serialized bytes, the memory it uses, the -maxmempool limit, and the minimum\n"
+            "fee per kB a transaction needs to get in.");
+
+    Object ret;
+    ret.push_back(Pair("size", (int64_t)mempool.size()));
+    ret.push_back(Pair("bytes", (int64_t)mempool.GetTotalTxSize()));
+    ret.push_back(Pair("usage", (int64_t)mempool.DynamicMemoryUsage()));
+    ret.push_back(Pair("maxmempool", (int64_t)nMaxMempoolSize));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(std::max(mempool.GetRollingMinFee(nMaxMempoolSize), MIN_RELAY_TX_FEE))));
+    return ret;
+}
+
+Value savemempool(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "savemempool\n"
+            "Writes the transaction memory pool to mempool.dat in the data directory, as is\n"
+            "done on shutdown.");
+
+    if (!fMempoolLoaded)
+        throw JSONRPCError(RPC_MISC_ERROR, "The memory pool was not loaded yet");
+    if (!DumpMempool())
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to dump the memory pool to disk");
+    return Value::null;
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -252,11 +296,71 @@ Value getblock(const Array& params, bool fHelp)
 
     CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
-    block.ReadFromDisk(pblockindex, true);
+    if (!block.ReadFromDisk(pblockindex, true))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, IsBlockFilePruned(pblockindex->nFile) ? "Block not available (pruned data)" : "Can't read block from disk");
 
     return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
 }
 
+/** Look up a block's file position under cs_main so the read itself can run unlocked. */
+static bool GetBlockPos(const uint256& hash, unsigned int& nFile, unsigned int& nBlockPos)
+{
+    LOCK(cs_main);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi == mapBlockIndex.end())
+        return false;
+    nFile = mi->second->nFile;
+    nBlockPos = mi->second->nBlockPos;
+    return true;
+}
+
+Value getrawblock(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getrawblock <hash>\n"
+            "Returns the serialized block with given block-hash as hex, read straight from the block file.");
+
+    uint256 hash = ParseHashV(params[0], "hash");
+    unsigned int nFile, nBlockPos;
+    if (!GetBlockPos(hash, nFile, nBlockPos))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    if (!ReadRawBlockFromDisk(ssBlock, nFile, nBlockPos))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+
+    return HexStr(ssBlock.begin(), ssBlock.end());
+}
+
+int RESTGetBlock(const string& strPath, string& strReply, string& strContentType)
+{
+    size_t nDot = strPath.rfind('.');
+    if (nDot == string::npos)
+        return HTTP_BAD_REQUEST;
+    string strHash = strPath.substr(0, nDot);
+    string strFormat = strPath.substr(nDot + 1);
+    if (strHash.size() != 64 || !IsHex(strHash) || (strFormat != "bin" && strFormat != "hex"))
+        return HTTP_BAD_REQUEST;
+
+    unsigned int nFile, nBlockPos;
+    if (!GetBlockPos(uint256(strHash), nFile, nBlockPos))
+        return HTTP_NOT_FOUND;
+
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    if (!ReadRawBlockFromDisk(ssBlock, nFile, nBlockPos))
+        return HTTP_INTERNAL_SERVER_ERROR;
+
+    if (strFormat == "bin")
+    {
+        strReply.assign(ssBlock.begin(), ssBlock.end());
+        strContentType = "application/octet-stream";
+    }
+    else
+        strReply = HexStr(ssBlock.begin(), ssBlock.end()) + "\n";
+    return HTTP_OK;
+}
+
 Value getblockbynumber(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -270,14 +374,9 @@ Value getblockbynumber(const Array& params, bool fHelp)
         throw runtime_error("Block number out of range.");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-
-    uint256 hash = *pblockindex->phashBlock;
-
-    pblockindex = mapBlockIndex[hash];
-    block.ReadFromDisk(pblockindex, true);
+    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
+    if (!block.ReadFromDisk(pblockindex, true))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, IsBlockFilePruned(pblockindex->nFile) ? "Block not available (pruned data)" : "Can't read block from disk");
 
     return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
 }
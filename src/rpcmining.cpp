@@ -84,6 +84,7 @@ Value getsproutinginfo(const Array& params, bool fHelp)
     obj.push_back(Pair("Current Block Size", (uint64_t)nLastBlockSize));
     obj.push_back(Pair("Current Block Tx", (uint64_t)nLastBlockTx));
     obj.push_back(Pair("Pooled Tx", (uint64_t)mempool.size()));
+    obj.push_back(Pair("Template Age", GetBlockTemplateAge(true)));
 
     obj.push_back(Pair("Difficulty", GetDifficulty(GetLastBlockIndex(pindexBest, true))));
     obj.push_back(Pair("Search Interval", (int)nLastBeanStakeSearchInterval));
@@ -415,7 +416,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
             delete pblock;
             pblock = NULL;
         }
-        pblock = CreateNewBlock(pwalletMain);
+        pblock = GetBlockTemplate(pwalletMain);
         if (!pblock)
             throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
 
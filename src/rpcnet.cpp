@@ -305,3 +305,23 @@ Value getnettotals(const Array& params, bool fHelp)
     obj.push_back(Pair("timemillis", GetTimeMillis()));
     return obj;
 }
+
+Value getblockcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getblockcacheinfo\n"
+            "Returns information about the cache of recently served blocks.");
+
+    size_t nEntries, nBytes, nMaxBytes;
+    uint64_t nHits, nMisses;
+    blockcache.GetStats(nEntries, nBytes, nMaxBytes, nHits, nMisses);
+
+    Object obj;
+    obj.push_back(Pair("blocks", (uint64_t)nEntries));
+    obj.push_back(Pair("bytes", (uint64_t)nBytes));
+    obj.push_back(Pair("maxbytes", (uint64_t)nMaxBytes));
+    obj.push_back(Pair("hits", nHits));
+    obj.push_back(Pair("misses", nMisses));
+    return obj;
+}
@@ -227,6 +227,7 @@ static const CRPCCommand vRPCCommands[] =
     { "getpeerinfo",            &getpeerinfo,            true,   false },
     { "ping",                   &ping,                   true,   false },
     { "getnettotals",           &getnettotals,           true,   true  },
+    { "getblockcacheinfo",      &getblockcacheinfo,      true,   true  },
     { "addnode",                &addnode,                true,   true  },
     { "getaddednodeinfo",       &getaddednodeinfo,       true,   true  },
     { "getdifficulty",          &getdifficulty,          true,   false },
@@ -261,7 +262,10 @@ static const CRPCCommand vRPCCommands[] =
     { "createmultisig",         &createmultisig,         true,   true  },
     { "addredeemscript",        &addredeemscript,        false,  false },
     { "getrawmempool",          &getrawmempool,          true,   false },
+    { "getmempoolinfo",         &getmempoolinfo,         true,   false },
+    { "savemempool",            &savemempool,            true,   false },
     { "getblock",               &getblock,               false,  false },
+    { "getrawblock",            &getrawblock,            true,   false },
     { "getblockbynumber",       &getblockbynumber,       false,  false },
     { "getblockhash",           &getblockhash,           false,  false },
     { "gettransaction",         &gettransaction,         false,  false },
@@ -702,7 +706,8 @@ void ServiceConnection(AcceptedConnection *conn)
         // Read HTTP message headers and body
         ReadHTTPMessage(conn->stream(), mapHeaders, strRequest, nProto);
 
-        if (strURI != "/") {
+        bool fRest = boost::starts_with(strURI, "/rest/block/");
+        if (strURI != "/" && !fRest) {
             conn->stream() << HTTPReply(HTTP_NOT_FOUND, "", false) << std::flush;
             break;
         }
@@ -728,6 +733,16 @@ void ServiceConnection(AcceptedConnection *conn)
         if (mapHeaders["connection"] == "close")
             fRun = false;
 
+        if (fRest)
+        {
+            string strReply, strContentType = "text/plain";
+            int nStatus = RESTGetBlock(strURI.substr(strlen("/rest/block/")), strReply, strContentType);
+            conn->stream() << HTTPReply(nStatus, strReply, fRun && nStatus == HTTP_OK, strContentType) << std::flush;
+            if (nStatus != HTTP_OK)
+                break;
+            continue;
+        }
+
         JSONRequest jreq;
         try
         {
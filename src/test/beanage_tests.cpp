@@ -0,0 +1,70 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txdb.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(beanage_tests)
+
+// A beansprout's stake in a block file that is no longer on disk: its
+// bean age, which ConnectBlock checks the stake reward against, and its
+// depth come from the coins table and the block index alone
+BOOST_AUTO_TEST_CASE(beanage_pruned_blockfile)
+{
+    LOCK(cs_main);
+    CBlockIndex* pindexTip = chainActive.Tip();
+    BOOST_REQUIRE(pindexTip);
+
+    // No block file 99999 exists, as if -prune had deleted it
+    const unsigned int nFile = 99999;
+    CTransaction txPrev;
+    txPrev.nTime = pindexTip->nTime + 1;
+    txPrev.vin.resize(1);
+    txPrev.vin[0].prevout.hash = 1;
+    txPrev.vin[0].prevout.n = 0;
+    txPrev.vout.resize(1);
+    txPrev.vout[0].nValue = 10 * bean;
+    txPrev.vout[0].scriptPubKey << OP_TRUE;
+    uint256 hashPrev = txPrev.GetHash();
+
+    CBlockIndex indexPrev;
+    indexPrev.pprev = pindexTip;
+    indexPrev.nHeight = pindexTip->nHeight + 1;
+    indexPrev.nFile = nFile;
+    indexPrev.nBlockPos = 0;
+    indexPrev.nTime = txPrev.nTime;
+    chainActive.SetTip(&indexPrev);
+
+    CTxDB txdb("r+");
+    BOOST_CHECK(txdb.UpdateTxIndex(hashPrev, CTxIndex(CDiskTxPos(nFile, 0, 81), txPrev.vout.size())));
+    BOOST_CHECK(txdb.WriteCoins(hashPrev, CCoins(txPrev)));
+
+    CTxIndex txindex;
+    BOOST_CHECK(txdb.ReadTxIndex(hashPrev, txindex));
+    BOOST_CHECK_EQUAL(txindex.GetDepthInMainChain(), 1);
+
+    const int64_t nDay = 24 * 60 * 60;
+    CTransaction txStake;
+    txStake.nTime = txPrev.nTime + nStakeMinAge + 10 * nDay;
+    txStake.vin.push_back(CTxIn(hashPrev, 0));
+    txStake.vout.resize(2);
+    txStake.vout[0].SetEmpty();
+    txStake.vout[1].nValue = 10 * bean;
+
+    uint64_t nBeanAge = 0;
+    BOOST_CHECK(txStake.GetBeanAge(txdb, nBeanAge));
+    BOOST_CHECK_EQUAL(nBeanAge, (uint64_t)(10 * (nStakeMinAge + 10 * nDay) / nDay));
+
+    // Not yet old enough: no age, but no failure either
+    txStake.nTime = txPrev.nTime + nStakeMinAge - 1;
+    BOOST_CHECK(txStake.GetBeanAge(txdb, nBeanAge));
+    BOOST_CHECK_EQUAL(nBeanAge, 0U);
+
+    txdb.EraseCoins(hashPrev);
+    txdb.EraseTxIndex(txPrev);
+    chainActive.SetTip(pindexTip);
+    BOOST_CHECK_EQUAL(txindex.GetDepthInMainChain(), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,53 @@
+#include <boost/test/unit_test.hpp>
+
+#include "blockcache.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockcache_tests)
+
+static CDataStream MakeBlock(unsigned char ch, size_t nSize)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.write(string(nSize, ch).data(), nSize);
+    return ss;
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_lru)
+{
+    CBlockCache cache(250);
+    cache.Insert(uint256(1), MakeBlock('a', 100));
+    cache.Insert(uint256(2), MakeBlock('b', 100));
+
+    // Touch 1 so 2 becomes the eviction candidate
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK(cache.Get(uint256(1), ss));
+    BOOST_CHECK_EQUAL(ss.size(), 100U);
+    BOOST_CHECK_EQUAL(ss[0], 'a');
+
+    cache.Insert(uint256(3), MakeBlock('c', 100));
+    BOOST_CHECK(cache.Get(uint256(1), ss));
+    BOOST_CHECK(!cache.Get(uint256(2), ss));
+    BOOST_CHECK(cache.Get(uint256(3), ss));
+    BOOST_CHECK_EQUAL(ss[0], 'c');
+
+    // Too big to ever fit
+    cache.Insert(uint256(4), MakeBlock('d', 300));
+    BOOST_CHECK(!cache.Get(uint256(4), ss));
+
+    size_t nEntries, nBytes, nMaxBytes;
+    uint64_t nHits, nMisses;
+    cache.GetStats(nEntries, nBytes, nMaxBytes, nHits, nMisses);
+    BOOST_CHECK_EQUAL(nEntries, 2U);
+    BOOST_CHECK_EQUAL(nBytes, 200U);
+    BOOST_CHECK_EQUAL(nMaxBytes, 250U);
+    BOOST_CHECK_EQUAL(nHits, 3U);
+    BOOST_CHECK_EQUAL(nMisses, 2U);
+
+    cache.SetMaxSize(150);
+    cache.GetStats(nEntries, nBytes, nMaxBytes, nHits, nMisses);
+    BOOST_CHECK_EQUAL(nEntries, 1U);
+    BOOST_CHECK(cache.Get(uint256(3), ss));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
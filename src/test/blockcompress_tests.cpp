@@ -0,0 +1,65 @@
+#include <boost/test/unit_test.hpp>
+
+#include "blockcompress.h"
+
+#include <stdlib.h>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockcompress_tests)
+
+static void CheckRoundTrip(const vector<unsigned char>& vch)
+{
+    vector<unsigned char> vchCompressed;
+    CompressBlock(vch.empty() ? NULL : &vch[0], vch.size(), vchCompressed);
+
+    vector<unsigned char> vchOut(vch.size());
+    BOOST_CHECK(DecompressBlock(&vchCompressed[0], vchCompressed.size(), vchOut.empty() ? NULL : &vchOut[0], vchOut.size()));
+    BOOST_CHECK(vchOut == vch);
+
+    // A prefix decodes on its own
+    if (vch.size() > 80)
+    {
+        vector<unsigned char> vchPrefix(80);
+        BOOST_CHECK(DecompressBlock(&vchCompressed[0], vchCompressed.size(), &vchPrefix[0], vchPrefix.size()));
+        BOOST_CHECK(equal(vchPrefix.begin(), vchPrefix.end(), vch.begin()));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(blockcompress_roundtrip)
+{
+    CheckRoundTrip(vector<unsigned char>());
+    CheckRoundTrip(vector<unsigned char>(7, 'x'));
+
+    // Repetitive data, like runs of similar scripts, shrinks
+    vector<unsigned char> vch;
+    for (int i = 0; i < 10000; i++)
+        vch.push_back("OP_DUP OP_HASH160 <20 bytes> OP_EQUALVERIFY OP_CHECKSIG"[i % 56]);
+    vector<unsigned char> vchCompressed;
+    CompressBlock(&vch[0], vch.size(), vchCompressed);
+    BOOST_CHECK(vchCompressed.size() < vch.size() / 10);
+    CheckRoundTrip(vch);
+
+    // Random data survives, if barely bigger
+    for (int i = 0; i < 10000; i++)
+        vch[i] = rand() & 0xff;
+    CheckRoundTrip(vch);
+    CompressBlock(&vch[0], vch.size(), vchCompressed);
+    BOOST_CHECK(vchCompressed.size() <= vch.size() + vch.size() / 255 + 16);
+}
+
+BOOST_AUTO_TEST_CASE(blockcompress_malformed)
+{
+    vector<unsigned char> vch(1000, 'a');
+    vector<unsigned char> vchCompressed;
+    CompressBlock(&vch[0], vch.size(), vchCompressed);
+
+    // Truncated input, asking for more than was compressed, bad offset
+    vector<unsigned char> vchOut(2000);
+    BOOST_CHECK(!DecompressBlock(&vchCompressed[0], vchCompressed.size() / 2, &vchOut[0], 1000));
+    BOOST_CHECK(!DecompressBlock(&vchCompressed[0], vchCompressed.size(), &vchOut[0], 2000));
+    const unsigned char pchBadOffset[] = { 0x10, 'a', 0x05, 0x00 };
+    BOOST_CHECK(!DecompressBlock(pchBadOffset, sizeof(pchBadOffset), &vchOut[0], 10));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
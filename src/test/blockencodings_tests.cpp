@@ -0,0 +1,106 @@
+#include <boost/test/unit_test.hpp>
+
+#include "blockencodings.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+static CBlock BuildBlock()
+{
+    CBlock block;
+    block.nBits = 0x1e0fffff;
+    block.nTime = 1500000000;
+    block.vtx.resize(4);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].prevout.SetNull();
+    block.vtx[0].vin[0].scriptSig << 1 << OP_0;
+    block.vtx[0].vout.resize(1);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+    {
+        block.vtx[i].vin.resize(1);
+        block.vtx[i].vin[0].prevout = COutPoint(block.vtx[i - 1].GetHash(), 0);
+        block.vtx[i].vout.resize(1);
+        block.vtx[i].vout[0].nValue = i * CENT;
+        block.vtx[i].vout[0].scriptPubKey << OP_TRUE;
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(cmpctblock_roundtrip)
+{
+    CBlock block = BuildBlock();
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    BOOST_CHECK_EQUAL(cmpctblock.vPrefilledTx.size(), 1U);
+    BOOST_CHECK_EQUAL(cmpctblock.vShortTxIDs.size(), 3U);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    // Six bytes per short ID
+    BOOST_CHECK(ss.size() < ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+
+    CBlockHeaderAndShortTxIDs cmpctblock2;
+    ss >> cmpctblock2;
+    BOOST_CHECK(cmpctblock2.header.GetHash() == block.GetHash());
+    BOOST_CHECK(cmpctblock2.vShortTxIDs == cmpctblock.vShortTxIDs);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        BOOST_CHECK_EQUAL(cmpctblock2.GetShortID(block.vtx[i].GetHash()), cmpctblock.vShortTxIDs[i - 1]);
+}
+
+BOOST_AUTO_TEST_CASE(cmpctblock_rebuild)
+{
+    CBlock block = BuildBlock();
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+
+    // Nothing in the pool: everything but the beanbase is missing
+    CTxMemPool pool;
+    CPartialBlock partial;
+    vector<unsigned short> vMissing;
+    BOOST_CHECK_EQUAL(partial.Init(cmpctblock, pool, vMissing), READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(vMissing.size(), 3U);
+    BOOST_CHECK_EQUAL(vMissing[0], 1);
+
+    vector<CTransaction> vtxMissing(block.vtx.begin() + 1, block.vtx.end());
+    CBlock block2;
+    BOOST_CHECK_EQUAL(partial.Fill(vtxMissing, block2), READ_STATUS_OK);
+    BOOST_CHECK(block2.GetHash() == block.GetHash());
+    BOOST_CHECK(block2.BuildMerkleTree() == block.hashMerkleRoot);
+
+    // Wrong transactions fail the merkle root, a wrong count is malformed
+    swap(vtxMissing[0], vtxMissing[1]);
+    BOOST_CHECK_EQUAL(partial.Fill(vtxMissing, block2), READ_STATUS_FAILED);
+    vtxMissing.pop_back();
+    BOOST_CHECK_EQUAL(partial.Fill(vtxMissing, block2), READ_STATUS_INVALID);
+}
+
+BOOST_AUTO_TEST_CASE(cmpctblock_malformed)
+{
+    CBlock block = BuildBlock();
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    cmpctblock.vPrefilledTx[0].nIndex = 10;
+
+    CTxMemPool pool;
+    CPartialBlock partial;
+    vector<unsigned short> vMissing;
+    BOOST_CHECK_EQUAL(partial.Init(cmpctblock, pool, vMissing), READ_STATUS_INVALID);
+
+    // Two transactions of the block with one short ID
+    cmpctblock = CBlockHeaderAndShortTxIDs(block);
+    cmpctblock.vShortTxIDs[1] = cmpctblock.vShortTxIDs[0];
+    BOOST_CHECK_EQUAL(partial.Init(cmpctblock, pool, vMissing), READ_STATUS_FAILED);
+
+    // More transactions than 16-bit indexes reach, rejected before anything
+    // is allocated for them
+    BOOST_CHECK(MAX_COMPACT_BLOCK_TXS <= 0xffff);
+    cmpctblock = CBlockHeaderAndShortTxIDs(block);
+    cmpctblock.vShortTxIDs.resize(MAX_COMPACT_BLOCK_TXS + 1);
+    BOOST_CHECK_EQUAL(partial.Init(cmpctblock, pool, vMissing), READ_STATUS_INVALID);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    CBlockHeaderAndShortTxIDs cmpctblock2;
+    BOOST_CHECK_THROW(ss >> cmpctblock2, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
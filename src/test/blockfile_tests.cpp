@@ -0,0 +1,62 @@
+#include <boost/test/unit_test.hpp>
+
+#include "blockfile.h"
+#include "util.h"
+
+#include <boost/filesystem/fstream.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockfile_tests)
+
+static boost::filesystem::path TestFilePath(unsigned int nFile)
+{
+    return boost::filesystem::temp_directory_path() / strprintf("blockfile_test_%u.dat", nFile);
+}
+
+static void Append(unsigned int nFile, const CDataStream& ss)
+{
+    boost::filesystem::ofstream file(TestFilePath(nFile), ios::binary | ios::app);
+    file.write(&ss[0], ss.size());
+}
+
+BOOST_AUTO_TEST_CASE(blockfile_map_read)
+{
+    boost::filesystem::remove(TestFilePath(1));
+    CBlockFileMap map(TestFilePath);
+
+    // Missing file: caller falls back to stdio
+    uint32_t n;
+    BOOST_CHECK(!map.Read(1, 0, n, SER_DISK, CLIENT_VERSION));
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << (uint32_t)7 << string("bean");
+    Append(1, ss);
+
+    string str;
+    BOOST_CHECK(map.Read(1, 0, n, SER_DISK, CLIENT_VERSION));
+    BOOST_CHECK_EQUAL(n, 7U);
+    BOOST_CHECK(map.Read(1, 4, str, SER_DISK, CLIENT_VERSION));
+    BOOST_CHECK_EQUAL(str, "bean");
+
+    // Appended data is past the mapped end and forces a remap
+    CDataStream ss2(SER_DISK, CLIENT_VERSION);
+    ss2 << string("sprout");
+    Append(1, ss2);
+    BOOST_CHECK(map.Read(1, ss.size(), str, SER_DISK, CLIENT_VERSION));
+    BOOST_CHECK_EQUAL(str, "sprout");
+
+    char pch[4];
+    BOOST_CHECK(map.ReadBytes(1, ss.size() + 1, pch, 4));
+    BOOST_CHECK(memcmp(pch, "spro", 4) == 0);
+    BOOST_CHECK(!map.ReadBytes(1, ss.size() + 4, pch, 4));
+    BOOST_CHECK(!map.Read(1, ss.size() + ss2.size(), n, SER_DISK, CLIENT_VERSION));
+
+    map.SetEnabled(false);
+    BOOST_CHECK(!map.Read(1, 0, n, SER_DISK, CLIENT_VERSION));
+    BOOST_CHECK_EQUAL(map.size(), 0U);
+
+    boost::filesystem::remove(TestFilePath(1));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,106 @@
+// Copyright (c) 2015-2020 Bean Core www.beancash.org
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include <vector>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
+#include "checkqueue.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+struct FakeCheck
+{
+    bool fOk;
+    FakeCheck() : fOk(true) {}
+    FakeCheck(bool fOkIn) : fOk(fOkIn) {}
+    bool operator()() const { return fOk; }
+    void swap(FakeCheck& check) { std::swap(fOk, check.fOk); }
+};
+
+static void RunChecks(CCheckQueue<FakeCheck>& queue, unsigned int nChecks, int nFail, bool fExpected)
+{
+    CCheckQueueControl<FakeCheck> control(&queue);
+    for (unsigned int i = 0; i < nChecks; i += 10)
+    {
+        vector<FakeCheck> vChecks;
+        for (unsigned int j = i; j < i + 10 && j < nChecks; j++)
+            vChecks.push_back(FakeCheck((int)j != nFail));
+        control.Add(vChecks);
+    }
+    BOOST_CHECK_EQUAL(control.Wait(), fExpected);
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_master_only)
+{
+    CCheckQueue<FakeCheck> queue(16);
+    RunChecks(queue, 1000, -1, true);
+    RunChecks(queue, 1000, 500, false);
+    // a failed batch must not poison the next one
+    RunChecks(queue, 1000, -1, true);
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_workers)
+{
+    CCheckQueue<FakeCheck> queue(16);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 3; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<FakeCheck>::Thread, boost::ref(queue)));
+
+    for (int n = 0; n < 20; n++)
+    {
+        RunChecks(queue, 5000, -1, true);
+        RunChecks(queue, 5000, n * 100, false);
+    }
+
+    queue.Quit();
+    threadGroup.join_all();
+}
+
+// Boost.Test checks are not thread safe, so the masters only count mismatches
+static void RunChecksRepeatedly(CCheckQueue<FakeCheck>* pqueue, int* pnErrors)
+{
+    for (int n = 0; n < 20; n++)
+    {
+        CCheckQueueControl<FakeCheck> control(pqueue);
+        vector<FakeCheck> vChecks;
+        for (int j = 0; j < 1000; j++)
+            vChecks.push_back(FakeCheck(n % 2 == 0 || j != n * 10));
+        control.Add(vChecks);
+        if (control.Wait() != (n % 2 == 0))
+            (*pnErrors)++;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_concurrent_masters)
+{
+    CCheckQueue<FakeCheck> queue(16);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 2; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<FakeCheck>::Thread, boost::ref(queue)));
+
+    // Controls on different threads take turns instead of mixing results
+    int nErrors[3] = { 0, 0, 0 };
+    boost::thread_group masters;
+    for (int i = 0; i < 3; i++)
+        masters.create_thread(boost::bind(&RunChecksRepeatedly, &queue, &nErrors[i]));
+    masters.join_all();
+    for (int i = 0; i < 3; i++)
+        BOOST_CHECK_EQUAL(nErrors[i], 0);
+
+    queue.Quit();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_null_control)
+{
+    CCheckQueueControl<FakeCheck> control(NULL);
+    vector<FakeCheck> vChecks(1, FakeCheck(false));
+    control.Add(vChecks);
+    BOOST_CHECK(control.Wait());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
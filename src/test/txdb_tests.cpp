@@ -0,0 +1,152 @@
+#include <boost/test/unit_test.hpp>
+
+#include "txdb.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(txdb_tests)
+
+// The linear scan CTxDB used before batches were indexed
+class CLinearBatchScanner : public leveldb::WriteBatch::Handler {
+public:
+    std::string needle;
+    bool foundEntry;
+
+    CLinearBatchScanner() : foundEntry(false) {}
+
+    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
+        if (key.ToString() == needle)
+            foundEntry = true;
+    }
+
+    virtual void Delete(const leveldb::Slice& key) {
+        if (key.ToString() == needle)
+            foundEntry = true;
+    }
+};
+
+static string BatchKey(int n)
+{
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << make_pair(string("tx"), uint256(n));
+    return ssKey.str();
+}
+
+BOOST_AUTO_TEST_CASE(txdb_batch_overlay)
+{
+    CTxDBBatch batch;
+    string strValue;
+    bool fDeleted = false;
+
+    BOOST_CHECK(!batch.Find(BatchKey(1), &strValue, &fDeleted));
+
+    batch.Put(BatchKey(1), "a");
+    BOOST_CHECK(batch.Find(BatchKey(1), &strValue, &fDeleted));
+    BOOST_CHECK(!fDeleted && strValue == "a");
+
+    // Later writes win
+    batch.Put(BatchKey(1), "b");
+    BOOST_CHECK(batch.Find(BatchKey(1), &strValue, &fDeleted));
+    BOOST_CHECK(!fDeleted && strValue == "b");
+
+    batch.Delete(BatchKey(1));
+    BOOST_CHECK(batch.Find(BatchKey(1), &strValue, &fDeleted));
+    BOOST_CHECK(fDeleted);
+
+    batch.Put(BatchKey(1), "c");
+    BOOST_CHECK(batch.Find(BatchKey(1), &strValue, &fDeleted));
+    BOOST_CHECK(!fDeleted && strValue == "c");
+
+    BOOST_CHECK(!batch.Find(BatchKey(2), &strValue, &fDeleted));
+    BOOST_CHECK_EQUAL(batch.size(), 1U);
+
+    // Appending a later batch overrides and extends
+    CTxDBBatch later;
+    later.Delete(BatchKey(1));
+    later.Put(BatchKey(2), "d");
+    batch.Append(later);
+    BOOST_CHECK(batch.Find(BatchKey(1), &strValue, &fDeleted));
+    BOOST_CHECK(fDeleted);
+    BOOST_CHECK(batch.Find(BatchKey(2), &strValue, &fDeleted));
+    BOOST_CHECK(!fDeleted && strValue == "d");
+    BOOST_CHECK_EQUAL(batch.size(), 2U);
+
+    leveldb::WriteBatch writebatch;
+    batch.WriteTo(writebatch);
+    CLinearBatchScanner scanner;
+    scanner.needle = BatchKey(2);
+    writebatch.Iterate(&scanner);
+    BOOST_CHECK(scanner.foundEntry);
+
+    batch.Clear();
+    BOOST_CHECK(batch.empty());
+    BOOST_CHECK_EQUAL(batch.GetBytes(), 0U);
+}
+
+// Not a pass/fail check: reports how long reading back every key of a large
+// block's worth of index updates takes with the old scan and with the overlay.
+BOOST_AUTO_TEST_CASE(txdb_batch_benchmark)
+{
+    const int nKeys = 4000;
+    CTxDBBatch batch;
+    leveldb::WriteBatch writebatch;
+    for (int i = 0; i < nKeys; i++)
+    {
+        batch.Put(BatchKey(i), string(100, 'x'));
+        writebatch.Put(BatchKey(i), string(100, 'x'));
+    }
+
+    int64_t nStart = GetTimeMicros();
+    int nFound = 0;
+    for (int i = 0; i < nKeys; i++)
+    {
+        CLinearBatchScanner scanner;
+        scanner.needle = BatchKey(i);
+        writebatch.Iterate(&scanner);
+        nFound += scanner.foundEntry;
+    }
+    int64_t nScan = GetTimeMicros() - nStart;
+    BOOST_CHECK_EQUAL(nFound, nKeys);
+
+    nStart = GetTimeMicros();
+    nFound = 0;
+    for (int i = 0; i < nKeys; i++)
+    {
+        string strValue;
+        bool fDeleted;
+        nFound += batch.Find(BatchKey(i), &strValue, &fDeleted);
+    }
+    int64_t nOverlay = GetTimeMicros() - nStart;
+    BOOST_CHECK_EQUAL(nFound, nKeys);
+
+    BOOST_TEST_MESSAGE(strprintf("%d batch reads: linear scan %" PRId64 "us, overlay %" PRId64 "us", nKeys, nScan, nOverlay));
+}
+
+// A full record cache drops its least recently used entries, not everything
+BOOST_AUTO_TEST_CASE(txdb_cache_lru)
+{
+    CTxDBCache cache;
+    CTxIndex txindex(CDiskTxPos(1, 2, 3), 2);
+    uint64_t nSequence = cache.GetSequence();
+    for (int i = 1; i <= 10; i++)
+        cache.FillTxIndex(uint256(i), txindex, nSequence);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 10U);
+
+    // Room for about ten: touch the oldest, then add five more
+    CTxIndex txindexRead;
+    cache.SetMaxSize(10 * (2 * sizeof(uint256) + 96 + ::GetSerializeSize(txindex, SER_DISK, CLIENT_VERSION)));
+    BOOST_CHECK(cache.GetTxIndex(uint256(1), txindexRead));
+    for (int i = 11; i <= 15; i++)
+        cache.FillTxIndex(uint256(i), txindex, nSequence);
+
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 10U);
+    BOOST_CHECK(cache.GetTxIndex(uint256(1), txindexRead));
+    BOOST_CHECK(txindexRead.pos == txindex.pos);
+    for (int i = 2; i <= 6; i++)
+        BOOST_CHECK(!cache.GetTxIndex(uint256(i), txindexRead));
+    for (int i = 7; i <= 15; i++)
+        BOOST_CHECK(cache.GetTxIndex(uint256(i), txindexRead));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
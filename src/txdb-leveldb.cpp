@@ -9,6 +9,8 @@
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 
 #include <leveldb/env.h>
 #include <leveldb/cache.h>
@@ -16,6 +18,7 @@
 #include <memenv/memenv.h>
 
 #include "kernel.h"
+#include "checkqueue.h"
 #include "checkpoints.h"
 #include "txdb.h"
 #include "util.h"
@@ -26,6 +29,144 @@ using namespace std;
 using namespace boost;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
+CTxDBCache txdbcache;
+
+// Commits held back while deferring, see CTxDB::SetDeferCommit()
+static CCriticalSection cs_deferred;
+static CTxDBBatch deferredBatch;
+static bool fDeferCommit = false;
+static uint64_t nDeferredMaxBytes = 0;
+
+// Rough memory cost of one cache entry: key, map and list nodes and the record itself.
+template<typename T>
+static uint64_t CacheEntrySize(const T& value)
+{
+    return 2 * sizeof(uint256) + 96 + ::GetSerializeSize(value, SER_DISK, CLIENT_VERSION);
+}
+
+template<typename T, typename L>
+static void CacheErase(std::map<uint256, std::pair<T, typename L::iterator> >& mapCache, L& lru, const uint256& hash, uint64_t& nBytes)
+{
+    typename std::map<uint256, std::pair<T, typename L::iterator> >::iterator mi = mapCache.find(hash);
+    if (mi == mapCache.end())
+        return;
+    nBytes -= CacheEntrySize(mi->second.first);
+    lru.erase(mi->second.second);
+    mapCache.erase(mi);
+}
+
+template<typename T, typename L>
+static void CacheSet(std::map<uint256, std::pair<T, typename L::iterator> >& mapCache, L& lru, bool fCoins, const uint256& hash, const T& value, uint64_t& nBytes)
+{
+    CacheErase(mapCache, lru, hash, nBytes);
+    lru.push_front(make_pair(fCoins, hash));
+    mapCache.insert(make_pair(hash, make_pair(value, lru.begin())));
+    nBytes += CacheEntrySize(value);
+}
+
+template<typename T, typename L>
+static bool CacheGet(std::map<uint256, std::pair<T, typename L::iterator> >& mapCache, L& lru, const uint256& hash, T& value)
+{
+    typename std::map<uint256, std::pair<T, typename L::iterator> >::iterator mi = mapCache.find(hash);
+    if (mi == mapCache.end())
+        return false;
+    lru.splice(lru.begin(), lru, mi->second.second);
+    value = mi->second.first;
+    return true;
+}
+
+void CTxDBCache::LimitSize()
+{
+    // Drop the least recently used records, which are cheap to re-read
+    while (nMaxBytes > 0 && nBytes > nMaxBytes && !lruEntries.empty())
+    {
+        uint256 hash = lruEntries.back().second;
+        if (lruEntries.back().first)
+            CacheErase(mapCoins, lruEntries, hash, nBytes);
+        else
+            CacheErase(mapTxIndex, lruEntries, hash, nBytes);
+    }
+}
+
+void CTxDBCache::SetMaxSize(uint64_t nMaxBytesIn)
+{
+    LOCK(cs);
+    nMaxBytes = nMaxBytesIn;
+    LimitSize();
+}
+
+uint64_t CTxDBCache::GetSequence()
+{
+    LOCK(cs);
+    return nSequence;
+}
+
+void CTxDBCache::Clear()
+{
+    LOCK(cs);
+    lruEntries.clear();
+    mapTxIndex.clear();
+    mapCoins.clear();
+    nBytes = 0;
+    nSequence++;
+}
+
+bool CTxDBCache::GetTxIndex(const uint256& hash, CTxIndex& txindex)
+{
+    LOCK(cs);
+    return CacheGet(mapTxIndex, lruEntries, hash, txindex);
+}
+
+bool CTxDBCache::GetCoins(const uint256& hash, CCoins& coins)
+{
+    LOCK(cs);
+    return CacheGet(mapCoins, lruEntries, hash, coins);
+}
+
+void CTxDBCache::FillTxIndex(const uint256& hash, const CTxIndex& txindex, uint64_t nSequenceRead)
+{
+    LOCK(cs);
+    if (nSequenceRead != nSequence)
+        return;
+    CacheSet(mapTxIndex, lruEntries, false, hash, txindex, nBytes);
+    LimitSize();
+}
+
+void CTxDBCache::FillCoins(const uint256& hash, const CCoins& coins, uint64_t nSequenceRead)
+{
+    LOCK(cs);
+    if (nSequenceRead != nSequence)
+        return;
+    CacheSet(mapCoins, lruEntries, true, hash, coins, nBytes);
+    LimitSize();
+}
+
+void CTxDBCache::Apply(const std::map<uint256, CTxIndex>& mapTxIndexIn, const std::map<uint256, CCoins>& mapCoinsIn)
+{
+    LOCK(cs);
+    for (const std::pair<const uint256, CTxIndex>& item : mapTxIndexIn)
+    {
+        if (item.second.IsNull())
+            CacheErase(mapTxIndex, lruEntries, item.first, nBytes);
+        else
+            CacheSet(mapTxIndex, lruEntries, false, item.first, item.second, nBytes);
+    }
+    for (const std::pair<const uint256, CCoins>& item : mapCoinsIn)
+    {
+        if (item.second.IsNull())
+            CacheErase(mapCoins, lruEntries, item.first, nBytes);
+        else
+            CacheSet(mapCoins, lruEntries, true, item.first, item.second, nBytes);
+    }
+    nSequence++;
+    LimitSize();
+}
+
+size_t CTxDBCache::GetCacheSize()
+{
+    LOCK(cs);
+    return mapTxIndex.size() + mapCoins.size();
+}
 
 static leveldb::Options GetOptions() {
     leveldb::Options options;
@@ -82,6 +223,8 @@ CTxDB::CTxDB(const char* pszMode)
 
     options = GetOptions();
     options.create_if_missing = fCreate;
+    // -dbcache is shared between the record cache (sized by AppInit2) and deferred commits
+    nDeferredMaxBytes = (uint64_t)GetArg("-dbcache", 25) << 19;
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
 
     init_blockindex(options); // Init directory
@@ -97,6 +240,7 @@ CTxDB::CTxDB(const char* pszMode)
             LogPrintf("Required index version is %d, removing old database\n", DATABASE_VERSION);
 
             // Leveldb instance destruction
+            txdbcache.Clear();
             delete txdb;
             txdb = pdb = NULL;
             delete activeBatch;
@@ -124,6 +268,7 @@ CTxDB::CTxDB(const char* pszMode)
 
 void CTxDB::Close()
 {
+    txdbcache.Clear();
     delete txdb;
     txdb = pdb = NULL;
     delete options.filter_policy;
@@ -137,16 +282,70 @@ void CTxDB::Close()
 bool CTxDB::TxnBegin()
 {
     assert(!activeBatch);
-    activeBatch = new leveldb::WriteBatch();
+    activeBatch = new CTxDBBatch();
     return true;
 }
 
 bool CTxDB::TxnCommit()
 {
     assert(activeBatch);
-    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
+    bool fOk = CommitBatch(*activeBatch);
     delete activeBatch;
     activeBatch = NULL;
+    if (fOk)
+        txdbcache.Apply(mapPendingTxIndex, mapPendingCoins);
+    mapPendingTxIndex.clear();
+    mapPendingCoins.clear();
+    return fOk;
+}
+
+// Must be called with cs_deferred held. pbatchNext goes in the same write,
+// after deferredBatch; neither is changed if the write fails.
+static bool WriteDeferred(const CTxDBBatch* pbatchNext = NULL)
+{
+    if (deferredBatch.empty() && !pbatchNext)
+        return true;
+
+    // Index entries must never refer to block data that could be lost
+    if (!FlushBlockFiles())
+        return error("CTxDB::FlushDeferred() : FlushBlockFiles failed");
+
+    int64_t nStart = GetTimeMillis();
+    leveldb::WriteBatch batch;
+    deferredBatch.WriteTo(batch);
+    if (pbatchNext)
+        pbatchNext->WriteTo(batch);
+    leveldb::WriteOptions options;
+    options.sync = true;
+    leveldb::Status status = txdb->Write(options, &batch);
+    if (!status.ok())
+        return error("CTxDB::FlushDeferred() : LevelDB batch commit failure: %s", status.ToString().c_str());
+    LogPrint("txdb", "CTxDB::FlushDeferred() : wrote %u entries (%" PRIu64 " bytes) in %" PRId64 "ms\n",
+        deferredBatch.size() + (pbatchNext ? pbatchNext->size() : 0), deferredBatch.GetBytes() + (pbatchNext ? pbatchNext->GetBytes() : 0), GetTimeMillis() - nStart);
+    deferredBatch.Clear();
+    return true;
+}
+
+bool CTxDB::CommitBatch(const CTxDBBatch& batchIn)
+{
+    {
+        LOCK(cs_deferred);
+        if (fDeferCommit || !deferredBatch.empty())
+        {
+            if (fDeferCommit && deferredBatch.GetBytes() + batchIn.GetBytes() < nDeferredMaxBytes)
+            {
+                deferredBatch.Append(batchIn);
+                return true;
+            }
+            // Not merged first, so a failed write leaves deferredBatch as it
+            // was and the caller's block is not connected
+            return WriteDeferred(&batchIn);
+        }
+    }
+
+    leveldb::WriteBatch batch;
+    batchIn.WriteTo(batch);
+    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
     if (!status.ok()) {
         LogPrintf("LevelDB batch commit failure: %s\n", status.ToString().c_str());
         return false;
@@ -154,61 +353,103 @@ bool CTxDB::TxnCommit()
     return true;
 }
 
-class CBatchScanner : public leveldb::WriteBatch::Handler {
-public:
-    std::string needle;
-    bool *deleted;
-    std::string *foundValue;
-    bool foundEntry;
-
-    CBatchScanner() : foundEntry(false) {}
-
-    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
-        }
-    }
+bool CTxDB::HaveDeferred()
+{
+    LOCK(cs_deferred);
+    return fDeferCommit || !deferredBatch.empty();
+}
 
-    virtual void Delete(const leveldb::Slice& key) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = true;
-        }
-    }
-};
+bool CTxDB::SetDeferCommit(bool fDefer)
+{
+    LOCK(cs_deferred);
+    if (fDefer == fDeferCommit)
+        return true;
+    LogPrint("txdb", "CTxDB::SetDeferCommit(%d)\n", fDefer);
+    // Keep deferring what couldn't be written
+    if (!fDefer && !WriteDeferred())
+        return false;
+    fDeferCommit = fDefer;
+    return true;
+}
+
+bool CTxDB::FlushDeferred()
+{
+    LOCK(cs_deferred);
+    return WriteDeferred();
+}
+
+bool CTxDB::Sync()
+{
+    LOCK(cs_deferred);
+    if (!WriteDeferred())
+        return false;
+    // An empty synced write flushes the log, and with it every earlier write
+    leveldb::WriteBatch batch;
+    leveldb::WriteOptions options;
+    options.sync = true;
+    leveldb::Status status = txdb->Write(options, &batch);
+    if (!status.ok())
+        return error("CTxDB::Sync() : LevelDB sync failure: %s", status.ToString().c_str());
+    return true;
+}
+
+uint64_t CTxDB::GetDeferredSize()
+{
+    LOCK(cs_deferred);
+    return deferredBatch.GetBytes();
+}
 
 // When performing a read, if we have an active batch we need to check it first
 // before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
+// a database transaction begins reads are consistent with it. The same goes
+// for commits that are still being deferred. Batches keep a hash index of
+// their keys, so each is a single lookup rather than a scan.
 bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
-    assert(activeBatch);
     *deleted = false;
-    CBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status status = activeBatch->Iterate(&scanner);
-    if (!status.ok()) {
-        throw runtime_error(status.ToString());
-    }
-    return scanner.foundEntry;
+    if (activeBatch && activeBatch->Find(key.str(), value, deleted))
+        return true;
+
+    LOCK(cs_deferred);
+    if (deferredBatch.empty())
+        return false;
+    return deferredBatch.Find(key.str(), value, deleted);
 }
 
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 {
     assert(!fClient);
     txindex.SetNull();
-    return Read(make_pair(string("tx"), hash), txindex);
+
+    // Changes made in this transaction come first, then committed state
+    if (activeBatch)
+    {
+        map<uint256, CTxIndex>::iterator mi = mapPendingTxIndex.find(hash);
+        if (mi != mapPendingTxIndex.end())
+        {
+            txindex = mi->second;
+            return !txindex.IsNull();
+        }
+    }
+    if (txdbcache.GetTxIndex(hash, txindex))
+        return true;
+
+    uint64_t nSequence = txdbcache.GetSequence();
+    if (!Read(make_pair(string("tx"), hash), txindex))
+        return false;
+    txdbcache.FillTxIndex(hash, txindex, nSequence);
+    return true;
 }
 
 bool CTxDB::UpdateTxIndex(uint256 hash, const CTxIndex& txindex)
 {
     assert(!fClient);
-    return Write(make_pair(string("tx"), hash), txindex);
+    if (!Write(make_pair(string("tx"), hash), txindex))
+        return false;
+    if (activeBatch)
+        mapPendingTxIndex[hash] = txindex;
+    else
+        txdbcache.Apply(map<uint256, CTxIndex>{{hash, txindex}}, map<uint256, CCoins>());
+    return true;
 }
 
 bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight)
@@ -218,7 +459,7 @@ bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeigh
     // Add to tx index
     uint256 hash = tx.GetHash();
     CTxIndex txindex(pos, tx.vout.size());
-    return Write(make_pair(string("tx"), hash), txindex);
+    return UpdateTxIndex(hash, txindex);
 }
 
 bool CTxDB::EraseTxIndex(const CTransaction& tx)
@@ -226,15 +467,137 @@ bool CTxDB::EraseTxIndex(const CTransaction& tx)
     assert(!fClient);
     uint256 hash = tx.GetHash();
 
-    return Erase(make_pair(string("tx"), hash));
+    if (!Erase(make_pair(string("tx"), hash)))
+        return false;
+    if (activeBatch)
+        mapPendingTxIndex[hash] = CTxIndex();
+    else
+        txdbcache.Apply(map<uint256, CTxIndex>{{hash, CTxIndex()}}, map<uint256, CCoins>());
+    return true;
 }
 
 bool CTxDB::ContainsTx(uint256 hash)
 {
     assert(!fClient);
+    if (activeBatch)
+    {
+        map<uint256, CTxIndex>::iterator mi = mapPendingTxIndex.find(hash);
+        if (mi != mapPendingTxIndex.end())
+            return !mi->second.IsNull();
+    }
+    CTxIndex txindex;
+    if (txdbcache.GetTxIndex(hash, txindex))
+        return true;
     return Exists(make_pair(string("tx"), hash));
 }
 
+// Returns the outputs of a transaction whether or not they are spent. The
+// "coins" table only keeps transactions with unspent outputs, so anything
+// else is rebuilt from the block files and cached.
+bool CTxDB::ReadCoins(uint256 hash, CCoins& coins)
+{
+    assert(!fClient);
+    coins.SetNull();
+
+    bool fErased = false;
+    if (activeBatch)
+    {
+        map<uint256, CCoins>::iterator mi = mapPendingCoins.find(hash);
+        if (mi != mapPendingCoins.end())
+        {
+            if (!mi->second.IsNull())
+            {
+                coins = mi->second;
+                return true;
+            }
+            fErased = true;
+        }
+    }
+    if (!fErased && txdbcache.GetCoins(hash, coins))
+        return true;
+
+    uint64_t nSequence = txdbcache.GetSequence();
+    if (!fErased && Read(make_pair(string("coins"), hash), coins))
+    {
+        txdbcache.FillCoins(hash, coins, nSequence);
+        return true;
+    }
+
+    CTxIndex txindex;
+    CTransaction tx;
+    if (!ReadTxIndex(hash, txindex) || !tx.ReadFromDisk(txindex.pos))
+        return false;
+    coins = CCoins(tx);
+    txdbcache.FillCoins(hash, coins, nSequence);
+    return true;
+}
+
+bool CTxDB::WriteCoins(uint256 hash, const CCoins& coins)
+{
+    assert(!fClient);
+    if (!Write(make_pair(string("coins"), hash), coins))
+        return false;
+    if (activeBatch)
+        mapPendingCoins[hash] = coins;
+    else
+        txdbcache.Apply(map<uint256, CTxIndex>(), map<uint256, CCoins>{{hash, coins}});
+    return true;
+}
+
+bool CTxDB::EraseCoins(uint256 hash)
+{
+    assert(!fClient);
+    if (!Erase(make_pair(string("coins"), hash)))
+        return false;
+    if (activeBatch)
+        mapPendingCoins[hash] = CCoins();
+    else
+        txdbcache.Apply(map<uint256, CTxIndex>(), map<uint256, CCoins>{{hash, CCoins()}});
+    return true;
+}
+
+// Unlike ReadCoins, only true if the coins table itself has the record
+bool CTxDB::ContainsCoins(uint256 hash)
+{
+    assert(!fClient);
+    return Exists(make_pair(string("coins"), hash));
+}
+
+bool CTxDB::ReadBlockUndo(uint256 hash, CBlockUndo& undo)
+{
+    return Read(make_pair(string("undo"), hash), undo);
+}
+
+bool CTxDB::WriteBlockUndo(uint256 hash, const CBlockUndo& undo)
+{
+    return Write(make_pair(string("undo"), hash), undo);
+}
+
+bool CTxDB::EraseBlockUndo(uint256 hash)
+{
+    return Erase(make_pair(string("undo"), hash));
+}
+
+bool CTxDB::ReadLastPrunedFile(unsigned int& nFile)
+{
+    return Read(string("nLastPrunedFile"), nFile);
+}
+
+bool CTxDB::WriteLastPrunedFile(unsigned int nFile)
+{
+    return Write(string("nLastPrunedFile"), nFile);
+}
+
+bool CTxDB::ReadBlocksCompressed(bool& fCompressed)
+{
+    return Read(string("fBlocksCompressed"), fCompressed);
+}
+
+bool CTxDB::WriteBlocksCompressed(bool fCompressed)
+{
+    return Write(string("fBlocksCompressed"), fCompressed);
+}
+
 bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex)
 {
     assert(!fClient);
@@ -312,98 +675,447 @@ static CBlockIndex *InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new(nothrow) CBlockIndex();
-    if (!pindexNew)
+    void* pmem = blockIndexArena.Allocate();
+    if (!pmem)
         throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = new(pmem) CBlockIndex();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
-bool CTxDB::LoadBlockIndex()
+/** One "blockindex" record handed to a LoadBlockIndex worker: deserializes
+ * the value into its slot of the current window and hashes the header.
+ */
+class CBlockIndexDecode
 {
-    if (mapBlockIndex.size() > 0) {
-        // Already loaded once in this session. It can happen during migration
-        // from BDB.
+private:
+    std::string strValue;
+    CDiskBlockIndex* pdiskindex;
+
+public:
+    CBlockIndexDecode() : pdiskindex(NULL) {}
+    CBlockIndexDecode(const leveldb::Slice& value, CDiskBlockIndex* pdiskindexIn) :
+        strValue(value.data(), value.size()), pdiskindex(pdiskindexIn) {}
+
+    bool operator()()
+    {
+        try {
+            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> *pdiskindex;
+        } catch (std::exception &e) {
+            return error("LoadBlockIndex() : deserialize error: %s", e.what());
+        }
+        // Computes and caches the hash unless -fastindex can use the stored one
+        pdiskindex->GetBlockHash();
         return true;
     }
-    // The block index is an in-memory structure that maps hashes to on-disk
-    // locations where the contents of the block can be found. Here, we scan it
-    // out of the DB and into mapBlockIndex.
-    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+
+    void swap(CBlockIndexDecode& check)
+    {
+        strValue.swap(check.strValue);
+        std::swap(pdiskindex, check.pdiskindex);
+    }
+};
+
+/** Link a decoded record into mapBlockIndex. */
+static bool LinkBlockIndex(CDiskBlockIndex& diskindex)
+{
+    uint256 blockHash = diskindex.GetBlockHash();
+
+    // Construct block index object
+    CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
+    pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+    pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
+    pindexNew->nFile          = diskindex.nFile;
+    pindexNew->nBlockPos      = diskindex.nBlockPos;
+    pindexNew->nHeight        = diskindex.nHeight;
+    pindexNew->nMint          = diskindex.nMint;
+    pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+    pindexNew->nFlags         = diskindex.nFlags;
+    pindexNew->nStakeModifier = diskindex.nStakeModifier;
+    pindexNew->prevoutStake   = diskindex.prevoutStake;
+    pindexNew->nStakeTime     = diskindex.nStakeTime;
+    pindexNew->hashProof      = diskindex.hashProof;
+    pindexNew->nVersion       = diskindex.nVersion;
+    pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+    pindexNew->nTime          = diskindex.nTime;
+    pindexNew->nBits          = diskindex.nBits;
+    pindexNew->nNonce         = diskindex.nNonce;
+
+    // Watch for genesis block
+    if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
+        pindexGenesisBlock = pindexNew;
+
+    if (!pindexNew->CheckIndex())
+        return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+
+    // Bitbean: build setStakeSeen
+    if (pindexNew->IsProofOfStake())
+        setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+
+    return true;
+}
+
+/** Scan the "blockindex" records as a three stage pipeline: this thread reads
+ * a window of raw records from the iterator, the check queue workers decode
+ * and hash them, and this thread then links the previous window into
+ * mapBlockIndex while the workers are busy with the next one.
+ */
+static bool ReadBlockIndexRecords(leveldb::Iterator* iterator, CCheckQueue<CBlockIndexDecode>& queue)
+{
+    static const unsigned int nWindow = 8192;
+    int64_t nTimeRead = 0, nTimeDecode = 0, nTimeLink = 0;
+    unsigned int nRecords = 0;
+
     // Seek to start key.
     CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
     ssStartKey << make_pair(string("blockindex"), uint256(0));
     iterator->Seek(ssStartKey.str());
-    // Now read each entry.
-    while (iterator->Valid())
+
+    // The workers decode into these, so the control goes after them: it is
+    // destroyed first, waiting for the workers on any early return or throw
+    vector<CDiskBlockIndex> vDecoding, vRead;
+    CCheckQueueControl<CBlockIndexDecode> control(&queue);
+    bool fEnd = false;
+    while (!fEnd || !vDecoding.empty())
     {
         boost::this_thread::interruption_point();
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-        // Unserialize
-        string strType;
-        ssKey >> strType;
-        // Did we reach the end of the data to read?
-        if (strType != "blockindex")
-            break; // if shutdown requested or finished loading block index
-        CDiskBlockIndex diskindex;
-        ssValue >> diskindex;
-
-        uint256 blockHash = diskindex.GetBlockHash();
-
-        // Construct block index object
-        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
-        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-        pindexNew->nFile          = diskindex.nFile;
-        pindexNew->nBlockPos      = diskindex.nBlockPos;
-        pindexNew->nHeight        = diskindex.nHeight;
-        pindexNew->nMint          = diskindex.nMint;
-        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-        pindexNew->nFlags         = diskindex.nFlags;
-        pindexNew->nStakeModifier = diskindex.nStakeModifier;
-        pindexNew->prevoutStake   = diskindex.prevoutStake;
-        pindexNew->nStakeTime     = diskindex.nStakeTime;
-        pindexNew->hashProof      = diskindex.hashProof;
-        pindexNew->nVersion       = diskindex.nVersion;
-        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-        pindexNew->nTime          = diskindex.nTime;
-        pindexNew->nBits          = diskindex.nBits;
-        pindexNew->nNonce         = diskindex.nNonce;
-
-        // Watch for genesis block
-        if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
-            pindexGenesisBlock = pindexNew;
-
-        if (!pindexNew->CheckIndex()) {
-            delete iterator;
-            return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+
+        // Read the next window
+        int64_t nStart = GetTimeMillis();
+        vRead.clear();
+        vector<CBlockIndexDecode> vChecks;
+        if (!fEnd)
+        {
+            vRead.resize(nWindow);
+            vChecks.reserve(nWindow);
+            while (vChecks.size() < nWindow && iterator->Valid())
+            {
+                CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+                ssKey.write(iterator->key().data(), iterator->key().size());
+                string strType;
+                ssKey >> strType;
+                // Did we reach the end of the data to read?
+                if (strType != "blockindex")
+                    break;
+                vChecks.push_back(CBlockIndexDecode(iterator->value(), &vRead[vChecks.size()]));
+                iterator->Next();
+            }
+            fEnd = vChecks.size() < nWindow;
+            vRead.resize(vChecks.size());
+            nRecords += vChecks.size();
+        }
+        nTimeRead += GetTimeMillis() - nStart;
+
+        // Collect the window the workers were decoding and hand them this one
+        nStart = GetTimeMillis();
+        if (!control.Wait())
+            return error("LoadBlockIndex() : failed to decode block index");
+        control.Add(vChecks);
+        nTimeDecode += GetTimeMillis() - nStart;
+
+        // Link the decoded window
+        nStart = GetTimeMillis();
+        for (CDiskBlockIndex& diskindex : vDecoding)
+            if (!LinkBlockIndex(diskindex))
+                return false;
+        vDecoding.swap(vRead);
+        nTimeLink += GetTimeMillis() - nStart;
+    }
+
+    LogPrintf("LoadBlockIndex(): %u records: read %" PRId64 "ms, waiting on decode %" PRId64 "ms, link %" PRId64 "ms\n",
+        nRecords, nTimeRead, nTimeDecode, nTimeLink);
+    return true;
+}
+
+enum
+{
+    VERIFY_OK,
+    VERIFY_BAD,
+    VERIFY_READ_FAILED,
+};
+
+/** Run the -checklevel checks on one block of the best chain. mapBlockPos
+ * maps the disk position of each block being verified to its height.
+ */
+static int VerifyBlock(CTxDB& txdb, CBlockIndex* pindex, int nCheckLevel, const map<pair<unsigned int, unsigned int>, int>& mapBlockPos)
+{
+    int nResult = VERIFY_OK;
+    CBlock block;
+    if (!block.ReadFromDisk(pindex))
+    {
+        error("LoadBlockIndex() : block.ReadFromDisk failed at %d", pindex->nHeight);
+        return VERIFY_READ_FAILED;
+    }
+    // check level 1: verify block validity
+    // check level 7: verify block signature too
+    if (nCheckLevel>0 && !block.CheckBlock(true, true, (nCheckLevel>6)))
+    {
+        LogPrintf("LoadBlockIndex() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+        nResult = VERIFY_BAD;
+    }
+    // check level 2: verify transaction index validity
+    if (nCheckLevel>1)
+    {
+        for (const CTransaction &tx : block.vtx)
+        {
+            uint256 hashTx = tx.GetHash();
+            CTxIndex txindex;
+            if (txdb.ReadTxIndex(hashTx, txindex))
+            {
+                // check level 3: checker transaction hashes
+                if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
+                {
+                    // either an error or a duplicate transaction
+                    CTransaction txFound;
+                    if (!txFound.ReadFromDisk(txindex.pos))
+                    {
+                        LogPrintf("LoadBlockIndex() : *** cannot read mislocated transaction %s\n", hashTx.ToString().c_str());
+                        nResult = VERIFY_BAD;
+                    }
+                    else
+                        if (txFound.GetHash() != hashTx) // not a duplicate tx
+                        {
+                            LogPrintf("LoadBlockIndex(): *** invalid tx position for %s\n", hashTx.ToString().c_str());
+                            nResult = VERIFY_BAD;
+                        }
+                }
+                // check level 4: check whether spent txouts were spent within the main chain
+                unsigned int nOutput = 0;
+                if (nCheckLevel>3)
+                {
+                    for (const CDiskTxPos &txpos : txindex.vSpent)
+                    {
+                        if (!txpos.IsNull())
+                        {
+                            pair<unsigned int, unsigned int> posFind = make_pair(txpos.nFile, txpos.nBlockPos);
+                            map<pair<unsigned int, unsigned int>, int>::const_iterator mi = mapBlockPos.find(posFind);
+                            if (mi == mapBlockPos.end() || mi->second < pindex->nHeight)
+                            {
+                                LogPrintf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str(), hashTx.ToString().c_str());
+                                nResult = VERIFY_BAD;
+                            }
+                            // check level 6: check whether spent txouts were spent by a valid transaction that consume them
+                            if (nCheckLevel>5)
+                            {
+                                CTransaction txSpend;
+                                if (!txSpend.ReadFromDisk(txpos))
+                                {
+                                    LogPrintf("LoadBlockIndex(): *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString().c_str(), nOutput);
+                                    nResult = VERIFY_BAD;
+                                }
+                                else if (!txSpend.CheckTransaction())
+                                {
+                                    LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i is invalid\n", hashTx.ToString().c_str(), nOutput);
+                                    nResult = VERIFY_BAD;
+                                }
+                                else
+                                {
+                                    bool fFound = false;
+                                    for (const CTxIn &txin : txSpend.vin)
+                                        if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
+                                            fFound = true;
+                                    if (!fFound)
+                                    {
+                                        LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i does not spend it\n", hashTx.ToString().c_str(), nOutput);
+                                        nResult = VERIFY_BAD;
+                                    }
+                                }
+                            }
+                        }
+                        nOutput++;
+                    }
+                }
+            }
+            // check level 5: check whether all prevouts are marked spent
+            if (nCheckLevel>4)
+            {
+                 for (const CTxIn &txin : tx.vin)
+                 {
+                      CTxIndex txindex;
+                      if (txdb.ReadTxIndex(txin.prevout.hash, txindex))
+                          if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
+                          {
+                              LogPrintf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString().c_str(), txin.prevout.n, hashTx.ToString().c_str());
+                              nResult = VERIFY_BAD;
+                          }
+                 }
+            }
+        }
+    }
+    return nResult;
+}
+
+/** One block handed to a startup verification worker. */
+class CBlockVerify
+{
+private:
+    CBlockIndex* pindex;
+    int nCheckLevel;
+    const map<pair<unsigned int, unsigned int>, int>* pmapBlockPos;
+    int* pnResult;
+
+public:
+    CBlockVerify() : pindex(NULL), nCheckLevel(0), pmapBlockPos(NULL), pnResult(NULL) {}
+    CBlockVerify(CBlockIndex* pindexIn, int nCheckLevelIn, const map<pair<unsigned int, unsigned int>, int>* pmapBlockPosIn, int* pnResultIn) :
+        pindex(pindexIn), nCheckLevel(nCheckLevelIn), pmapBlockPos(pmapBlockPosIn), pnResult(pnResultIn) {}
+
+    bool operator()()
+    {
+        // The result goes to our own slot rather than the queue, so one bad
+        // block doesn't stop the rest from being checked
+        CTxDB txdb("r");
+        *pnResult = VerifyBlock(txdb, pindex, nCheckLevel, *pmapBlockPos);
+        return true;
+    }
+
+    void swap(CBlockVerify& check)
+    {
+        std::swap(pindex, check.pindex);
+        std::swap(nCheckLevel, check.nCheckLevel);
+        std::swap(pmapBlockPos, check.pmapBlockPos);
+        std::swap(pnResult, check.pnResult);
+    }
+};
+
+bool CTxDB::VerifyBlockIndex(int nCheckLevel, int nCheckDepth, bool fBackground)
+{
+    static const unsigned int nWindow = 64;
+
+    // Snapshot the blocks to check, from the tip down
+    vector<CBlockIndex*> vBlocks;
+    map<pair<unsigned int, unsigned int>, int> mapBlockPos;
+    {
+        LOCK(cs_main);
+        if (nCheckDepth == 0)
+            nCheckDepth = 1000000000; // suffices until the year 19000
+        if (nCheckDepth > nBestHeight)
+            nCheckDepth = nBestHeight;
+        // Older blocks may have been pruned
+        unsigned int nLastPrunedFile = 0;
+        if ((fPruneMode || (ReadLastPrunedFile(nLastPrunedFile) && nLastPrunedFile > 0)) && nCheckDepth > MIN_BLOCKS_TO_KEEP)
+            nCheckDepth = MIN_BLOCKS_TO_KEEP;
+        for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
+        {
+            if (pindex->nHeight < nBestHeight-nCheckDepth)
+                break;
+            vBlocks.push_back(pindex);
+            mapBlockPos[make_pair(pindex->nFile, pindex->nBlockPos)] = pindex->nHeight;
         }
+    }
+    LogPrintf("Verifying last %i blocks at level %i%s\n", nCheckDepth, nCheckLevel, fBackground ? " in the background" : "");
+    int64_t nStart = GetTimeMillis();
+
+    vector<int> vResult(vBlocks.size(), VERIFY_OK);
+    CCheckQueue<CBlockVerify> queue(4);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nScriptCheckThreads - 1; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<CBlockVerify>::Thread, &queue));
+    try {
+        for (unsigned int nFirst = 0; nFirst < vBlocks.size(); nFirst += nWindow)
+        {
+            boost::this_thread::interruption_point();
+            vector<CBlockVerify> vChecks;
+            for (unsigned int i = nFirst; i < vBlocks.size() && i < nFirst + nWindow; i++)
+                vChecks.push_back(CBlockVerify(vBlocks[i], nCheckLevel, &mapBlockPos, &vResult[i]));
+            queue.Add(vChecks);
+            queue.Wait();
+        }
+    } catch (...) {
+        queue.Quit();
+        threadGroup.join_all();
+        throw;
+    }
+    queue.Quit();
+    threadGroup.join_all();
+    LogPrintf("LoadBlockIndex(): verified blocks %" PRId64 "ms\n", GetTimeMillis() - nStart);
+
+    // Same outcome as checking one by one from the tip: a read failure is
+    // fatal, otherwise fall back to the parent of the lowest bad block
+    CBlockIndex* pindexBad = NULL;
+    for (unsigned int i = 0; i < vBlocks.size(); i++)
+    {
+        if (vResult[i] == VERIFY_READ_FAILED)
+            return false;
+        if (vResult[i] == VERIFY_BAD)
+            pindexBad = vBlocks[i];
+    }
+    if (!pindexBad)
+        return true;
 
-        // Bitbean: build setStakeSeen
-        if (pindexNew->IsProofOfStake())
-            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+    boost::this_thread::interruption_point();
+    LOCK(cs_main);
+    if (fBackground)
+    {
+        // The chain may have moved on since the snapshot; only act if the block
+        // is still in it and still fails against the current tip
+        if (!chainActive.Contains(pindexBad))
+            return true;
+        for (int nHeight = pindexBad->nHeight; nHeight <= chainActive.Height(); nHeight++)
+            mapBlockPos[make_pair(chainActive[nHeight]->nFile, chainActive[nHeight]->nBlockPos)] = nHeight;
+        if (VerifyBlock(*this, pindexBad, nCheckLevel, mapBlockPos) != VERIFY_BAD)
+            return true;
+    }
+
+    // Reorg back to the fork
+    CBlockIndex* pindexFork = pindexBad->pprev;
+    LogPrintf("LoadBlockIndex() : *** moving best chain pointer back to block %d\n", pindexFork->nHeight);
+    CBlock block;
+    if (!block.ReadFromDisk(pindexFork))
+        return error("LoadBlockIndex() : block.ReadFromDisk failed");
+    CTxDB txdb;
+    block.SetBestChain(txdb, pindexFork);
+
+    return true;
+}
+
+bool CTxDB::LoadBlockIndex()
+{
+    if (mapBlockIndex.size() > 0) {
+        // Already loaded once in this session. It can happen during migration
+        // from BDB.
+        return true;
+    }
+    int64_t nStart = GetTimeMillis();
+
+    // The block index is an in-memory structure that maps hashes to on-disk
+    // locations where the contents of the block can be found. Here, we scan it
+    // out of the DB and into mapBlockIndex, decoding on the -par worker threads.
+    CCheckQueue<CBlockIndexDecode> queue(128);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nScriptCheckThreads - 1; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<CBlockIndexDecode>::Thread, &queue));
 
-        iterator->Next();
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    bool fLoaded;
+    try {
+        fLoaded = ReadBlockIndexRecords(iterator, queue);
+    } catch (...) {
+        queue.Quit();
+        threadGroup.join_all();
+        delete iterator;
+        throw;
     }
+    queue.Quit();
+    threadGroup.join_all();
     delete iterator;
+    if (!fLoaded)
+        return false;
 
     boost::this_thread::interruption_point();
 
     // Calculate nChainTrust
+    int64_t nStartTrust = GetTimeMillis();
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
-    for (const std::pair<uint256, CBlockIndex*>& item : mapBlockIndex)
+    for (const std::pair<const uint256, CBlockIndex*>& item : mapBlockIndex)
     {
         CBlockIndex* pindex = item.second;
         vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
@@ -418,6 +1130,7 @@ bool CTxDB::LoadBlockIndex()
         if (!CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
             return error("CTxDB::LoadBlockIndex() : Failed stake modifier checkpoint height=%d, modifier=0x%016" PRIx64, pindex->nHeight, pindex->nStakeModifier);
     }
+    LogPrintf("LoadBlockIndex(): chain trust and stake modifier checksums %" PRId64 "ms\n", GetTimeMillis() - nStartTrust);
 
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
@@ -429,6 +1142,7 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
+    chainActive.SetTip(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexBest->nChainTrust;
 
@@ -446,133 +1160,10 @@ bool CTxDB::LoadBlockIndex()
     ReadBestInvalidTrust(bnBestInvalidTrust);
     nBestInvalidTrust = bnBestInvalidTrust.getuint256();
 
-    // Verify blocks in the best chain
-    int nCheckLevel = GetArg("-checklevel", 1);
-    int nCheckDepth = GetArg( "-checkblocks", 600);
-    if (nCheckDepth == 0)
-        nCheckDepth = 1000000000; // suffices until the year 19000
-    if (nCheckDepth > nBestHeight)
-        nCheckDepth = nBestHeight;
-    LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
-    CBlockIndex* pindexFork = NULL;
-    map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
-    for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
-    {
-        boost::this_thread::interruption_point();
-        if (pindex->nHeight < nBestHeight-nCheckDepth)
-            break;
-        CBlock block;
-        if (!block.ReadFromDisk(pindex))
-            return error("LoadBlockIndex() : block.ReadFromDisk failed");
-        // check level 1: verify block validity
-        // check level 7: verify block signature too
-        if (nCheckLevel>0 && !block.CheckBlock(true, true, (nCheckLevel>6)))
-        {
-            LogPrintf("LoadBlockIndex() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
-            pindexFork = pindex->pprev;
-        }
-        // check level 2: verify transaction index validity
-        if (nCheckLevel>1)
-        {
-            pair<unsigned int, unsigned int> pos = make_pair(pindex->nFile, pindex->nBlockPos);
-            mapBlockPos[pos] = pindex;
-            for (const CTransaction &tx : block.vtx)
-            {
-                uint256 hashTx = tx.GetHash();
-                CTxIndex txindex;
-                if (ReadTxIndex(hashTx, txindex))
-                {
-                    // check level 3: checker transaction hashes
-                    if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
-                    {
-                        // either an error or a duplicate transaction
-                        CTransaction txFound;
-                        if (!txFound.ReadFromDisk(txindex.pos))
-                        {
-                            LogPrintf("LoadBlockIndex() : *** cannot read mislocated transaction %s\n", hashTx.ToString().c_str());
-                            pindexFork = pindex->pprev;
-                        }
-                        else
-                            if (txFound.GetHash() != hashTx) // not a duplicate tx
-                            {
-                                LogPrintf("LoadBlockIndex(): *** invalid tx position for %s\n", hashTx.ToString().c_str());
-                                pindexFork = pindex->pprev;
-                            }
-                    }
-                    // check level 4: check whether spent txouts were spent within the main chain
-                    unsigned int nOutput = 0;
-                    if (nCheckLevel>3)
-                    {
-                        for (const CDiskTxPos &txpos : txindex.vSpent)
-                        {
-                            if (!txpos.IsNull())
-                            {
-                                pair<unsigned int, unsigned int> posFind = make_pair(txpos.nFile, txpos.nBlockPos);
-                                if (!mapBlockPos.count(posFind))
-                                {
-                                    LogPrintf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str(), hashTx.ToString().c_str());
-                                    pindexFork = pindex->pprev;
-                                }
-                                // check level 6: check whether spent txouts were spent by a valid transaction that consume them
-                                if (nCheckLevel>5)
-                                {
-                                    CTransaction txSpend;
-                                    if (!txSpend.ReadFromDisk(txpos))
-                                    {
-                                        LogPrintf("LoadBlockIndex(): *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString().c_str(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else if (!txSpend.CheckTransaction())
-                                    {
-                                        LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i is invalid\n", hashTx.ToString().c_str(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else
-                                    {
-                                        bool fFound = false;
-                                        for (const CTxIn &txin : txSpend.vin)
-                                            if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
-                                                fFound = true;
-                                        if (!fFound)
-                                        {
-                                            LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i does not spend it\n", hashTx.ToString().c_str(), nOutput);
-                                            pindexFork = pindex->pprev;
-                                        }
-                                    }
-                                }
-                            }
-                            nOutput++;
-                        }
-                    }
-                }
-                // check level 5: check whether all prevouts are marked spent
-                if (nCheckLevel>4)
-                {
-                     for (const CTxIn &txin : tx.vin)
-                     {
-                          CTxIndex txindex;
-                          if (ReadTxIndex(txin.prevout.hash, txindex))
-                              if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
-                              {
-                                  LogPrintf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString().c_str(), txin.prevout.n, hashTx.ToString().c_str());
-                                  pindexFork = pindex->pprev;
-                              }
-                     }
-                }
-            }
-        }
-    }
-    if (pindexFork)
-    {
-        boost::this_thread::interruption_point();
-        // Reorg back to the fork
-        LogPrintf("LoadBlockIndex() : *** moving best chain pointer back to block %d\n", pindexFork->nHeight);
-        CBlock block;
-        if (!block.ReadFromDisk(pindexFork))
-            return error("LoadBlockIndex() : block.ReadFromDisk failed");
-        CTxDB txdb;
-        block.SetBestChain(txdb, pindexFork);
-    }
+    // Verify blocks in the best chain, or leave it to ThreadVerifyBlockIndex
+    if (!GetBoolArg("-asynccheck", false) && !VerifyBlockIndex(GetArg("-checklevel", 1), GetArg("-checkblocks", 600), false))
+        return false;
 
+    LogPrintf("LoadBlockIndex(): total %" PRId64 "ms\n", GetTimeMillis() - nStart);
     return true;
 }
@@ -8,13 +8,164 @@
 
 #include "main.h"
 
+#include <list>
 #include <map>
 #include <string>
 #include <vector>
+#include <unordered_map>
 
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+/** Pending writes and deletes for the tx database, indexed by key so that
+ * reads inside a CTxDB transaction don't have to walk a whole
+ * leveldb::WriteBatch.  Only the latest write to each key is kept; the batch
+ * that actually goes to disk is built from it by WriteTo().
+ */
+class CTxDBBatch
+{
+private:
+    // key -> (fDeleted, value)
+    std::unordered_map<std::string, std::pair<bool, std::string> > mapWrites;
+
+    // approximate memory used by keys and values
+    uint64_t nBytes;
+
+    std::pair<bool, std::string>& Entry(const std::string& strKey)
+    {
+        std::unordered_map<std::string, std::pair<bool, std::string> >::iterator mi = mapWrites.find(strKey);
+        if (mi == mapWrites.end())
+        {
+            nBytes += strKey.size() + 64;
+            mi = mapWrites.insert(std::make_pair(strKey, std::make_pair(false, std::string()))).first;
+        }
+        nBytes -= mi->second.second.size();
+        return mi->second;
+    }
+
+public:
+    CTxDBBatch() : nBytes(0) {}
+
+    void Put(const std::string& strKey, const std::string& strValue)
+    {
+        std::pair<bool, std::string>& entry = Entry(strKey);
+        entry.first = false;
+        entry.second = strValue;
+        nBytes += strValue.size();
+    }
+
+    void Delete(const std::string& strKey)
+    {
+        std::pair<bool, std::string>& entry = Entry(strKey);
+        entry.first = true;
+        entry.second.clear();
+    }
+
+    // Returns true if the batch touches strKey, and then either sets
+    // *pfDeleted or fills *pstrValue with the pending value.
+    bool Find(const std::string& strKey, std::string* pstrValue, bool* pfDeleted) const
+    {
+        std::unordered_map<std::string, std::pair<bool, std::string> >::const_iterator mi = mapWrites.find(strKey);
+        if (mi == mapWrites.end())
+            return false;
+        *pfDeleted = mi->second.first;
+        if (!*pfDeleted)
+            *pstrValue = mi->second.second;
+        return true;
+    }
+
+    // Apply a later batch on top of this one
+    void Append(const CTxDBBatch& other)
+    {
+        for (const std::pair<const std::string, std::pair<bool, std::string> >& item : other.mapWrites)
+        {
+            if (item.second.first)
+                Delete(item.first);
+            else
+                Put(item.first, item.second.second);
+        }
+    }
+
+    void WriteTo(leveldb::WriteBatch& batch) const
+    {
+        for (const std::pair<const std::string, std::pair<bool, std::string> >& item : mapWrites)
+        {
+            if (item.second.first)
+                batch.Delete(item.first);
+            else
+                batch.Put(item.first, item.second.second);
+        }
+    }
+
+    void Clear()
+    {
+        mapWrites.clear();
+        nBytes = 0;
+    }
+
+    bool empty() const
+    {
+        return mapWrites.empty();
+    }
+
+    size_t size() const
+    {
+        return mapWrites.size();
+    }
+
+    uint64_t GetBytes() const
+    {
+        return nBytes;
+    }
+};
+
+/** In-memory cache of committed tx index and coins records, shared by every
+ * CTxDB instance.  Only state that is known to be on disk goes in here;
+ * changes made inside a CTxDB transaction are kept by that instance and
+ * applied to the cache once the batch has been written. Nothing in it is
+ * dirty, so when full the least recently used records are simply dropped.
+ */
+class CTxDBCache
+{
+private:
+    // Both kinds of record, most recently used first: (is coins, hash)
+    typedef std::list<std::pair<bool, uint256> > list_type;
+
+    CCriticalSection cs;
+    list_type lruEntries;
+    std::map<uint256, std::pair<CTxIndex, list_type::iterator> > mapTxIndex;
+    std::map<uint256, std::pair<CCoins, list_type::iterator> > mapCoins;
+    uint64_t nBytes;
+    uint64_t nMaxBytes;
+
+    // Bumped on every applied change, so a reader that went to disk can tell
+    // whether its result may already be stale.
+    uint64_t nSequence;
+
+    void LimitSize();
+
+public:
+    CTxDBCache() : nBytes(0), nMaxBytes(0), nSequence(0) {}
+
+    void SetMaxSize(uint64_t nMaxBytesIn);
+    uint64_t GetSequence();
+    void Clear();
+
+    bool GetTxIndex(const uint256& hash, CTxIndex& txindex);
+    bool GetCoins(const uint256& hash, CCoins& coins);
+
+    // Insert a value read from disk, unless something changed since nSequenceRead
+    void FillTxIndex(const uint256& hash, const CTxIndex& txindex, uint64_t nSequenceRead);
+    void FillCoins(const uint256& hash, const CCoins& coins, uint64_t nSequenceRead);
+
+    // Apply committed changes; null values stand for erased records
+    void Apply(const std::map<uint256, CTxIndex>& mapTxIndexIn, const std::map<uint256, CCoins>& mapCoinsIn);
+
+    size_t GetCacheSize();
+};
+
+extern CTxDBCache txdbcache;
+
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
 // be very cheap. Unfortunately that means, a CTxDB instance is actually just a
@@ -45,15 +196,26 @@ private:
 
     // A batch stores up writes and deletes for atomic application. When this
     // field is non-NULL, writes/deletes go there instead of directly to disk.
-    leveldb::WriteBatch *activeBatch;
+    CTxDBBatch *activeBatch;
     leveldb::Options options;
     bool fReadOnly;
     int nVersion;
 
+    // Tx index and coins changes made since TxnBegin(), keyed by tx hash.
+    // Null values stand for erased records.
+    std::map<uint256, CTxIndex> mapPendingTxIndex;
+    std::map<uint256, CCoins> mapPendingCoins;
+
+    // Writes a batch to disk, or into the deferred batch while commits are
+    // being deferred.
+    bool CommitBatch(const CTxDBBatch& batch);
+
+    static bool HaveDeferred();
+
 protected:
-    // Returns true and sets (value,false) if activeBatch contains the given key
-    // or leaves value alone and sets deleted = true if activeBatch contains a
-    // delete for it.
+    // Returns true and sets (value,false) if activeBatch or the deferred batch
+    // contains the given key or leaves value alone and sets deleted = true if
+    // they contain a delete for it.
     bool ScanBatch(const CDataStream &key, std::string *value, bool *deleted) const;
 
     template<typename K, typename T>
@@ -64,15 +226,12 @@ protected:
         ssKey << key;
         std::string strValue;
 
-        bool readFromDb = true;
-        if (activeBatch) {
-            // First we must search for it in the currently pending set of
-            // changes to the db. If not found in the batch, go on to read disk.
-            bool deleted = false;
-            readFromDb = ScanBatch(ssKey, &strValue, &deleted) == false;
-            if (deleted) {
-                return false;
-            }
+        // First we must search for it in the currently pending set of
+        // changes to the db. If not found in the batch, go on to read disk.
+        bool deleted = false;
+        bool readFromDb = ScanBatch(ssKey, &strValue, &deleted) == false;
+        if (deleted) {
+            return false;
         }
         if (readFromDb) {
             leveldb::Status status = pdb->Get(leveldb::ReadOptions(),
@@ -114,6 +273,12 @@ protected:
             activeBatch->Put(ssKey.str(), ssValue.str());
             return true;
         }
+        if (HaveDeferred()) {
+            // Must not be overtaken by older deferred writes
+            CTxDBBatch batch;
+            batch.Put(ssKey.str(), ssValue.str());
+            return CommitBatch(batch);
+        }
         leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
         if (!status.ok()) {
             printf("LevelDB write failure: %s\n", status.ToString().c_str());
@@ -137,6 +302,11 @@ protected:
             activeBatch->Delete(ssKey.str());
             return true;
         }
+        if (HaveDeferred()) {
+            CTxDBBatch batch;
+            batch.Delete(ssKey.str());
+            return CommitBatch(batch);
+        }
         leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
         return (status.ok() || status.IsNotFound());
     }
@@ -149,13 +319,9 @@ protected:
         ssKey << key;
         std::string unused;
 
-        if (activeBatch) {
-            bool deleted;
-            if (ScanBatch(ssKey, &unused, &deleted) && !deleted) {
-                return true;
-            }
-        }
-
+        bool deleted;
+        if (ScanBatch(ssKey, &unused, &deleted))
+            return !deleted;
 
         leveldb::Status status = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &unused);
         return status.IsNotFound() == false;
@@ -163,12 +329,25 @@ protected:
 
 
 public:
+    // While commits are deferred (during initial block download), TxnCommit()
+    // only merges the batch into one shared in-memory batch. That is written
+    // atomically once it outgrows its share of -dbcache, when deferring is
+    // switched off, or by an explicit FlushDeferred() at shutdown. Switching
+    // it off fails, and keeps deferring, if that write fails.
+    static bool SetDeferCommit(bool fDefer);
+    static bool FlushDeferred();
+    /** Write any deferred commits and sync everything committed so far to disk. */
+    static bool Sync();
+    static uint64_t GetDeferredSize();
+
     bool TxnBegin();
     bool TxnCommit();
     bool TxnAbort()
     {
         delete activeBatch;
         activeBatch = NULL;
+        mapPendingTxIndex.clear();
+        mapPendingCoins.clear();
         return true;
     }
 
@@ -188,6 +367,17 @@ public:
     bool AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight);
     bool EraseTxIndex(const CTransaction& tx);
     bool ContainsTx(uint256 hash);
+    bool ReadCoins(uint256 hash, CCoins& coins);
+    bool WriteCoins(uint256 hash, const CCoins& coins);
+    bool EraseCoins(uint256 hash);
+    bool ContainsCoins(uint256 hash);
+    bool ReadBlockUndo(uint256 hash, CBlockUndo& undo);
+    bool WriteBlockUndo(uint256 hash, const CBlockUndo& undo);
+    bool EraseBlockUndo(uint256 hash);
+    bool ReadLastPrunedFile(unsigned int& nFile);
+    bool WriteLastPrunedFile(unsigned int nFile);
+    bool ReadBlocksCompressed(bool& fCompressed);
+    bool WriteBlocksCompressed(bool fCompressed);
     bool ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(uint256 hash, CTransaction& tx);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex);
@@ -202,6 +392,9 @@ public:
     bool ReadCheckpointPubKey(std::string& strPubKey);
     bool WriteCheckpointPubKey(const std::string& strPubKey);
     bool LoadBlockIndex();
+    /** Check the last nCheckDepth best chain blocks at nCheckLevel on the -par
+     * workers, and move the best chain back before the lowest bad one. */
+    bool VerifyBlockIndex(int nCheckLevel, int nCheckDepth, bool fBackground);
 private:
     bool LoadBlockIndexGuts();
 };
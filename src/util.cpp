@@ -61,6 +61,7 @@ namespace boost {
 #include "shlobj.h"
 #elif defined(__linux__)
 # include <sys/prctl.h>
+# include <fcntl.h>
 #endif
 
 #ifndef WIN32
@@ -1173,6 +1174,38 @@ void FileCommit(FILE *fileout)
 #endif
 }
 
+/** Reserve disk space for [nOffset, nOffset + nLength) without changing the
+ * file size, so appends don't fragment the file. Best effort: a no-op where
+ * the filesystem or platform can't do it.
+ */
+void PreallocateFile(FILE *file, unsigned int nOffset, unsigned int nLength)
+{
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+    fallocate(fileno(file), FALLOC_FL_KEEP_SIZE, nOffset, nLength);
+#elif defined(MAC_OSX)
+    fstore_t fst;
+    fst.fst_flags = F_ALLOCATECONTIG;
+    fst.fst_posmode = F_PEOFPOSMODE;
+    fst.fst_offset = 0;
+    fst.fst_length = (off_t)nOffset + nLength;
+    fst.fst_bytesalloc = 0;
+    if (fcntl(fileno(file), F_PREALLOCATE, &fst) == -1)
+    {
+        fst.fst_flags = F_ALLOCATEALL;
+        fcntl(fileno(file), F_PREALLOCATE, &fst);
+    }
+#endif
+}
+
+bool TruncateFile(FILE *file, unsigned int nLength)
+{
+#ifdef WIN32
+    return _chsize(_fileno(file), nLength) == 0;
+#else
+    return ftruncate(fileno(file), nLength) == 0;
+#endif
+}
+
 void ShrinkDebugFile()
 {
     // Scroll debug.log if it's getting too big
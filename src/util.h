@@ -194,6 +194,8 @@ void ParseParameters(int argc, const char*const argv[]);
 bool WildcardMatch(const char* psz, const char* mask);
 bool WildcardMatch(const std::string& str, const std::string& mask);
 void FileCommit(FILE *fileout);
+void PreallocateFile(FILE *file, unsigned int nOffset, unsigned int nLength);
+bool TruncateFile(FILE *file, unsigned int nLength);
 bool RenameOver(boost::filesystem::path src, boost::filesystem::path dest);
 int RaiseFileDescriptorLimit(int nMinFD);
 boost::filesystem::path GetDefaultDataDir();
@@ -850,6 +850,12 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
                 continue;
             }
 
+            // Pruned blocks are gone
+            if (IsBlockFilePruned(pindex->nFile)) {
+                pindex = pindex->pnext;
+                continue;
+            }
+
             CBlock block;
             block.ReadFromDisk(pindex, true);
             for (CTransaction& tx : block.vtx)
@@ -1857,9 +1863,10 @@ bool CWallet::CreateBeanStake(const CKeyStore& keystore, unsigned int nBits, int
         CBlock block;
         {
             LOCK2(cs_main, cs_wallet);
-            if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+            if (!ReadBlockHeader(txindex.pos.nFile, txindex.pos.nBlockPos, block))
                 continue;
         }
+        CCoins coinsPrev(*pbean.first);
 
         static int nMaxStakeSearchInterval = 60;
         if (block.GetBlockTime() + nStakeMinAge > txNew.nTime - nMaxStakeSearchInterval)
@@ -1873,7 +1880,7 @@ bool CWallet::CreateBeanStake(const CKeyStore& keystore, unsigned int nBits, int
             // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
             uint256 hashProofOfStake = 0, targetProofOfStake = 0;
             COutPoint prevoutStake = COutPoint(pbean.first->GetHash(), pbean.second);
-            if (CheckStakeKernelHash(nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, *pbean.first, prevoutStake, txNew.nTime - n, hashProofOfStake, targetProofOfStake))
+            if (CheckStakeKernelHash(nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, coinsPrev, prevoutStake, txNew.nTime - n, hashProofOfStake, targetProofOfStake))
             {
                 // Found a kernel
                 LogPrint("Bean Sprout", "CreateBeanSprout : kernel found\n");
@@ -1976,6 +1983,7 @@ bool CWallet::CreateBeanStake(const CKeyStore& keystore, unsigned int nBits, int
     {
         uint64_t nBeanAge;
         CTxDB txdb("r");
+        LOCK2(cs_main, cs_wallet);
         if (!txNew.GetBeanAge(txdb, nBeanAge))
             return error("CreateBeanStake : failed to calculate bean age");
 
@@ -2716,7 +2724,7 @@ void CWallet::GetKeyBirthTimes(std::map<CKeyID, int64_t> &mapKeyBirth) const {
     for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); it++) {
         // iterate over all wallet transactions...
         const CWalletTx &wtx = (*it).second;
-        std::map<uint256, CBlockIndex*>::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
+        BlockMap::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
         if (blit != mapBlockIndex.end() && blit->second->IsInMainChain()) {
             // ... which are already in a block
             int nHeight = blit->second->nHeight;